@@ -0,0 +1,225 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Display mode writes in background.
+ *
+ * Writing display mode and HDCP mode may block in hdmitx driver for
+ * hundreds of milliseconds, so the main loop only plans the switch
+ * and a worker thread does the writes. There's at most one queued
+ * plan: a newer one replaces it, so a burst of switch requests ends
+ * up in just the last one. Results are passed back through a small
+ * single-producer single-consumer ring, and an eventfd wakes up the
+ * main loop.
+ */
+
+#include "afrd.h"
+#include "actuator.h"
+#include "capture.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+// number of results in ring, must be a power of two
+#define RESULT_RING		4
+
+static pthread_t g_act_thread;
+static bool g_act_threaded = false;
+// wakes up the main loop when plans complete
+static int g_act_done_fd = -1;
+
+// protects everything below up to the ring
+static pthread_mutex_t g_act_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a plan is queued, or when worker becomes idle
+static pthread_cond_t g_act_cond = PTHREAD_COND_INITIALIZER;
+static display_plan_t g_act_plan;
+static bool g_act_pending;
+static bool g_act_running;
+static bool g_act_quit;
+
+static atomic_uint g_act_superseded;
+
+// the ring: producer advances head, consumer advances tail
+static actuator_result_t g_act_ring [RESULT_RING];
+static atomic_uint g_act_head;
+static atomic_uint g_act_tail;
+
+static void actuator_run (const display_plan_t *plan)
+{
+	unsigned head = atomic_load_explicit (&g_act_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit (&g_act_tail, memory_order_acquire);
+
+	actuator_result_t res;
+	memset (&res, 0, sizeof (res));
+	res.start = mstime_get ();
+	res.switched = display_plan_run (plan, &res.steps);
+
+	if (head - tail >= RESULT_RING) {
+		trace (2, "actuator result queue full, dropping result\n");
+		return;
+	}
+
+	g_act_ring [head & (RESULT_RING - 1)] = res;
+	atomic_store_explicit (&g_act_head, head + 1, memory_order_release);
+}
+
+static void *actuator_worker (void *arg)
+{
+	pthread_mutex_lock (&g_act_lock);
+	for (;;) {
+		while (!g_act_pending && !g_act_quit)
+			pthread_cond_wait (&g_act_cond, &g_act_lock);
+		if (!g_act_pending)
+			break;
+
+		display_plan_t plan = g_act_plan;
+		g_act_pending = false;
+		g_act_running = true;
+		pthread_mutex_unlock (&g_act_lock);
+
+		actuator_run (&plan);
+
+		pthread_mutex_lock (&g_act_lock);
+		g_act_running = false;
+		pthread_cond_broadcast (&g_act_cond);
+
+		// wake main loop up when it can see we're idle
+		uint64_t val = 1;
+		write (g_act_done_fd, &val, sizeof (val));
+	}
+	pthread_mutex_unlock (&g_act_lock);
+
+	return NULL;
+}
+
+bool actuator_init ()
+{
+	g_act_pending = false;
+	g_act_running = false;
+	g_act_quit = false;
+	atomic_store (&g_act_head, 0);
+	atomic_store (&g_act_tail, 0);
+
+	// replay must be deterministic, so write synchronously
+	if (g_replay)
+		return true;
+
+	g_act_done_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((g_act_done_fd < 0) ||
+	    (pthread_create (&g_act_thread, NULL, actuator_worker, NULL) != 0)) {
+		trace (0, "failed to start actuator thread, switching synchronously\n");
+		actuator_fini ();
+		return false;
+	}
+
+	g_act_threaded = true;
+	return true;
+}
+
+void actuator_fini ()
+{
+	if (g_act_threaded) {
+		// the last plan usually restores display mode, let it finish
+		pthread_mutex_lock (&g_act_lock);
+		g_act_quit = true;
+		pthread_cond_broadcast (&g_act_cond);
+		pthread_mutex_unlock (&g_act_lock);
+		pthread_join (g_act_thread, NULL);
+		g_act_threaded = false;
+	}
+
+	if (g_act_done_fd >= 0) {
+		close (g_act_done_fd);
+		g_act_done_fd = -1;
+	}
+}
+
+void actuator_detach ()
+{
+	g_act_threaded = false;
+}
+
+int actuator_fd ()
+{
+	return g_act_threaded ? g_act_done_fd : -1;
+}
+
+void actuator_submit (const display_plan_t *plan)
+{
+	if (!g_act_threaded) {
+		actuator_run (plan);
+		return;
+	}
+
+	pthread_mutex_lock (&g_act_lock);
+	// a queued switch writes HDCP mode after the display mode anyway,
+	// and there's no point in it before the screen is disabled
+	if (g_act_pending && plan->hdcp_only) {
+		if (g_act_plan.mode.name [0] || g_act_plan.hdcp_only) {
+			trace (2, "merging HDCP write into queued display plan\n");
+			g_act_plan.hdcp = plan->hdcp;
+			g_act_plan.hdcp_restart |= plan->hdcp_restart;
+		}
+		pthread_mutex_unlock (&g_act_lock);
+		return;
+	}
+
+	if (g_act_pending) {
+		trace (2, "replacing queued display plan\n");
+		atomic_fetch_add (&g_act_superseded, 1);
+	}
+	g_act_plan = *plan;
+	g_act_pending = true;
+	pthread_cond_broadcast (&g_act_cond);
+	pthread_mutex_unlock (&g_act_lock);
+}
+
+bool actuator_busy ()
+{
+	if (!g_act_threaded)
+		return false;
+
+	pthread_mutex_lock (&g_act_lock);
+	bool busy = g_act_pending || g_act_running;
+	pthread_mutex_unlock (&g_act_lock);
+	return busy;
+}
+
+void actuator_wait ()
+{
+	if (!g_act_threaded)
+		return;
+
+	pthread_mutex_lock (&g_act_lock);
+	while (g_act_pending || g_act_running)
+		pthread_cond_wait (&g_act_cond, &g_act_lock);
+	pthread_mutex_unlock (&g_act_lock);
+}
+
+void actuator_ack ()
+{
+	uint64_t val;
+	if (g_act_threaded)
+		read (g_act_done_fd, &val, sizeof (val));
+}
+
+bool actuator_get (actuator_result_t *res)
+{
+	unsigned tail = atomic_load_explicit (&g_act_tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit (&g_act_head, memory_order_acquire);
+	if (tail == head)
+		return false;
+
+	*res = g_act_ring [tail & (RESULT_RING - 1)];
+	atomic_store_explicit (&g_act_tail, tail + 1, memory_order_release);
+	return true;
+}
+
+uint32_t actuator_superseded ()
+{
+	return atomic_load_explicit (&g_act_superseded, memory_order_relaxed);
+}
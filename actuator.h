@@ -0,0 +1,51 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Display mode writes in background
+ */
+
+#ifndef __ACTUATOR_H__
+#define __ACTUATOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "afrd.h"
+
+/// the outcome of a display plan
+typedef struct
+{
+	/// true if a display mode was written, false if the screen was just blanked
+	bool switched;
+	/// when the writes started (mstime_get () time)
+	mstime_t start;
+	/// how long every write took
+	latency_steps_t steps;
+} actuator_result_t;
+
+/// start the actuator thread, false if plans will run synchronously
+extern bool actuator_init ();
+/// finish the queued plan and stop the thread
+extern void actuator_fini ();
+/// stop using the thread without waiting for it (emergency)
+extern void actuator_detach ();
+/// the eventfd that becomes readable when plans complete, -1 if not threaded
+extern int actuator_fd ();
+/// queue a display plan, replaces the queued plan that has not started yet;
+/// a plan that only writes HDCP mode is merged into the queued one instead
+extern void actuator_submit (const display_plan_t *plan);
+/// true while a plan is queued or running
+extern bool actuator_busy ();
+/// wait until the queued plans complete, must be called before tearing
+/// down the attributes the plans write
+extern void actuator_wait ();
+/// acknowledge the eventfd wakeup
+extern void actuator_ack ();
+/// get the next completed plan result, false if none
+extern bool actuator_get (actuator_result_t *res);
+/// number of plans replaced before they could run
+extern uint32_t actuator_superseded ();
+
+#endif /* __ACTUATOR_H__ */
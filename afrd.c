@@ -9,6 +9,15 @@
 #include "uevent_filter.h"
 #include "colorspace.h"
 #include "androp.h"
+#include "capture.h"
+#include "ptsest.h"
+#include "sampler.h"
+#include "actuator.h"
+#include "link.h"
+#include "watch.h"
+#include "prior.h"
+#include "fusion.h"
+#include "sim.h"
 
 #define __USE_GNU
 #include <unistd.h>
@@ -17,6 +26,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <time.h>
 
 #ifndef SOCK_CLOEXEC
 #  define SOCK_CLOEXEC O_CLOEXEC
@@ -29,6 +39,10 @@ const char *g_hdmi_dev = NULL;
 const char *g_mode_path = NULL;
 
 static const char *g_hdmi_state = NULL;
+static const char *g_mode_info = NULL;
+static sysfs_attr_t g_attr_hdmi_state;
+// vdec_status as seen from main thread, sampler has its own handle
+static sysfs_attr_t g_attr_vdec_status;
 static int g_uevent_sock = -1;
 static const char *g_vdec_sysfs = NULL;
 
@@ -39,10 +53,11 @@ static int g_switch_timeout;
 static int g_switch_blackout;
 static int g_switch_ignore;
 static int g_switch_hdmi;
+static int g_switch_link;
 
 static int g_mode_prefer_exact;
 static int g_mode_use_fract;
-static int g_mode_blacklist_rates [10];
+static int *g_mode_blacklist_rates;
 static int g_mode_blacklist_rates_count;
 
 static bool g_enable;                 // enabled in config file
@@ -51,6 +66,15 @@ static uevent_filter_t g_filter_frhint;
 static uevent_filter_t g_filter_vdec;
 static uevent_filter_t g_filter_hdmi;
 static uevent_filter_t g_filter_hdcp;
+// all the above filters compiled together
+static uevent_classifier_t g_classifier;
+
+// hashes of uevent attribute names we're interested in
+static uint32_t g_hash_frame_rate_hint;
+static uint32_t g_hash_frame_rate_end_hint;
+static uint32_t g_hash_action;
+static uint32_t g_hash_modalias;
+static uint32_t g_hash_devpath;
 
 static strlist_t g_vdec_blacklist;
 static strlist_t g_frhint_vdec_blacklist;
@@ -71,6 +95,8 @@ static mstime_t g_ost_switch;
  * link becomes active.
  */
 static mstime_t g_ost_hdmi;
+// the timer has expired while the actuator was busy, handle it when it's done
+static bool g_hdmi_deferred;
 
 /**
  * Screen blackout timer
@@ -88,15 +114,33 @@ static mstime_t g_ost_config;
 static mstime_t g_ost_off;
 
 /**
- * Will re-enable HDCP if getting an "HDCP HDMI off" event
- * during this timer
+ * Next background sample of movie frame rate during playback
  */
-static mstime_t g_ost_hdcp;
+static mstime_t g_ost_monitor;
 
 /**
- * Periodic HDCP sanity check
+ * Next check if display link has come back after a mode switch
  */
-static mstime_t g_ost_hdcp_check;
+static mstime_t g_ost_settle;
+
+// the mode switch being measured
+static struct
+{
+	// the kind of transition
+	switch_type_t type;
+	// when we started writing the new mode
+	mstime_t start;
+	// the latency_now () time of uevent that caused the switch, 0 if none
+	uint64_t trigger;
+	// current link poll interval, ms
+	int poll;
+	// the mode before the switch, to revert to if link does not come back
+	display_mode_t prev;
+	// true if this switch is a revert itself
+	bool reverting;
+} g_settle;
+
+static const char *g_switch_type_name [SWITCH_TYPES] = { "fractional", "refresh rate", "full" };
 
 /**
  * Available sources for fps values
@@ -105,27 +149,40 @@ typedef enum
 {
 	// FRAME_RATE_HINT should be immediately usable
 	SRC_FRH,
-	// dump_vdec_chunks is more reliable than others, only 2 confirmations
+	// dump_vdec_chunks is more reliable than others, weighted by estimator confidence
 	SRC_CHUNKS,
-	// dump_vdec_blocks is less reliable, so 3 confirmations
+	// dump_vdec_blocks is less reliable, so 3 confirmations by default
 	SRC_BLOCKS,
-	// need 4 confirmations to accept vdec_status
+	// need 4 confirmations by default to accept vdec_status
 	SRC_VDEC,
 
 	// number of fps sources
 	SRC_COUNT
 } hz_source_t;
 
-static const uint8_t src_weight [SRC_COUNT] =
-{
-	100,	// FRH
-	50,	// CHUNKS
-	34,	// BLOCKS
-	25,	// VDEC
-};
-
-// accept hz when weight sum up to this
-#define ACCEPT_HZ_WEIGHT        100
+_Static_assert (SRC_COUNT == FUSION_SOURCES, "fusion must know every fps source");
+
+// maximal number of poll interval doublings for sources that don't change
+#define POLL_BACKOFF_MAX	3
+
+// in-playback monitor sampling intervals, ms
+#define MONITOR_START		4000
+#define MONITOR_MIN		1000
+#define MONITOR_MAX		32000
+// number of samples in a row needed to believe frame rate has changed
+#define MONITOR_CONFIRM		3
+// how long to watch decoder counters after a switch to judge playback quality, ms
+#define JUDGE_WINDOW		20000
+// playback is bad if this many frames per 1000 were dropped or late
+#define JUDGE_BAD_SCORE		20
+
+// display link poll interval after a mode switch grows from min to max, ms
+#define LINK_POLL_MIN		10
+#define LINK_POLL_MAX		100
+// every that many ms of expected blackout cost one point of mode rating...
+#define SWITCH_COST_UNIT	250
+// ...but less than one step of refresh rate error in total
+#define SWITCH_COST_MAX		15
 
 // minimum sane refresh rate, .8 fixed-point
 #define HZ_MIN		FP8 ( 10,000)
@@ -133,13 +190,15 @@ static const uint8_t src_weight [SRC_COUNT] =
 
 typedef struct
 {
-	// last seen value from this source
-	int hz;
-	// total weight of hz samples
-	int weight;
-	// expiration timer for collecting data from this source
-	mstime_t timeout;
-} hz_stat_t;
+	// when to poll the source next time
+	mstime_t next;
+	// when source data changed last time
+	mstime_t changed;
+	// average interval between source data changes, ms
+	int cadence;
+	// number of polls in a row that brought nothing new
+	int stale;
+} hz_poll_t;
 
 /**
  * Frame rate detector data.
@@ -159,13 +218,53 @@ static struct
 	// hz detection timeout
 	mstime_t hz_ost;
 
-	// we accumulate fps data from every source
-	hz_stat_t hz_stat [SRC_COUNT];
+	// we combine fps data from every source
+	fusion_t fusion;
+	// polling schedule for every source
+	hz_poll_t hz_poll [SRC_COUNT];
+	// true if we switched before all sources agreed, hz may be refined
+	bool provisional;
+	// the detected frame rate we've switched provisionally to
+	int provisional_hz;
 
 	// a stamp to detect when dump_vdec_blocks stays still
 	int hz_samples_stamp;
+	// frame rate estimator from dump_vdec_chunks timestamps
+	pts_est_t chunks_est;
+
+	// the source that gave the frame rate we've decided on
+	int hz_src;
+	// prior cache key for current movie, complete when frame size is known
+	prior_key_t prior_key;
+
+	// when the uevent that started playback was received, 0 after we've switched
+	uint64_t trigger_stamp;
+	// when we've started detecting movie frame rate
+	uint64_t detect_stamp;
+
+	// watching for frame rate changes during playback
+	struct
+	{
+		// the movie frame rate we've switched to, 0 if not monitoring
+		int hz;
+		// dump_vdec_blocks stamp of last sample
+		int stamp;
+		// current sampling interval, ms
+		int interval;
+		// a different frame rate seen in a row, and how many times
+		int miss_hz;
+		int misses;
+		// true while judging how well the movie plays on current display mode
+		bool judging;
+		// vdec_status counters at start of judgement, and when they were taken
+		unsigned frames, drops;
+		mstime_t judge_stamp;
+	} monitor;
 } g_state;
 
+// incremented every time detection restarts, to drop stale samples
+static uint32_t g_sample_gen;
+
 /**
  *
  */
@@ -177,36 +276,208 @@ static struct
 	int fps;
 } g_frame_rate_hint;
 
+/**
+ * Content id hint via API
+ */
+static struct
+{
+	// time stamp when this hint was valid
+	mstime_t stamp;
+	// hash of content id
+	uint32_t id;
+} g_content_id_hint;
 
-static bool uevent_open (int buf_sz)
+// max number of video decoders we track at once
+#define VDEC_MAX		8
+
+/**
+ * Active video decoders, keyed by uevent DEVPATH. Only the primary
+ * decoder drives the refresh rate, the others (previews, picture-in-picture,
+ * decoders opened by player during seeks) are just counted.
+ */
+static struct
+{
+	struct
+	{
+		// DEVPATH of decoder device, empty if found via sysfs on resync
+		char devpath [64];
+		// decoder driver name
+		char modalias [32];
+		// number of "add" events not paired with "remove" yet
+		int refs;
+		// decoders are ordered by age
+		uint32_t serial;
+	} dec [VDEC_MAX];
+	// number of active decoders
+	int count;
+	// index of primary decoder, -1 if none
+	int primary;
+	// incremented on every new decoder
+	uint32_t serial;
+} g_vdec = { .primary = -1 };
+
+
+/**
+ * Sequence number of last received uevent. The kernel numbers every
+ * uevent it emits, so the gap between consecutive SEQNUMs we receive
+ * is the number of uevents that didn't pass our socket filter.
+ */
+static unsigned long long g_uevent_seqnum;
+// true if kernel-side socket filter is active
+static bool g_uevent_filtered;
+// set when socket overflow happened, next SEQNUM gap includes lost uevents
+static bool g_uevent_overflow;
+// set when some uevents were lost and state must be read from sysfs
+static bool g_resync;
+
+// max number of uevents received with a single syscall
+#define UEVENT_BATCH		16
+// max uevent size (kernel limit is 2048 bytes)
+#define UEVENT_MAX_SIZE		4096
+// approximate socket buffer space occupied by one uevent
+#define UEVENT_SKB_SIZE		4096
+// socket receive buffer size limits
+#define UEVENT_RCVBUF_MIN	(16 * 1024)
+#define UEVENT_RCVBUF_MAX	(1024 * 1024)
+
+// uevent receive buffers
+static struct uevent_batch_t
+{
+	char msg [UEVENT_BATCH][UEVENT_MAX_SIZE];
+	struct sockaddr_nl addr [UEVENT_BATCH];
+	struct iovec iov [UEVENT_BATCH];
+	union {
+		struct cmsghdr cmsghdr;
+		uint8_t buf [CMSG_SPACE (sizeof (struct ucred)) +
+			CMSG_SPACE (sizeof (struct timespec))];
+	} control [UEVENT_BATCH];
+	struct mmsghdr hdr [UEVENT_BATCH];
+} g_uevent_batch;
+
+// current socket receive buffer size
+static int g_uevent_rcvbuf;
+// when the uevent being handled was received (latency_now () time), 0 if none
+static uint64_t g_uevent_stamp;
+
+// set uevent socket receive buffer size
+static void uevent_rcvbuf (int buf_sz)
+{
+	if (buf_sz < UEVENT_RCVBUF_MIN)
+		buf_sz = UEVENT_RCVBUF_MIN;
+	if (buf_sz > UEVENT_RCVBUF_MAX)
+		buf_sz = UEVENT_RCVBUF_MAX;
+	if (buf_sz == g_uevent_rcvbuf)
+		return;
+
+	if (setsockopt (g_uevent_sock, SOL_SOCKET, SO_RCVBUFFORCE, &buf_sz, sizeof (buf_sz)) < 0)
+		setsockopt (g_uevent_sock, SOL_SOCKET, SO_RCVBUF, &buf_sz, sizeof (buf_sz));
+
+	if (g_uevent_rcvbuf)
+		trace (1, "uevent socket buffer size %d -> %d\n", g_uevent_rcvbuf, buf_sz);
+	g_uevent_rcvbuf = buf_sz;
+}
+
+// open the kernel uevent netlink socket
+static int uevent_netlink_open ()
 {
 	struct sockaddr_nl addr;
 
 	memset (&addr, 0, sizeof (addr));
 	addr.nl_family = AF_NETLINK;
 	addr.nl_pid = getpid ();
-	addr.nl_groups = 0xffffffff;
+	// kernel uevents only, we don't need udev re-broadcasts
+	addr.nl_groups = 1;
+
+	int sock = socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (sock < 0)
+		return -1;
+
+	if (bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		close (sock);
+		return -1;
+	}
+
+	return sock;
+}
 
-	g_uevent_sock = socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+static bool uevent_open (int buf_sz)
+{
+	// the simulated device sends uevents through a socket of its own
+	g_uevent_sock = g_sim ? sim_uevent_open () : uevent_netlink_open ();
 	if (g_uevent_sock < 0)
 		return false;
 
-	setsockopt (g_uevent_sock, SOL_SOCKET, SO_RCVBUFFORCE, &buf_sz, sizeof (buf_sz));
+	g_uevent_rcvbuf = 0;
+	uevent_rcvbuf (buf_sz);
 
 	int one = 1;
 	setsockopt (g_uevent_sock, SOL_SOCKET, SO_PASSCRED, &one, sizeof (one));
-
-	if (bind (g_uevent_sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
-		close (g_uevent_sock);
-		g_uevent_sock = -1;
-		return false;
-	}
+	// to know how long uevents wait in socket buffer
+	setsockopt (g_uevent_sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof (one));
 
 	fcntl (g_uevent_sock, F_SETFL, O_NONBLOCK);
 
+	g_uevent_seqnum = 0;
+	g_uevent_filtered = false;
+	g_uevent_overflow = false;
 	return true;
 }
 
+// make kernel drop uevents that won't pass our filters
+static void uevent_attach_filter ()
+{
+	struct sock_filter prog [256];
+	int n = uevent_classifier_bpf (&g_classifier, prog, ARRAY_SIZE (prog));
+	if (!n) {
+		trace (1, "	uevent filters can't be done in kernel, receiving all uevents\n");
+		return;
+	}
+
+	struct sock_fprog fprog = {
+		.len = n,
+		.filter = prog,
+	};
+
+	if (setsockopt (g_uevent_sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof (fprog)) < 0) {
+		trace (1, "	failed to attach uevent socket filter: %s\n", strerror (errno));
+		return;
+	}
+
+	trace (1, "	attached %d-instruction uevent socket filter\n", n);
+	g_uevent_filtered = true;
+}
+
+// account the uevents filtered off by kernel since the last one
+static void uevent_count (const char *msg, ssize_t size)
+{
+	g_afrd_stats.uevents_received++;
+
+	// SEQNUM is the last attribute of kernel uevents
+	const char *last = msg + size;
+	while ((last > msg) && last [-1])
+		last--;
+	int skip = strskip (last, "SEQNUM=");
+	if (!skip)
+		return;
+
+	unsigned long long seqnum = strtoull (last + skip, NULL, 10);
+	if (g_uevent_seqnum && (seqnum > g_uevent_seqnum + 1)) {
+		unsigned gap = seqnum - g_uevent_seqnum - 1;
+		// without socket filter the gap means lost uevents; with it the
+		// gap is what the filter dropped, except after an overflow, when
+		// filtered and lost uevents can't be told apart and the whole gap
+		// is counted as lost, an upper bound
+		if (!g_uevent_filtered || g_uevent_overflow) {
+			trace (1, "Lost %s%u uevents\n", g_uevent_filtered ? "up to " : "", gap);
+			g_afrd_stats.uevents_dropped += gap;
+			g_resync = true;
+		} else
+			g_afrd_stats.uevents_filtered += gap;
+	}
+	g_uevent_overflow = false;
+	g_uevent_seqnum = seqnum;
+}
+
 static void update_stats ()
 {
 	g_afrd_stats.enabled = g_enable;
@@ -218,6 +489,14 @@ static void update_stats ()
 	shmem_update ();
 }
 
+static int min_time (int to, mstime_t *ost)
+{
+	int tost = mstime_left (ost);
+	if ((to < 0) || ((tost >= 0) && (tost < to)))
+		return tost;
+	return to;
+}
+
 static bool rate_is_blacklisted (int rate)
 {
 	for (int i = 0; i < g_mode_blacklist_rates_count; i++)
@@ -226,6 +505,12 @@ static bool rate_is_blacklisted (int rate)
 	return false;
 }
 
+// check if movies of given frame rate played badly on this refresh rate
+static bool rate_is_demoted (int rate, int movie_hz)
+{
+	return g_display_id && prior_pair_demoted (g_display_id, rate, movie_hz);
+}
+
 // note! this function considers fractional rate "equal" to integer rate!
 // it is a rough test to filter off data that is way off the mainline.
 static bool hz_close (int hz1, int hz2)
@@ -238,23 +523,24 @@ static bool hz_close (int hz1, int hz2)
 	return abs (10000 - ((hz1 * 10000 + hz2 / 2) / hz2)) <= 50;
 }
 
+// known standard framerates
+static const short g_sane_hz [] =
+{
+	FP8 (23,976), FP8 (24,000),
+	FP8 (25,000),
+	FP8 (29,970), FP8 (30,000),
+	FP8 (50,000),
+	FP8 (59,940), FP8 (60,000),
+};
+
 // round hz to nearest known standard framerate
 static int hz_round (int hz)
 {
-	static short sane_hz [] =
-	{
-		FP8 (23,976), FP8 (24,000),
-		FP8 (25,000),
-		FP8 (29,970), FP8 (30,000),
-		FP8 (50,000),
-		FP8 (59,940), FP8 (60,000),
-	};
-
 	int closest_hz = 0;
 	int closest_delta = 99999999;
 
-	for (size_t i = 0; i < ARRAY_SIZE (sane_hz); i++) {
-		int shz = sane_hz [i];
+	for (size_t i = 0; i < ARRAY_SIZE (g_sane_hz); i++) {
+		int shz = g_sane_hz [i];
 		int delta = abs (shz - hz);
 		if (delta < closest_delta) {
 			closest_delta = delta;
@@ -272,98 +558,312 @@ static int hz_round (int hz)
 	return 0;
 }
 
-// accumulate fps data from different sources
-static void accumulate_fps (int hz, hz_source_t src)
+// display refresh rate to look for, if user wants fractional or integer rates
+static int mode_target_hz (int movie_hz)
 {
-	hz_stat_t *stat = &g_state.hz_stat [src];
-	if (stat->weight && !hz_close (hz, stat->hz)) {
-		g_state.hz_stat [src].weight = 0;
-		trace (2, "Resetting Hz weight src %d\n", src);
-	}
+	if (g_mode_use_fract == 0)
+		return movie_hz;
+
+	display_mode_t tmp;
+	tmp.framerate = (movie_hz + 0x80) >> 8;
+	tmp.fractional = (g_mode_use_fract == 1);
+	return display_mode_hz (&tmp);
+}
+
+// true if we know how long both kinds of refresh rate switches take on this display
+static bool switch_costs_known ()
+{
+	return (prior_cost (g_display_id, SWITCH_FRAC) >= 0) &&
+		(prior_cost (g_display_id, SWITCH_RATE) >= 0);
+}
 
-	int weight = src_weight [src];
+// mode rating penalty for the expected blackout when switching to mode
+static int switch_penalty (display_mode_t *mode)
+{
+	if (display_mode_equal (mode, &g_current_mode))
+		return 0;
 
-	stat->hz = hz;
-	stat->weight += weight;
-	mstime_arm (&stat->timeout, g_switch_delay_retry * 2);
+	int ms = prior_cost (g_display_id, display_mode_transition (mode, false));
+	if (ms <= 0)
+		return 0;
 
-	trace (2, "Accumulating "HZ_FMT"fps src %d weight %d total %d\n",
-		HZ_ARGS (hz), src, weight, stat->weight);
+	int penalty = ms / SWITCH_COST_UNIT;
+	return (penalty > SWITCH_COST_MAX) ? SWITCH_COST_MAX : penalty;
 }
 
-// guess the best fps from accumulated data, more insistent if last_chance is true
-static int best_fps (bool last_chance)
+/**
+ * Find the best display mode of same size as like for a movie, false if none.
+ * If costly is true, modes that take longer to switch to from current mode
+ * are penalized.
+ */
+static bool mode_select (const display_mode_t *like, int movie_hz, bool costly,
+	display_mode_t *best_mode)
 {
-	hz_stat_t *best_stat = NULL;
-	int best_weight = 0;
-	int best_src = -1;
+	/* Find the video mode that:
+	 * a) Has same width and height and interlace flag
+	 * b) Closely divides by the required framerate, error less
+	 *    than 4.1% (difference between 23.976 and 25 Hz)
+	 * c) Has the highest framerate (e.g. 50Hz display modes are
+	 *    better than 25Hz display modes for displaying 25Hz video)
+	 *    if g_mode_prefer_exact is 0, or
+	 * d) Has the closest framerate if g_mode_prefer_exact is 1.
+	 * e) Keeps the screen dark for shorter time, if costly is true;
+	 *    this may outweigh c) or d), but never b).
+	 */
+	int hz = mode_target_hz (movie_hz);
+	unsigned best_rating = 0;
+	best_mode->name [0] = 0;
+	for (int i = 0; i < g_modes_n; i++) {
+		display_mode_t *mode = &g_modes [i];
+		if ((mode->width != like->width) ||
+		    (mode->height != like->height) ||
+		    (mode->interlaced != like->interlaced))
+			continue;
 
-	for (int i = 0; i < SRC_COUNT; i++) {
-		hz_stat_t *stat = &g_state.hz_stat [i];
+		unsigned rate_n = 1;
+		unsigned rate = (mode->framerate << 16) / hz;
+		while (rate > 0x180) {
+			rate_n++;
+			rate = (mode->framerate << 16) / (hz * rate_n);
+		}
 
-		if (last_chance) {
-			// if last chance, use any detection that we're at least half sure
-			if (stat->weight < ACCEPT_HZ_WEIGHT/2)
-				continue;
-		} else {
-			// we still have time, wait best src that has a chance to finish
-			if (stat->weight < ACCEPT_HZ_WEIGHT) {
-				if (mstime_running (&stat->timeout))
-					break;
-				continue;
+		unsigned delta = abs ((int)(rate - 0x100));
+		if (delta > 11)
+			continue; // freq error > 4.3%
+
+		// rating is larger as delta is closer to 1.0 rate
+		int rating = (11 - delta) * 16;
+
+		unsigned n = (rate_n > 3) ? 3 : (rate_n - 1);
+		rating += 4 * (g_mode_prefer_exact ? (3 - n) : n);
+
+		if (rating > best_rating) {
+			display_mode_t tmp = *mode;
+			// decide if integer or fractional framerate is better
+			display_mode_set_hz (&tmp, hz);
+
+			// if framerate is blacklisted, try to invert fractional
+			if (rate_is_blacklisted (display_mode_hz (&tmp))) {
+				tmp.fractional = !tmp.fractional && tmp.fract_ok;
+				if (rate_is_blacklisted (display_mode_hz (&tmp)))
+					// no luck, both framerates are banned
+					continue;
+			}
+
+			// if movies judder at this framerate, try to invert fractional,
+			// or use it only if nothing better is available
+			if (rate_is_demoted (display_mode_hz (&tmp), movie_hz)) {
+				display_mode_t alt = tmp;
+				alt.fractional = !alt.fractional && alt.fract_ok;
+				if (!rate_is_blacklisted (display_mode_hz (&alt)) &&
+				    !rate_is_demoted (display_mode_hz (&alt), movie_hz))
+					tmp = alt;
+				else {
+					rating /= 4;
+					if (rating <= best_rating)
+						continue;
+				}
+			}
+
+			if (costly) {
+				int penalty = switch_penalty (&tmp);
+				rating = (rating > penalty) ? rating - penalty : 1;
+				if (rating <= best_rating)
+					continue;
 			}
-		}
 
-		if (best_weight < stat->weight) {
-			best_weight = stat->weight;
-			best_stat = stat;
-			best_src = i;
+			best_rating = rating;
+			*best_mode = tmp;
 		}
 	}
 
-	if (!best_stat)
-		return 0;
+	return best_mode->name [0] != 0;
+}
+
+// the display modes chosen for every standard frame rate, per mode size
+typedef struct
+{
+	int width;
+	int height;
+	bool interlaced;
+	display_mode_t best [ARRAY_SIZE (g_sane_hz)];
+} mode_index_t;
 
-	trace (2, "Best src %d "HZ_FMT"Hz weight %d timeout %d\n",
-	        best_src, HZ_ARGS (best_stat->hz), best_stat->weight,
-	        mstime_left (&best_stat->timeout));
+static mode_index_t *g_mode_index;
+static int g_mode_index_n;
 
-	return best_stat->hz;
+static int sane_hz_index (int hz)
+{
+	for (size_t i = 0; i < ARRAY_SIZE (g_sane_hz); i++)
+		if (abs (g_sane_hz [i] - hz) <= 1)
+			return i;
+	return -1;
 }
 
-static bool query_vdec_blocks ()
+static void mode_index_free ()
 {
-	if (!g_vdec_sysfs)
-		return false;
+	free (g_mode_index);
+	g_mode_index = NULL;
+	g_mode_index_n = 0;
+}
 
-	trace (2, "Querying vdec_blocks\n");
+static void mode_index_fill (mode_index_t *mi, int rate)
+{
+	display_mode_t like;
+	like.width = mi->width;
+	like.height = mi->height;
+	like.interlaced = mi->interlaced;
+
+	display_mode_t *best = &mi->best [rate];
+	mode_select (&like, g_sane_hz [rate], false, best);
+	if (best->name [0])
+		dtrace (2, "\t%dx%d%s@"HZ_FMT"fps -> "DISPMODE_FMT"\n",
+			mi->width, mi->height, mi->interlaced ? "i" : "", HZ_ARGS (g_sane_hz [rate]),
+			DISPMODE_ARGS (*best, display_mode_hz (best)));
+}
 
-	char line [200];
-	snprintf (line, sizeof (line), "%s/dump_vdec_blocks", g_vdec_sysfs);
-	FILE *vsf = fopen (line, "r");
-	if (!vsf)
-		return false;
+/**
+ * Choose the display mode for every mode size and standard frame rate
+ * in advance, so that switching for a movie is just a lookup.
+ * Must be called whenever display modes or selection rules change.
+ */
+static void mode_index_build ()
+{
+	mode_index_free ();
 
-	bool ok = fgets (line, sizeof (line), vsf) != NULL;
-	fclose (vsf);
-	if (!ok)
-		return false;
+	for (int i = 0; i < g_modes_n; i++) {
+		display_mode_t *mode = &g_modes [i];
+		int n;
+		for (n = 0; n < g_mode_index_n; n++)
+			if ((g_mode_index [n].width == mode->width) &&
+			    (g_mode_index [n].height == mode->height) &&
+			    (g_mode_index [n].interlaced == mode->interlaced))
+				break;
+		if (n < g_mode_index_n)
+			continue;
+
+		g_mode_index_n++;
+		g_mode_index = (mode_index_t *)realloc (g_mode_index, sizeof (mode_index_t) * g_mode_index_n);
+		g_mode_index [n].width = mode->width;
+		g_mode_index [n].height = mode->height;
+		g_mode_index [n].interlaced = mode->interlaced;
+	}
+
+	if (g_mode_index_n)
+		trace (2, "Choosing display modes for %d mode sizes\n", g_mode_index_n);
+
+	for (int n = 0; n < g_mode_index_n; n++)
+		for (size_t rate = 0; rate < ARRAY_SIZE (g_sane_hz); rate++)
+			mode_index_fill (&g_mode_index [n], rate);
+}
+
+// choose display modes again for movies of given frame rate
+static void mode_index_update (int movie_hz)
+{
+	int rate = sane_hz_index (movie_hz);
+	if (rate < 0)
+		return;
+
+	for (int n = 0; n < g_mode_index_n; n++)
+		mode_index_fill (&g_mode_index [n], rate);
+}
+
+// the display mode chosen in advance for a movie, NULL if not known
+static const display_mode_t *mode_index_find (const display_mode_t *like, int movie_hz)
+{
+	int rate = sane_hz_index (movie_hz);
+	if (rate < 0)
+		return NULL;
+
+	for (int n = 0; n < g_mode_index_n; n++) {
+		mode_index_t *mi = &g_mode_index [n];
+		if ((mi->width == like->width) &&
+		    (mi->height == like->height) &&
+		    (mi->interlaced == like->interlaced))
+			return &mi->best [rate];
+	}
+
+	return NULL;
+}
+
+// load learned source reliability for current decoder before first sample
+static void fusion_ready ()
+{
+	if (!g_state.fusion.ready)
+		fusion_reset (&g_state.fusion, prior_reliability (g_state.modalias));
+}
 
-	unsigned dsize = find_ulong (line, ",dsize=", &ok);
-	unsigned nframes = find_ulong (line, ",frames:", &ok);
-	unsigned timeint = find_ulong (line, ",dur:", &ok);
+// accumulate fps data from different sources
+static void accumulate_fps (int hz, hz_source_t src)
+{
+	fusion_ready ();
+	if (!fusion_add (&g_state.fusion, src, hz, 100))
+		return;
+
+	trace (2, "Accumulating "HZ_FMT"fps src %d samples %d\n",
+		HZ_ARGS (hz), src, g_state.fusion.samples [src]);
+}
+
+// set fps data from a source that accumulates samples by itself
+static void update_fps (int hz, hz_source_t src, int confidence)
+{
+	fusion_ready ();
+	if (!fusion_set (&g_state.fusion, src, hz, confidence))
+		return;
+
+	trace (2, "Updating "HZ_FMT"fps src %d confidence %d%%\n",
+		HZ_ARGS (hz), src, confidence);
+}
+
+// most probable fps if its posterior is at least min_posterior
+static int fused_fps (int min_posterior)
+{
+	int posterior, src;
+	int hz = fusion_best (&g_state.fusion, &posterior, &src);
+	if (!hz || (posterior < min_posterior))
+		return 0;
+
+	trace (2, "Best src %d "HZ_FMT"Hz posterior %d.%d%%\n",
+	        src, HZ_ARGS (hz), posterior / 10, posterior % 10);
+
+	g_state.hz_src = src;
+	return hz;
+}
+
+// guess the best fps from accumulated data, more insistent if last_chance is true
+static int best_fps (bool last_chance)
+{
+	// if last chance, use any detection that is more likely than all others
+	return fused_fps (last_chance ? FUSION_ONE / 2 : FUSION_ACCEPT);
+}
+
+// find a frame rate we're almost sure about
+static int provisional_fps ()
+{
+	return fused_fps (FUSION_PROVISIONAL);
+}
+
+// apply sampled fps source data, return true if it had new data since last time
+static bool apply_vdec_blocks (const vdec_sample_t *sample)
+{
+	unsigned dsize = sample->blocks.dsize;
+	unsigned nframes = sample->blocks.nframes;
+	unsigned timeint = sample->blocks.timeint;
 
 	dtrace (2, "\t> dsize %u frames %u dur %u\n", dsize, nframes, timeint);
 
-	// if we don't have enough stats, don't take it into account
-	if (!ok || nframes < 5 || timeint < 120 ||
-	    g_state.hz_samples_stamp == dsize)
+	// nothing new since last time
+	if (!sample->blocks.ok || g_state.hz_samples_stamp == dsize)
 		return false;
-
 	g_state.hz_samples_stamp = dsize;
+
+	// if we don't have enough stats, don't take it into account
+	if (nframes < 5 || timeint < 120)
+		return true;
+
 	int hz = hz_round ((nframes * 256000 + timeint / 2) / timeint);
 	if (hz == 0)
-		return false;
+		return true;
 
 	trace (2, "\t> %d frames played over last %dms at "HZ_FMT"fps\n",
 		nframes, timeint, HZ_ARGS (hz));
@@ -371,163 +871,210 @@ static bool query_vdec_blocks ()
 	return true;
 }
 
-static int compare_pts (const void *a, const void *b)
+// chunk timestamps are sorted in place, keep them off stack
+static vdec_sample_t g_chunks_sample;
+
+static bool apply_vdec_chunks (const vdec_sample_t *sample)
 {
-	int ptsa = *(int *)a;
-	int ptsb = *(int *)b;
-	return ptsa - ptsb;
+	g_chunks_sample = *sample;
+	int pts_size = g_chunks_sample.chunks.count;
+
+	pts_est_t *est = &g_state.chunks_est;
+	int fresh = pts_est_feed (est, g_chunks_sample.chunks.pts, pts_size);
+
+	int confidence;
+	int raw_hz = pts_est_hz (est, &confidence);
+	trace (2, "\t> %d new pts of %d, %u intervals, %u outliers, "HZ_FMT"fps, confidence %d%%\n",
+		fresh, pts_size, est->samples, est->outliers, HZ_ARGS (raw_hz), confidence);
+
+	int hz = hz_round (raw_hz);
+	if ((hz == 0) || (confidence < 50))
+		return (fresh != 0);
+
+	if (fresh && (est->locked_at == est->samples))
+		trace (2, "\t> chunk estimator locked on "HZ_FMT"fps after %u intervals\n",
+			HZ_ARGS (hz), est->locked_at);
+
+	// the estimator does its own accumulation over time
+	update_fps (hz, SRC_CHUNKS, confidence);
+	return (fresh != 0);
 }
 
-static bool query_vdec_chunks ()
+// find out the name of active video decoder, return false if none
+static bool vdec_active (char *name, size_t name_size)
 {
 	if (!g_vdec_sysfs)
 		return false;
 
-	trace (2, "Querying vdec_chunks\n");
-
 	char buff [4096];
-	snprintf (buff, sizeof (buff), "%s/dump_vdec_chunks", g_vdec_sysfs);
-	int vsh = open (buff, O_RDONLY);
-	if (vsh < 0)
+	int n = sysfs_attr_read (&g_attr_vdec_status, buff, sizeof (buff));
+	if (n < 0)
 		return false;
 
-	int size = read (vsh, buff, sizeof (buff) - 1);
-	close (vsh);
-	if (size < 100)
+	vdec_channel_t channel [SAMPLE_MAX_CHANNELS];
+	int count = vdec_status_channels (buff, n, channel, SAMPLE_MAX_CHANNELS);
+	int primary = vdec_primary_channel (channel, count);
+	if (primary < 0)
 		return false;
 
-	buff [size] = 0;
-	char *cur = buff;
-	int pts [64];
-	int pts_size = 0;
-	unsigned long long pts64_base;
+	strncpy (name, channel [primary].name, name_size - 1);
+	name [name_size - 1] = 0;
+	return true;
+}
 
-	while (*cur) {
-		char *eol = strchr (cur, '\n');
-		if (!eol)
-			break; // incomplete line
-		*eol = '\0';
-
-		bool ok = true;
-		unsigned long long pts64 = find_ulonglong (cur, "pts64=", &ok);
-		if (ok) {
-			if (!pts_size)
-				pts64_base = pts64;
-			pts [pts_size++] = (int)(pts64 - pts64_base);
-			if (pts_size > ARRAY_SIZE (pts))
-				break; // enough data
-		}
+static int vdec_find (const char *devpath)
+{
+	for (int i = 0; i < VDEC_MAX; i++)
+		if (g_vdec.dec [i].refs && (strcmp (g_vdec.dec [i].devpath, devpath) == 0))
+			return i;
+	return -1;
+}
 
-		cur = eol + 1;
-	}
+// make the oldest active decoder primary
+static void vdec_elect ()
+{
+	g_vdec.primary = -1;
+	for (int i = 0; i < VDEC_MAX; i++)
+		if (g_vdec.dec [i].refs &&
+		    ((g_vdec.primary < 0) ||
+		     ((int32_t)(g_vdec.dec [i].serial - g_vdec.dec [g_vdec.primary].serial) < 0)))
+			g_vdec.primary = i;
+
+	g_afrd_stats.vdec_decoders = g_vdec.count;
+}
 
-	if (pts_size < 5)
-		return false;
+// forget all decoders
+static void vdec_clear ()
+{
+	memset (&g_vdec.dec, 0, sizeof (g_vdec.dec));
+	g_vdec.count = 0;
+	vdec_elect ();
+}
 
-	qsort (pts, pts_size, sizeof (pts [0]), compare_pts);
-
-	// transform to usecs per frame
-	int i;
-	for (i = 1; i < pts_size; i++)
-		pts [i - 1] = pts [i] - pts [i - 1];
-	pts_size--;
-
-	// now compute the average frame rate
-	int base_pts = pts [0];
-	int avg_pts = base_pts;
-	int avg_count = 1;
-	for (i = 1; i < pts_size; i++) {
-		int rate = 128 * pts [i] / base_pts;
-		if ((rate >= 247) && (rate <= 264)) {
-			// pts [i] is a frame skip
-			avg_count++;
-		} else if ((rate >= 62) && (rate <= 66)) {
-			// all previous pts were frame skips
-			avg_count *= 2;
-			base_pts = pts [i];
-		} else if ((pts [i] > base_pts + 1500) || (pts [i] < base_pts - 1500))
-			continue; // totally wrong pts
-		avg_count++;
-		avg_pts += pts [i];
-	}
-
-	if (avg_count < 3)
+// a decoder was added, returns true if it's the first one
+static bool vdec_add (const char *devpath, const char *modalias)
+{
+	int i = vdec_find (devpath);
+	if (i >= 0) {
+		g_vdec.dec [i].refs++;
 		return false;
+	}
 
-	trace (2, "\t> %d pts in %d us, base pts %d\n", avg_count, avg_pts, base_pts);
+	for (i = 0; i < VDEC_MAX; i++)
+		if (!g_vdec.dec [i].refs)
+			break;
+	if (i >= VDEC_MAX) {
+		trace (1, "Too many active decoders, ignoring %s\n", devpath);
+		return false;
+	}
 
-	// warning: 32 bits easily overflow here, using longlong.
-	int hz = hz_round ((avg_count * 256000000ULL) / avg_pts);
-	if (hz == 0)
+	strncpy (g_vdec.dec [i].devpath, devpath, sizeof (g_vdec.dec [i].devpath) - 1);
+	strncpy (g_vdec.dec [i].modalias, modalias ? modalias : "",
+		sizeof (g_vdec.dec [i].modalias) - 1);
+	g_vdec.dec [i].refs = 1;
+	g_vdec.dec [i].serial = ++g_vdec.serial;
+	g_vdec.count++;
+
+	if (g_vdec.count > 1) {
+		trace (1, "Auxiliary decoder %s %s, %d decoders active\n",
+			devpath, g_vdec.dec [i].modalias, g_vdec.count);
+		g_afrd_stats.vdec_decoders = g_vdec.count;
 		return false;
+	}
 
-	// this gives fps with very high precision
-	accumulate_fps (hz, SRC_CHUNKS);
+	vdec_elect ();
 	return true;
 }
 
-static bool query_vdec ()
+// a decoder was removed, returns true if no more decoders are active
+static bool vdec_remove (const char *devpath)
 {
-	if (!g_vdec_sysfs)
+	int i = vdec_find (devpath);
+	// decoders found on resync have no devpath
+	if (i < 0)
+		i = vdec_find ("");
+	if (i < 0)
+		return (g_vdec.count == 0);
+
+	if (--g_vdec.dec [i].refs)
 		return false;
 
-	trace (2, "Querying vdec_status\n");
-
-	char line [200];
-	snprintf (line, sizeof (line), "%s/vdec_status", g_vdec_sysfs);
-	FILE *vsf = fopen (line, "r");
-	if (!vsf) {
-		trace (1, "\t> Failed to open %s/vdec_status\n", g_vdec_sysfs);
-		g_vdec_sysfs = NULL;
-		return false;
+	g_vdec.count--;
+	if (i == g_vdec.primary) {
+		vdec_elect ();
+		if (g_vdec.primary >= 0)
+			trace (1, "Primary decoder gone, %s %s takes over\n",
+				g_vdec.dec [g_vdec.primary].devpath,
+				g_vdec.dec [g_vdec.primary].modalias);
+	} else {
+		trace (1, "Auxiliary decoder %s gone, %d decoders active\n",
+			devpath, g_vdec.count);
+		g_afrd_stats.vdec_decoders = g_vdec.count;
 	}
 
-	// the values we're going to extract
-	int fps = 0, frame_dur = 0;
+	// if only the decoder found on resync is left, make sure it's still there
+	char modalias [sizeof (g_state.modalias)];
+	if ((g_vdec.count == 1) && (vdec_find ("") >= 0) &&
+	    !vdec_active (modalias, sizeof (modalias)))
+		vdec_clear ();
 
-	while (fgets (line, sizeof (line), vsf)) {
-		// Bionic sscanf sucks badly, so parse the string manually...
-		char *cur = line;
-		const char *attr, *val;
+	return (g_vdec.count == 0);
+}
 
-		cur += strspn (cur, spaces);
-		attr = cur;
-		while (*cur && (*cur != ':'))
-			cur++;
-		if (!*cur)
-			continue;
-		*cur = 0;
-		strip_trailing_spaces (cur, attr);
-		cur++;
-		cur += strspn (cur, spaces);
+// look up the prior cache as soon as we know the movie frame size
+static void prior_check (int width, int height)
+{
+	prior_key_t *key = &g_state.prior_key;
+	if (key->width || !width || !height || !g_state.modalias [0])
+		return;
 
-		val = cur;
-		cur = strchr (cur, 0);
-		strip_trailing_spaces (cur, val);
-
-		dtrace (2, "\tattr [%s] val [%s]\n", attr, val);
-
-		if (strcmp (attr, "frame rate") == 0) {
-			char *endp;
-			fps = strtol (val, &endp, 10);
-			endp += strspn (endp, spaces);
-			if ((*endp != 0) && (strcmp (endp, "fps") != 0)) {
-				trace (2, "\tgarbage at end of 'frame rate': [%s]\n", endp);
-				fps = 0;
-			} else
-				trace (2, "\t> frame rate %d\n", fps);
-		} else if (strcmp (attr, "frame dur") == 0) {
-			char *endp;
-			frame_dur = strtol (val, &endp, 10);
-			if (*endp != 0) {
-				trace (2, "\tgarbage at end of 'frame dur': [%s]\n", endp);
-				frame_dur = 0;
-			} else
-				trace (2, "\t> frame dur %d\n", frame_dur);
-		}
-	}
+	snprintf (key->modalias, sizeof (key->modalias), "%s", g_state.modalias);
+	key->width = width;
+	key->height = height;
 
-	fclose (vsf);
+	const prior_entry_t *pe = prior_lookup (key);
+	if (!pe || (pe->src >= SRC_COUNT))
+		return;
+
+	trace (1, "Last time %s %dx%d was "HZ_FMT"fps from src %d, confirmed %d times\n",
+		key->modalias, width, height, HZ_ARGS (pe->hz), pe->src, pe->hits);
+
+	// the first agreeing sample is enough if we've seen this content before
+	fusion_ready ();
+	fusion_prior (&g_state.fusion, pe->src, pe->hz);
+}
+
+// learn from the decided frame rate for the next time same content is played
+static void framerate_settled ()
+{
+	fusion_rel_t *rel = prior_reliability (g_state.modalias);
+	if (rel)
+		fusion_learn (&g_state.fusion, g_state.hz, rel);
+
+	if (g_state.prior_key.width && (g_state.hz_src >= 0))
+		prior_store (&g_state.prior_key, g_state.hz, g_state.hz_src);
+}
+
+static bool apply_vdec (const vdec_sample_t *sample)
+{
+	g_afrd_stats.vdec_channels = sample->vdec.channels;
+	if (sample->vdec.primary < 0)
+		return false;
+
+	const vdec_channel_t *ch = &sample->vdec.channel [sample->vdec.primary];
+	if (sample->vdec.channels > 1)
+		trace (2, "\t> %d channels, primary %s %dx%d\n",
+			sample->vdec.channels, ch->name, ch->width, ch->height);
+
+	int fps = ch->fps;
+	int frame_dur = ch->frame_dur;
+
+	prior_check (ch->width, ch->height);
+
+	if (fps)
+		trace (2, "\t> frame rate %d\n", fps);
+	if (frame_dur)
+		trace (2, "\t> frame dur %d\n", frame_dur);
 
 	// Prefer frame_dur over fps, but sometimes it's 0 and sometimes it's insane
 	int hz = 0;
@@ -551,13 +1098,449 @@ static bool query_vdec ()
 	if (!hz)
 		return false;
 
-	accumulate_fps (hz, SRC_VDEC);
-	return true;
+	accumulate_fps (hz, SRC_VDEC);
+	return true;
+}
+
+// compute next poll time for a source from its update cadence
+static void framerate_poll_schedule (hz_source_t src, bool changed)
+{
+	hz_poll_t *poll = &g_state.hz_poll [src];
+	int interval = g_switch_delay_retry;
+
+	if (changed) {
+		if (mstime_enabled (&poll->changed)) {
+			int cadence = g_mstime - poll->changed;
+			poll->cadence = poll->cadence ? (poll->cadence * 3 + cadence) / 4 : cadence;
+		}
+		mstime_arm (&poll->changed, 0);
+		poll->stale = 0;
+
+		// no point polling faster than the source updates
+		if (poll->cadence && (poll->cadence < interval))
+			interval = poll->cadence;
+		if (interval < g_switch_delay_retry / 2)
+			interval = g_switch_delay_retry / 2;
+	} else {
+		// back off sources that don't change
+		if (poll->stale < POLL_BACKOFF_MAX)
+			poll->stale++;
+		interval <<= poll->stale;
+	}
+
+	mstime_arm (&poll->next, interval);
+	dtrace (2, "\t> src %d %s, next poll in %d ms\n",
+		src, changed ? "changed" : "stale", interval);
+}
+
+// start over frame rate detection for current movie
+static void framerate_detect_reset ()
+{
+	memset (&g_state.fusion, 0, sizeof (g_state.fusion));
+	memset (&g_state.hz_poll, 0, sizeof (g_state.hz_poll));
+	memset (&g_state.monitor, 0, sizeof (g_state.monitor));
+	mstime_disable (&g_ost_monitor);
+	g_state.provisional = false;
+	g_sample_gen++;
+	pts_est_reset (&g_state.chunks_est);
+}
+
+// watch movie frame rate after we've switched to it
+static void monitor_start (int hz)
+{
+	if (!g_vdec_sysfs)
+		return;
+
+	memset (&g_state.monitor, 0, sizeof (g_state.monitor));
+	g_state.monitor.hz = hz;
+	g_state.monitor.interval = MONITOR_START;
+	g_state.monitor.judging = (g_display_id != 0);
+	mstime_arm (&g_ost_monitor, MONITOR_START);
+}
+
+// movie frame rate changed during playback, detect it again
+static void framerate_redetect (int hz)
+{
+	trace (1, "Movie frame rate changed from "HZ_FMT" to "HZ_FMT"fps, re-detecting\n",
+		HZ_ARGS (g_state.monitor.hz), HZ_ARGS (hz));
+
+	g_afrd_stats.monitor_switches++;
+	framerate_detect_reset ();
+	g_state.hz = 0;
+	mstime_arm (&g_state.hz_ost, g_switch_timeout);
+	mstime_arm (&g_ost_switch, 0);
+	shmem_update ();
+}
+
+// check a background sample of dump_vdec_blocks
+static void monitor_sample (const vdec_sample_t *sample)
+{
+	g_afrd_stats.monitor_samples++;
+	g_afrd_stats.monitor_time += sample->time;
+
+	unsigned dsize = sample->blocks.dsize;
+	unsigned nframes = sample->blocks.nframes;
+	unsigned timeint = sample->blocks.timeint;
+	int interval = g_state.monitor.interval;
+
+	if (!sample->failed && sample->blocks.ok &&
+	    (g_state.monitor.stamp != dsize) &&
+	    (nframes >= 5) && (timeint >= 120)) {
+		g_state.monitor.stamp = dsize;
+
+		int hz = hz_round ((nframes * 256000 + timeint / 2) / timeint);
+		if (hz && !hz_close (hz, g_state.monitor.hz)) {
+			if (g_state.monitor.misses && hz_close (hz, g_state.monitor.miss_hz))
+				g_state.monitor.misses++;
+			else {
+				g_state.monitor.miss_hz = hz;
+				g_state.monitor.misses = 1;
+			}
+
+			trace (2, "Monitor: "HZ_FMT"fps instead of "HZ_FMT"fps, %d times in a row\n",
+				HZ_ARGS (hz), HZ_ARGS (g_state.monitor.hz), g_state.monitor.misses);
+
+			if (g_state.monitor.misses >= MONITOR_CONFIRM) {
+				framerate_redetect (hz);
+				return;
+			}
+
+			// look closer to confirm or refute it soon
+			interval = MONITOR_MIN;
+		} else if (hz) {
+			g_state.monitor.misses = 0;
+			// frame rate is stable, look less often
+			interval *= 2;
+			if (interval > MONITOR_MAX)
+				interval = MONITOR_MAX;
+		}
+	}
+
+	g_state.monitor.interval = interval;
+	mstime_arm (&g_ost_monitor, interval);
+	shmem_update ();
+}
+
+// judge playback quality on current display mode from vdec_status counters
+static void monitor_judge (const vdec_sample_t *sample)
+{
+	if (!g_state.monitor.judging || sample->failed || (sample->vdec.primary < 0))
+		return;
+
+	const vdec_channel_t *ch = &sample->vdec.channel [sample->vdec.primary];
+	int elapsed = g_mstime - g_state.monitor.judge_stamp;
+
+	// start over if counters were reset or we don't have them yet
+	if (!mstime_enabled (&g_state.monitor.judge_stamp) ||
+	    (ch->frame_count < g_state.monitor.frames) ||
+	    (ch->drop_count < g_state.monitor.drops)) {
+		g_state.monitor.frames = ch->frame_count;
+		g_state.monitor.drops = ch->drop_count;
+		mstime_arm (&g_state.monitor.judge_stamp, 0);
+		return;
+	}
+
+	if (elapsed < JUDGE_WINDOW)
+		return;
+
+	unsigned frames = ch->frame_count - g_state.monitor.frames;
+	unsigned drops = ch->drop_count - g_state.monitor.drops;
+	unsigned expected = ((uint64_t)g_state.monitor.hz * elapsed) / 256000;
+
+	// paused, seeking or fast-forwarding: nothing to judge, try again
+	if ((frames + drops < expected / 2) || (frames > expected * 3 / 2)) {
+		trace (2, "Judge: %u frames in %d ms, expected %u, starting over\n",
+			frames, elapsed, expected);
+		mstime_disable (&g_state.monitor.judge_stamp);
+		return;
+	}
+
+	// dropped frames plus frames that decoder failed to deliver in time
+	unsigned score = (drops * 1000) / (frames + drops);
+	if (expected > frames)
+		score += ((expected - frames) * 1000) / expected;
+
+	int mode_hz = display_mode_hz (&g_current_mode);
+	bool bad = (score >= JUDGE_BAD_SCORE);
+	trace (1, "Movie at "HZ_FMT"fps on "HZ_FMT"Hz: %u frames, %u dropped in %d ms, score %u%s\n",
+		HZ_ARGS (g_state.monitor.hz), HZ_ARGS (mode_hz), frames, drops, elapsed,
+		score, bad ? " (bad)" : "");
+
+	g_state.monitor.judging = false;
+	g_afrd_stats.judder_score = score;
+	bool was_demoted = prior_pair_demoted (g_display_id, mode_hz, g_state.monitor.hz);
+	bool demoted = prior_pair_eval (g_display_id, mode_hz, g_state.monitor.hz, bad);
+	if (demoted && !was_demoted) {
+		trace (1, "Demoting "HZ_FMT"Hz for "HZ_FMT"fps movies on this display\n",
+			HZ_ARGS (mode_hz), HZ_ARGS (g_state.monitor.hz));
+		g_afrd_stats.judder_demotions++;
+	}
+	// the choice of display mode for such movies may be different now
+	if (demoted != was_demoted)
+		mode_index_update (g_state.monitor.hz);
+	shmem_update ();
+}
+
+// apply the samples that came from sampler, return true if there were any
+static bool apply_samples ()
+{
+	bool applied = false;
+	vdec_sample_t sample;
+
+	while (sampler_get (&sample)) {
+		hz_source_t src = SRC_CHUNKS + sample.kind;
+
+		// drop samples requested for previous movie
+		if (sample.gen != g_sample_gen)
+			continue;
+
+		latency_add (LAT_QUERY, sample.time);
+
+		// after we've switched, samples are watched by monitor
+		if (g_state.monitor.hz && (src == SRC_BLOCKS)) {
+			monitor_sample (&sample);
+			continue;
+		}
+		if (g_state.monitor.hz && (src == SRC_VDEC)) {
+			monitor_judge (&sample);
+			continue;
+		}
+
+		bool changed = false;
+		if (sample.failed) {
+			trace (2, "\t> failed to sample src %d\n", src);
+			// vdec_status must be always there
+			if (src == SRC_VDEC) {
+				trace (1, "\t> Failed to open %s/vdec_status\n", g_vdec_sysfs);
+				g_vdec_sysfs = NULL;
+			}
+		} else switch (src) {
+			case SRC_CHUNKS: changed = apply_vdec_chunks (&sample); break;
+			case SRC_BLOCKS: changed = apply_vdec_blocks (&sample); break;
+			default: changed = apply_vdec (&sample); break;
+		}
+
+		framerate_poll_schedule (src, changed);
+		applied = true;
+	}
+
+	return applied;
+}
+
+// request the fps sources that are due
+static void framerate_poll ()
+{
+	if (!g_vdec_sysfs)
+		return;
+
+	unsigned kinds = 0;
+	for (int src = SRC_CHUNKS; src < SRC_COUNT; src++) {
+		if (mstime_running (&g_state.hz_poll [src].next))
+			continue;
+
+		trace (2, "Querying src %d\n", src);
+		kinds |= 1 << (src - SRC_CHUNKS);
+		// in case sample gets lost, ask again later
+		mstime_arm (&g_state.hz_poll [src].next, g_switch_delay_retry * 2);
+	}
+
+	sampler_request (kinds, g_sample_gen);
+
+	// in synchronous mode samples are ready immediately
+	if (sampler_fd () < 0)
+		apply_samples ();
+}
+
+// milliseconds until the next source poll or detection timeout
+static int framerate_poll_delay ()
+{
+	int to = mstime_left (&g_state.hz_ost);
+	for (int src = SRC_CHUNKS; src < SRC_COUNT; src++)
+		to = min_time (to, &g_state.hz_poll [src].next);
+	return (to > 0) ? to : 1;
+}
+
+// re-check provisional frame rate, return true if it has to be changed
+static bool framerate_refine ()
+{
+	bool last_chance = mstime_expired (&g_state.hz_ost);
+
+	framerate_poll ();
+	int hz = best_fps (last_chance);
+
+	if (hz && (abs (hz - g_state.provisional_hz) > 1)) {
+		trace (1, "Refining provisional frame rate "HZ_FMT" to "HZ_FMT"fps\n",
+			HZ_ARGS (g_state.provisional_hz), HZ_ARGS (hz));
+		g_state.provisional = false;
+		g_state.hz = hz;
+		framerate_settled ();
+		return true;
+	}
+
+	if (hz || last_chance || !g_switch_delay_retry) {
+		trace (2, "Provisional frame rate "HZ_FMT"fps confirmed\n",
+			HZ_ARGS (g_state.provisional_hz));
+		g_state.provisional = false;
+		if (hz)
+			framerate_settled ();
+		monitor_start (g_state.provisional_hz);
+		return false;
+	}
+
+	mstime_arm (&g_ost_switch, framerate_poll_delay ());
+	return false;
+}
+
+// account display control writes completed by the actuator
+static void handle_actuator ()
+{
+	actuator_ack ();
+
+	// the driver should be done with the writes, look at HDMI state now
+	if (g_hdmi_deferred && !actuator_busy ()) {
+		g_hdmi_deferred = false;
+		mstime_arm (&g_ost_hdmi, 0);
+	}
+
+	actuator_result_t res;
+	bool done = false;
+	while (actuator_get (&res)) {
+		done = true;
+		latency_commit (&res.steps);
+		if (!res.switched)
+			continue;
+
+		// the first switch for a movie tells how quickly we react
+		if (g_settle.trigger) {
+			latency_since (LAT_SWITCH, g_settle.trigger);
+			g_settle.trigger = 0;
+		}
+
+		// screen was disabled again while we were switching
+		if (g_blackened)
+			continue;
+
+		g_settle.start = res.start;
+		g_settle.poll = LINK_POLL_MIN;
+		link_watch (&g_current_mode);
+		// the mode write may take a while, check link right after it
+		mstime_arm (&g_ost_settle, 0);
+	}
+
+	if (!done)
+		return;
+
+	uint32_t written, skipped;
+	sysfs_write_stats (&written, &skipped);
+	g_afrd_stats.sysfs_writes = written;
+	g_afrd_stats.sysfs_writes_skipped = skipped;
+	g_afrd_stats.switches_superseded = actuator_superseded ();
+	shmem_update ();
+}
+
+// switch display mode and start measuring how long the screen stays dark
+static void switch_display_mode (display_mode_t *mode, bool force)
+{
+	switch_type_t type = display_mode_transition (mode, force);
+	display_mode_t prev = g_current_mode;
+
+	if (!display_mode_switch (mode, force)) {
+		if (g_settle.trigger) {
+			latency_since (LAT_SWITCH, g_settle.trigger);
+			g_settle.trigger = 0;
+		}
+		return;
+	}
+
+	g_settle.type = type;
+	g_settle.prev = prev;
+	g_settle.reverting = false;
+	// synchronous actuator has done the writes already
+	if (actuator_fd () < 0)
+		handle_actuator ();
+}
+
+// stop waiting for display link
+static void settle_stop ()
+{
+	mstime_disable (&g_ost_settle);
+	link_unwatch ();
+}
+
+// milliseconds until the next display link check
+static int settle_poll_delay (int ms)
+{
+	// don't bother until such switches usually complete...
+	int expected = prior_cost (g_display_id, g_settle.type);
+	int early = expected - expected / 8 - ms;
+	if (early > g_settle.poll)
+		return early;
+
+	// ...then poll often, slowing down if it takes long
+	int delay = g_settle.poll;
+	g_settle.poll = (delay * 2 < LINK_POLL_MAX) ? delay * 2 : LINK_POLL_MAX;
+	return delay;
+}
+
+// check if display link is up after a mode switch and learn how long it took
+static void settle_check ()
+{
+	const char *waiting;
+	link_state_t state = link_check (&waiting);
+	// display unplugged, this switch tells nothing
+	if (state == LINK_UNPLUGGED) {
+		settle_stop ();
+		return;
+	}
+
+	int ms = mstime_get () - g_settle.start;
+	int deadline = g_switch_link ? g_switch_link : DEFAULT_SWITCH_LINK;
+	if ((state == LINK_DOWN) && (ms < deadline)) {
+		mstime_arm (&g_ost_settle, settle_poll_delay (ms));
+		return;
+	}
+
+	settle_stop ();
+
+	g_afrd_stats.switch_settle_ms = ms;
+
+	if (state == LINK_UP) {
+		trace (1, "Display link settled in %d ms after %s switch\n",
+			ms, g_switch_type_name [g_settle.type]);
+		int expected = prior_cost (g_display_id, g_settle.type);
+		if (expected >= 0)
+			trace (2, "\t> such switches took %d ms on average\n", expected);
+		// a timed out switch, or a revert after it, is not a typical one
+		if (!g_settle.reverting)
+			prior_cost_eval (g_display_id, g_settle.type, ms);
+
+		latency_add (LAT_LINK, (uint64_t)ms * 1000);
+		g_afrd_stats.switches_settled++;
+		g_settle.reverting = false;
+		shmem_update ();
+		return;
+	}
+
+	trace (1, "Display link did not come back in %d ms after %s switch, no %s\n",
+		ms, g_switch_type_name [g_settle.type], waiting);
+	g_afrd_stats.switches_failed++;
+	shmem_update ();
+
+	// if reverting does not help either, leave it as is
+	if (!g_switch_link || g_settle.reverting || !g_settle.prev.name [0])
+		return;
+
+	display_mode_t prev = g_settle.prev;
+	trace (1, "Reverting display mode to "DISPMODE_FMT"\n",
+		DISPMODE_ARGS (prev, display_mode_hz (&prev)));
+	switch_display_mode (&prev, true);
+	g_settle.reverting = true;
 }
 
 static void blackout ()
 {
 	mstime_disable (&g_ost_blackout);
+	settle_stop ();
 
 	if (g_blackened)
 		return;
@@ -565,6 +1548,8 @@ static void blackout ()
 	display_mode_get_current ();
 	g_state.orig_mode = g_current_mode;
 	display_mode_null ();
+	if (actuator_fd () < 0)
+		handle_actuator ();
 
 	update_stats ();
 }
@@ -573,17 +1558,18 @@ static void framerate_restore (bool only_if_black)
 {
 	mstime_disable (&g_ost_blackout);
 	mstime_disable (&g_ost_switch);
+	mstime_disable (&g_ost_monitor);
 
 	if (only_if_black && !g_blackened)
 		return;
 
-	mstime_arm (&g_ost_hdcp, DEFAULT_SWITCH_HDCP);
 	if (g_state.orig_mode.name [0])
-		display_mode_switch (&g_state.orig_mode, false);
+		switch_display_mode (&g_state.orig_mode, false);
 	else
-		display_mode_switch (&g_current_mode, false);
+		switch_display_mode (&g_current_mode, false);
 
 	memset (&g_state, 0, sizeof (g_state));
+	g_sample_gen++;
 	update_stats ();
 }
 
@@ -612,91 +1598,65 @@ giveup:			trace (1, "Timeout detecting movie frame rate, giving up\n");
 			framerate_restore (true);
 			return;
 		}
+		framerate_settled ();
+	}
+
+	// keep polling after a provisional switch in case we were wrong
+	bool refined = false;
+	if (g_state.provisional) {
+		if (!framerate_refine ())
+			return;
+		refined = true;
 	}
 
 	// ask every source until we have a valid refresh rate
 	if (g_state.hz == 0) {
-		query_vdec_chunks ();
-		query_vdec_blocks ();
-		query_vdec ();
+		framerate_poll ();
 		g_state.hz = best_fps (false);
+		if ((g_state.hz == 0) &&
+		    ((g_state.hz = provisional_fps ()) != 0) &&
+		    g_switch_delay_retry) {
+			trace (1, "Switching provisionally to "HZ_FMT"fps\n", HZ_ARGS (g_state.hz));
+			g_state.provisional = true;
+			g_state.provisional_hz = g_state.hz;
+			mstime_arm (&g_ost_switch, framerate_poll_delay ());
+		} else if (g_state.hz)
+			framerate_settled ();
+
 		if (g_state.hz == 0) {
 			// Cannot determine movie frame rate, retry if allowed
 			if (!g_switch_delay_retry)
 				goto giveup;
 
-			mstime_arm (&g_ost_switch, g_switch_delay_retry);
+			mstime_arm (&g_ost_switch, framerate_poll_delay ());
 			return;
 		}
 	}
 
+	// the display rate may differ from movie rate below
+	int movie_hz = g_state.hz;
+
 	// use fractional or integer frame rates if user requested so
-	if (g_mode_use_fract != 0) {
-		display_mode_t tmp;
-		tmp.framerate = (g_state.hz + 0x80) >> 8;
-		tmp.fractional = (g_mode_use_fract == 1);
-		g_state.hz = display_mode_hz (&tmp);
-	}
+	g_state.hz = mode_target_hz (movie_hz);
 
 	trace (1, "Current mode is "DISPMODE_FMT"\n",
 		DISPMODE_ARGS (g_current_mode, display_mode_hz (&g_current_mode)));
 	trace (1, "Looking for display mode closest to %dx%d@"HZ_FMT"Hz\n",
 		g_current_mode.width, g_current_mode.height, HZ_ARGS (g_state.hz));
 
-	/* Find the video mode that:
-	 * a) Has same width and height and interlace flag
-	 * b) Closely divides by the required framerate, error less
-	 *    than 4.1% (difference between 23.976 and 25 Hz)
-	 * c) Has the highest framerate (e.g. 50Hz display modes are
-	 *    better than 25Hz display modes for displaying 25Hz video)
-	 *    if g_mode_prefer_exact is 0, or
-	 * d) Has the closest framerate if g_mode_prefer_exact is 1.
-	 */
+	// the modes chosen in advance don't know what we're switching from,
+	// so choose again if some of them may keep the screen dark for longer
+	uint64_t decide_stamp = latency_now ();
 	display_mode_t best_mode;
-	unsigned best_rating = 0;
-	int i;
-	best_mode.name [0] = 0;
-	for (i = 0; i < g_modes_n; i++) {
-		display_mode_t *mode = &g_modes [i];
-		if ((mode->width != g_current_mode.width) ||
-		    (mode->height != g_current_mode.height) ||
-		    (mode->interlaced != g_current_mode.interlaced))
-			continue;
-
-		unsigned rate_n = 1;
-		unsigned rate = (mode->framerate << 16) / g_state.hz;
-		while (rate > 0x180) {
-			rate_n++;
-			rate = (mode->framerate << 16) / (g_state.hz * rate_n);
-		}
-
-		unsigned delta = abs ((int)(rate - 0x100));
-		if (delta > 11)
-			continue; // freq error > 4.3%
-
-		// rating is larger as delta is closer to 1.0 rate
-		int rating = (11 - delta) * 16;
-
-		unsigned n = (rate_n > 3) ? 3 : (rate_n - 1);
-		rating += 4 * (g_mode_prefer_exact ? (3 - n) : n);
-
-		if (rating > best_rating) {
-			display_mode_t tmp = *mode;
-			// decide if integer or fractional framerate is better
-			display_mode_set_hz (&tmp, g_state.hz);
-
-			// if framerate is blacklisted, try to invert fractional
-			if (rate_is_blacklisted (display_mode_hz (&tmp))) {
-				tmp.fractional = !tmp.fractional;
-				if (rate_is_blacklisted (display_mode_hz (&tmp)))
-					// no luck, both framerates are banned
-					continue;
-			}
-
-			best_rating = rating;
-			best_mode = tmp;
-		}
-	}
+	const display_mode_t *indexed = NULL;
+	bool costly = !g_blackened && switch_costs_known ();
+	if (!costly)
+		indexed = mode_index_find (&g_current_mode, movie_hz);
+	if (indexed)
+		best_mode = *indexed;
+	else
+		mode_select (&g_current_mode, movie_hz, costly, &best_mode);
+	latency_since (LAT_DECIDE, decide_stamp);
 
 	if (!best_mode.name [0]) {
 		trace (1, "Failed to find a suitable display mode\n");
@@ -706,12 +1666,13 @@ giveup:			trace (1, "Timeout detecting movie frame rate, giving up\n");
 
 	// if we already switched mode to something close to what we found,
 	// avoid unneeded irritating framerate switching in the middle of watching
-	if (g_state.orig_mode.name [0] && !g_blackened && !force) {
+	if (g_state.orig_mode.name [0] && !g_blackened && !force && !refined) {
 		int hz1 = display_mode_hz (&best_mode);
 		int hz2 = display_mode_hz (&g_current_mode);
 		if (hz_close (hz1, hz2)) {
 			trace (1, "Skipping mode switch since current refresh is close enough\n");
 			framerate_restore (true);
+			monitor_start (movie_hz);
 			return;
 		}
 	}
@@ -722,9 +1683,19 @@ giveup:			trace (1, "Timeout detecting movie frame rate, giving up\n");
 	if (!g_state.orig_mode.name [0])
 		g_state.orig_mode = g_current_mode;
 
-	mstime_arm (&g_ost_hdcp, DEFAULT_SWITCH_HDCP);
-	display_mode_switch (&best_mode, force);
+	// the first switch for a movie tells how quickly we react
+	g_settle.trigger = g_state.trigger_stamp;
+	if (g_state.trigger_stamp) {
+		latency_add (LAT_DETECT, decide_stamp - g_state.detect_stamp);
+		g_state.trigger_stamp = 0;
+	}
+
+	switch_display_mode (&best_mode, force);
 	update_stats ();
+
+	// keep an eye on the movie in case its frame rate changes
+	if (!g_state.provisional && !force)
+		monitor_start (movie_hz);
 }
 
 /* @param restore true to delay restoring refresh rate to original,
@@ -773,16 +1744,30 @@ static void delay_framerate_switch (bool restore, int hz, const char *modalias)
 		}
 
 		// save decoder name
-		strncpy (g_state.modalias, modalias, sizeof (g_state.modalias));
+		snprintf (g_state.modalias, sizeof (g_state.modalias), "%s", modalias);
 	}
 
 	if (g_state.restore != restore) {
 		g_state.restore = restore;
 		g_state.hz = hz;
 		// start collecting stats all over again
-		memset (&g_state.hz_stat, 0, sizeof (g_state.hz_stat));
+		framerate_detect_reset ();
+
+		memset (&g_state.prior_key, 0, sizeof (g_state.prior_key));
 	}
 
+	// start the clock when playback starts, not all switches are started by uevents
+	if (!restore && !g_state.trigger_stamp && !g_state.orig_mode.name [0]) {
+		g_state.detect_stamp = latency_now ();
+		g_state.trigger_stamp = g_uevent_stamp ? g_uevent_stamp : g_state.detect_stamp;
+		latency_add (LAT_TRIGGER, g_state.detect_stamp - g_state.trigger_stamp);
+	}
+
+	// check for content id hint via API
+	if (!restore &&
+	    mstime_running (&g_content_id_hint.stamp))
+		g_state.prior_key.content_id = g_content_id_hint.id;
+
 	// if refresh rate is going to be restored, and screen is black, do not delay
 	if (restore && g_blackened)
 		delay = g_switch_delay_on;
@@ -820,65 +1805,177 @@ static void delay_framerate_switch (bool restore, int hz, const char *modalias)
 	}
 }
 
+// use cached capabilities of a known display until they're refreshed
+static void display_cache_load ()
+{
+	uint32_t edid = display_edid_id ();
+	const prior_display_t *pd = prior_display_lookup (edid);
+	if (!pd)
+		return;
+
+	trace (1, "Display %08x is known, using its %d cached modes\n", edid, pd->modes);
+	display_modes_set (pd->mode, pd->modes, edid);
+	mode_index_build ();
+	colorspace_caps_set (pd->cs, pd->colorspaces);
+	hdcp_set_mode (pd->hdcp);
+	g_afrd_stats.display_cache_hits++;
+}
+
+// remember capabilities of the display after a full refresh
+static void display_cache_store ()
+{
+	colorspace_cap_t cs [PRIOR_DISPLAY_CS];
+	int cs_count = colorspace_caps_get (cs, PRIOR_DISPLAY_CS);
+
+	bool known = (prior_display_lookup (g_display_edid) != NULL);
+	if (prior_display_store (g_display_edid, g_modes, g_modes_n, cs, cs_count, hdcp_mode ()) && known)
+		trace (1, "Display %08x capabilities changed since last time\n", g_display_edid);
+}
+
 static void handle_hdmi_switch (int state)
 {
+	// the display driver may have recreated its attributes
+	sysfs_invalidate ();
+
 	if (state == -1)
-		state = sysfs_get_int (g_hdmi_state, NULL);
+		state = sysfs_attr_get_int (&g_attr_hdmi_state);
 
 	if (state <= 0) {
 		trace (1, "HDMI not active, clearing video mode list\n");
+		settle_stop ();
 		hdcp_fini ();
 		display_modes_fini ();
+		mode_index_free ();
 		memset (&g_state.orig_mode, 0, sizeof (g_state.orig_mode));
 	} else {
 		display_modes_init ();
+		mode_index_build ();
 		colorspace_refresh ();
 		hdcp_init ();
+		display_cache_store ();
+	}
+}
+
+/**
+ * Rebuild playback state from sysfs, as if we've got all the uevents
+ * that we have lost (at startup, after socket overflow or reload).
+ */
+static void afrd_resync (const char *why)
+{
+	g_resync = false;
+	trace (1, "Resynchronizing state from sysfs (%s)\n", why);
+	// display settings may have been changed meanwhile
+	sysfs_forget ();
+
+	int hdmi = sysfs_attr_get_int (&g_attr_hdmi_state);
+	if (hdmi <= 0) {
+		if (g_modes_n)
+			handle_hdmi_switch (0);
+		return;
+	}
+
+	// if HDMI plug-in was lost, refresh everything, otherwise just current mode
+	if (!g_modes_n)
+		handle_hdmi_switch (1);
+	else
+		display_mode_get_current ();
+	update_stats ();
+
+	char modalias [sizeof (g_state.modalias)];
+	if (vdec_active (modalias, sizeof (modalias))) {
+		// we don't know the devpath, it will be matched by first "remove"
+		if (!g_vdec.count)
+			vdec_add ("", modalias);
+		if (g_state.restore || !g_state.modalias [0] ||
+		    (strcmp (g_state.modalias, modalias) != 0)) {
+			trace (1, "\t> decoder %s is running\n", modalias);
+			delay_framerate_switch (false, 0, modalias);
+			// the movie is already playing, don't blacken the screen
+			mstime_disable (&g_ost_blackout);
+		}
+	} else {
+		vdec_clear ();
+		if (!g_state.restore &&
+		    (g_state.orig_mode.name [0] || g_state.delayed_switch)) {
+			trace (1, "\t> no decoder is running\n");
+			delay_framerate_switch (true, 0, NULL);
+		}
 	}
 }
 
+// HDMI plugged on or off, handle it when things settle down
+static void hdmi_state_changed ()
+{
+	trace (1, "HDMI state changed, will handle in %d ms\n",
+		g_switch_hdmi);
+	mstime_arm (&g_ost_hdmi, g_switch_hdmi);
+
+	// a display we've seen before is usable right away,
+	// the delayed refresh will confirm its capabilities
+	sysfs_invalidate ();
+	if (sysfs_attr_get_int (&g_attr_hdmi_state) > 0)
+		display_cache_load ();
+}
+
+// the driver has notified about HDMI state change
+static void hdmi_state_watch (sysfs_attr_t *sa, const char *value, bool changed)
+{
+	if (changed && g_switch_hdmi)
+		hdmi_state_changed ();
+}
+
 static void handle_uevent (char *msg, ssize_t size)
 {
 	const char *frame_rate_hint = NULL;
 	const char *frame_rate_end_hint = NULL;
 	const char *action = NULL;
 	const char *modalias = NULL;
-	const char *msg_orig = msg;
+	const char *devpath = "";
+	const char *end = msg + size;
 
-	uevent_filter_reset (&g_filter_frhint);
-	uevent_filter_reset (&g_filter_vdec);
-	uevent_filter_reset (&g_filter_hdmi);
-	uevent_filter_reset (&g_filter_hdcp);
+	uevent_classifier_reset (&g_classifier);
 
-	for (const char *end = msg + size; msg < end; msg += strlen (msg) + 1) {
-		if (msg == msg_orig) {
-			trace (2, "Parsing uevent %s\n", msg);
-			continue;
-		} else
-			trace (2, "\t> %s\n", msg);
+	// first line is "action@devpath"
+	trace (2, "Parsing uevent %s\n", msg);
+	msg += strlen (msg) + 1;
+
+	while (msg < end) {
+		char *eos = memchr (msg, 0, end - msg);
+		if (!eos)
+			eos = (char *)end;
 
-		char *val = strchr (msg, '=');
-		if (val)
+		trace (2, "\t> %s\n", msg);
+
+		char *val = memchr (msg, '=', eos - msg);
+		size_t key_len;
+		if (val) {
+			key_len = val - msg;
 			*val++ = 0;
-		else
-			val = strchr (msg, 0);
+		} else {
+			key_len = eos - msg;
+			val = eos;
+		}
 
 		/* look for keywords we are interested */
-		if (strcmp (msg, "FRAME_RATE_HINT") == 0)
+		uint32_t hash = uevent_hash (msg, key_len);
+		if ((hash == g_hash_frame_rate_hint) && (strcmp (msg, "FRAME_RATE_HINT") == 0))
 			frame_rate_hint = val;
-		else if (strcmp (msg, "FRAME_RATE_END_HINT") == 0)
+		else if ((hash == g_hash_frame_rate_end_hint) && (strcmp (msg, "FRAME_RATE_END_HINT") == 0))
 			frame_rate_end_hint = val;
-		else if (strcmp (msg, "ACTION") == 0)
+		else if ((hash == g_hash_action) && (strcmp (msg, "ACTION") == 0))
 			action = val;
-		else if (strcmp (msg, "MODALIAS") == 0)
+		else if ((hash == g_hash_modalias) && (strcmp (msg, "MODALIAS") == 0))
 			modalias = val + strskip (val, "platform:");
+		else if ((hash == g_hash_devpath) && (strcmp (msg, "DEVPATH") == 0))
+			devpath = val;
+
+		/* and drop the uevent as soon as no filter can match */
+		if (!uevent_classifier_match (&g_classifier, hash, msg, val, eos - val)) {
+			trace (2, "\tUnrecognized uevent\n");
+			return;
+		}
 
-		/* and count matches for every kind of uevent */
-		uevent_filter_match (&g_filter_frhint, msg, val);
-		uevent_filter_match (&g_filter_vdec, msg, val);
-		uevent_filter_match (&g_filter_hdmi, msg, val);
-		uevent_filter_match (&g_filter_hdcp, msg, val);
-		msg = val;
+		msg = eos + 1;
 	}
 
 	if (uevent_filter_matched (&g_filter_frhint)) {
@@ -900,77 +1997,152 @@ static void handle_uevent (char *msg, ssize_t size)
 			delay_framerate_switch (true, 0, modalias);
 
 	} else if (uevent_filter_matched (&g_filter_vdec)) {
-		/* got a vdec uevent */
-		if (action && (strcmp (action, "add") == 0))
-			delay_framerate_switch (false, 0, modalias);
-		else if (action && (strcmp (action, "remove") == 0))
-			delay_framerate_switch (true, 0, modalias);
+		/* got a vdec uevent, only first and last decoder matter */
+		if (action && (strcmp (action, "add") == 0)) {
+			if (vdec_add (devpath, modalias))
+				delay_framerate_switch (false, 0, modalias);
+		} else if (action && (strcmp (action, "remove") == 0)) {
+			if (vdec_remove (devpath))
+				delay_framerate_switch (true, 0, modalias);
+		}
 
 	} else if (uevent_filter_matched (&g_filter_hdmi) && g_switch_hdmi) {
 		/* hdmi plugged on or off */
-		trace (1, "HDMI state changed, will handle in %d ms\n",
-			g_switch_hdmi);
-		mstime_arm (&g_ost_hdmi, g_switch_hdmi);
+		hdmi_state_changed ();
 
 	} else if (uevent_filter_matched (&g_filter_hdcp)) {
-		// If playing or within a few seconds after a video mode switch
-		if (g_state.orig_mode.name [0] ||
-		    mstime_running (&g_ost_hdcp)) {
+		// If playing or waiting for display link after a video mode switch
+		if (g_state.orig_mode.name [0] || link_watching ()) {
 			/* HDCP turned HDMI off, turn it back on */
 			trace (1, "HDCP disabled HDMI, re-enable HDCP 1.4\n");
 			hdcp_restore (true);
+			if (actuator_fd () < 0)
+				handle_actuator ();
 		}
 
 	} else
 		trace (2, "\tUnrecognized uevent\n");
 }
 
+// check message credentials and return true if it comes from kernel
+static bool uevent_from_kernel (struct msghdr *msghdr)
+{
+	// nobody else can write into the simulated device socket
+	if (g_sim)
+		return true;
+
+	struct cmsghdr *cmsg;
+	struct ucred *ucred = NULL;
+	CMSG_FOREACH (cmsg, msghdr) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_CREDENTIALS &&
+		    cmsg->cmsg_len == CMSG_LEN (sizeof (struct ucred)))
+			ucred = (struct ucred*) CMSG_DATA (cmsg);
+	}
+
+	struct sockaddr_nl *addr = (struct sockaddr_nl *)msghdr->msg_name;
+	return ucred && (ucred->pid == 0) && (addr->nl_pid == 0);
+}
+
+// when the kernel queued the message, or now if it didn't tell
+static uint64_t uevent_stamp (struct msghdr *msghdr)
+{
+	struct cmsghdr *cmsg;
+	CMSG_FOREACH (cmsg, msghdr) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS &&
+		    cmsg->cmsg_len == CMSG_LEN (sizeof (struct timespec)))
+			return latency_from_realtime ((struct timespec *)CMSG_DATA (cmsg));
+	}
+
+	return latency_now ();
+}
+
+// account a burst of uevents received during a single wakeup
+static void uevent_burst (int count)
+{
+	if (!count)
+		return;
+
+	int bucket = 0;
+	while ((count >> (bucket + 1)) && (bucket < ARRAY_SIZE (g_afrd_stats.uevent_batch) - 1))
+		bucket++;
+	g_afrd_stats.uevent_batch [bucket]++;
+
+	// make sure the socket buffer can hold twice the largest burst
+	if (count * UEVENT_SKB_SIZE * 2 > g_uevent_rcvbuf)
+		uevent_rcvbuf (count * UEVENT_SKB_SIZE * 2);
+}
+
+// handle a raw uevent, msg must have space for trailing zero
+static void uevent_process (char *msg, ssize_t size)
+{
+	// kernel uevents are sent with the trailing zero
+	if (size && !msg [size - 1])
+		size--;
+	msg [size] = 0;
+	uevent_count (msg, size);
+	handle_uevent (msg, size);
+}
+
 static void handle_uevents ()
 {
+	struct uevent_batch_t *b = &g_uevent_batch;
+	int burst = 0;
+
 	for (;;)
 	{
-		char msg [4096];
-		struct sockaddr_nl addr;
-		struct iovec iovec = {
-			.iov_base = &msg,
-			.iov_len = sizeof (msg) - 1,
-		};
-		union {
-			struct cmsghdr cmsghdr;
-			uint8_t buf [CMSG_SPACE (sizeof (struct ucred))];
-		} control = {};
-		struct msghdr msghdr = {
-			.msg_name = &addr,
-			.msg_namelen = sizeof (addr),
-			.msg_iov = &iovec,
-			.msg_iovlen = 1,
-			.msg_control = &control,
-			.msg_controllen = sizeof (control),
-		};
-
-		ssize_t size = recvmsg (g_uevent_sock, &msghdr, MSG_DONTWAIT);
-		if (size < 0) {
-			if (errno == EAGAIN)
-				return;
-
-			continue;
+		for (int i = 0; i < UEVENT_BATCH; i++) {
+			b->iov [i].iov_base = b->msg [i];
+			b->iov [i].iov_len = sizeof (b->msg [i]) - 1;
+			b->hdr [i].msg_hdr = (struct msghdr) {
+				.msg_name = &b->addr [i],
+				.msg_namelen = sizeof (b->addr [i]),
+				.msg_iov = &b->iov [i],
+				.msg_iovlen = 1,
+				.msg_control = &b->control [i],
+				.msg_controllen = sizeof (b->control [i]),
+			};
+			b->hdr [i].msg_len = 0;
 		}
 
-		struct cmsghdr *cmsg;
-		struct ucred *ucred = NULL;
-		CMSG_FOREACH (cmsg, &msghdr) {
-			if (cmsg->cmsg_level == SOL_SOCKET &&
-			    cmsg->cmsg_type == SCM_CREDENTIALS &&
-			    cmsg->cmsg_len == CMSG_LEN (sizeof (struct ucred)))
-				ucred = (struct ucred*) CMSG_DATA (cmsg);
+		int n = recvmmsg (g_uevent_sock, b->hdr, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENOBUFS) {
+				// kernel had to drop some uevents, SEQNUM gap will tell how many
+				trace (1, "uevent socket overflow\n");
+				g_afrd_stats.uevent_overflows++;
+				g_uevent_overflow = true;
+				g_resync = true;
+				uevent_rcvbuf (g_uevent_rcvbuf * 2);
+				continue;
+			}
+
+			// EAGAIN or something unexpected
+			break;
 		}
 
-		if (!ucred || ucred->pid != 0 || addr.nl_pid != 0)
-			continue;
+		burst += n;
+		for (int i = 0; i < n; i++) {
+			if (!uevent_from_kernel (&b->hdr [i].msg_hdr))
+				continue;
+
+			g_uevent_stamp = uevent_stamp (&b->hdr [i].msg_hdr);
+			latency_since (LAT_QUEUE, g_uevent_stamp);
+			capture_uevent (b->msg [i], b->hdr [i].msg_len);
+			uevent_process (b->msg [i], b->hdr [i].msg_len);
+			g_uevent_stamp = 0;
+		}
 
-		msg [size] = 0;
-		handle_uevent (msg, size);
+		if (n < UEVENT_BATCH)
+			break;
 	}
+
+	uevent_burst (burst);
+	shmem_update ();
 }
 
 /* --------- * --------- * --------- * --------- * --------- * --------- */
@@ -978,14 +2150,6 @@ static void handle_uevents ()
 /* check config file once in 5 seconds */
 #define CONFIG_CHECK_PERIOD	5000
 
-static int min_time (int to, mstime_t *ost)
-{
-	int tost = mstime_left (ost);
-	if ((to < 0) || ((tost >= 0) && (tost < to)))
-		return tost;
-	return to;
-}
-
 static time_t mtime (const char *fn)
 {
 	struct stat st;
@@ -1014,40 +2178,260 @@ static void safe_mstime_update (int to)
 		mstime_adjust (delta_mstime, &g_ost_hdmi);
 		mstime_adjust (delta_mstime, &g_ost_blackout);
 		mstime_adjust (delta_mstime, &g_ost_config);
+		mstime_adjust (delta_mstime, &g_ost_monitor);
+		// keep the link settle deadline counting from the same moment
+		if (mstime_enabled (&g_ost_settle)) {
+			mstime_adjust (delta_mstime, &g_ost_settle);
+			g_settle.start += delta_mstime;
+		}
 	}
 }
 
 static time_t g_config_mtime;
 
-int afrd_run ()
+// apply samples from sampler thread and see if we know the frame rate now
+static void handle_samples ()
 {
-	if (g_uevent_sock == -1)
-		return -1;
+	sampler_ack ();
+	if (!apply_samples ())
+		return;
 
-	int ret = 0;
+	// re-evaluate right away instead of waiting for next poll
+	if (mstime_enabled (&g_ost_switch) && !g_state.restore &&
+	    ((g_state.hz == 0) || g_state.provisional)) {
+		mstime_disable (&g_ost_switch);
+		framerate_switch (false);
+	}
+}
 
-	trace (1, "afrd running\n");
-	mstime_update ();
+// main loop iterations longer than this are counted as stalls, microseconds
+#define LOOP_STALL_US	10000
 
-	struct pollfd pfd [16];
-	pfd [0].events = POLLIN;
-	pfd [0].fd = g_uevent_sock;
+// account the time main loop was busy and couldn't serve events
+static void loop_stall (struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	uint32_t us = (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+
+	bool changed = false;
+	if (us > g_afrd_stats.loop_stall_max) {
+		g_afrd_stats.loop_stall_max = us;
+		changed = true;
+	}
+	if (us >= LOOP_STALL_US) {
+		g_afrd_stats.loop_stalls++;
+		trace (2, "main loop was busy for %u us\n", us);
+		changed = true;
+	}
+
+	uint32_t sample_max = sampler_time_max ();
+	if (g_afrd_stats.sample_time_max != sample_max) {
+		g_afrd_stats.sample_time_max = sample_max;
+		changed = true;
+	}
+
+	if (changed)
+		shmem_update ();
+}
+
+// arm the timers at the start of main loop
+static void afrd_start ()
+{
+	mstime_update ();
 
 	mstime_disable (&g_ost_switch);
 	mstime_disable (&g_ost_hdmi);
+	g_hdmi_deferred = false;
 	mstime_disable (&g_ost_blackout);
 	mstime_disable (&g_ost_off);
-	mstime_disable (&g_ost_hdcp);
+	mstime_disable (&g_ost_monitor);
+	settle_stop ();
 
 	// Check config timestamp timer
 	mstime_arm (&g_ost_config, 1);
 	g_config_mtime = mtime (g_config);
 
-	// Check HDCP status regularily
-	mstime_arm (&g_ost_hdcp_check, 8000);
-
 	update_stats ();
 
+	// we don't know what happened while we weren't listening
+	afrd_resync ("startup");
+}
+
+// milliseconds until the next pending mode switch activity, -1 if idle
+static int afrd_busy_timeout ()
+{
+	int to = mstime_left (&g_ost_switch);
+	to = min_time (to, &g_ost_hdmi);
+	to = min_time (to, &g_ost_blackout);
+	to = min_time (to, &g_ost_settle);
+	return to;
+}
+
+// milliseconds until the next timer expires, -1 if no timers are armed
+static int afrd_timeout ()
+{
+	int to = afrd_busy_timeout ();
+	to = min_time (to, &g_ost_config);
+	to = min_time (to, &g_ost_monitor);
+
+	// attributes that have to be re-read
+	int wto = watch_timeout ();
+	if ((wto >= 0) && ((to < 0) || (wto < to)))
+		to = wto;
+	return to;
+}
+
+// handle expired timers, return true if config file has to be reloaded
+static bool afrd_timers ()
+{
+	// what we'd read while display mode is being written is not settled,
+	// the actuator will wake us up when it's done
+	if (g_resync && !actuator_busy ())
+		afrd_resync ("lost uevents");
+
+	// disable screen at start of playback
+	if (mstime_expired (&g_ost_blackout) && !g_state.restore)
+		blackout ();
+
+	// if mode switch timer expired, switch the mode finally
+	if (mstime_expired (&g_ost_switch)) {
+		mstime_disable (&g_ost_switch);
+		framerate_switch (false);
+	}
+
+	// learn how long the last mode switch took
+	if (mstime_expired (&g_ost_settle))
+		settle_check ();
+
+	// query supported video modes after HDMI has been plugged on
+	if (mstime_expired (&g_ost_hdmi)) {
+		mstime_disable (&g_ost_hdmi);
+		g_hdmi_deferred = actuator_busy ();
+		if (!g_hdmi_deferred)
+			handle_hdmi_switch (-1);
+	}
+
+	// check config timestamp and reload it if so
+	if (mstime_expired (&g_ost_config)) {
+		// if we're doing other work, don't hog the CPU
+		if (!mstime_enabled (&g_ost_blackout) &&
+		    !mstime_enabled (&g_ost_switch) &&
+		    !mstime_enabled (&g_ost_hdmi) && !g_hdmi_deferred) {
+			mstime_arm (&g_ost_config, CONFIG_CHECK_PERIOD);
+			time_t cmt = mtime (g_config);
+			if ((cmt != 0) && (cmt != g_config_mtime)) {
+				trace (1, "config file %s changed, reloading\n", g_config);
+				return true;
+			}
+		} else
+			mstime_arm (&g_ost_config, 1000);
+	}
+
+	// sample movie frame rate in background while playing
+	if (mstime_expired (&g_ost_monitor)) {
+		// in case sample gets lost, ask again later
+		mstime_arm (&g_ost_monitor, g_state.monitor.interval * 2);
+		sampler_request ((1 << SAMPLE_BLOCKS) |
+			(g_state.monitor.judging ? (1 << SAMPLE_VDEC) : 0), g_sample_gen);
+		if (sampler_fd () < 0)
+			apply_samples ();
+	}
+
+	// re-read watched attributes that don't notify about changes
+	watch_timers ();
+	// and account the writes their callbacks have done synchronously
+	if (actuator_fd () < 0)
+		handle_actuator ();
+	if (link_changed ())
+		mstime_arm (&g_ost_settle, 0);
+
+	return false;
+}
+
+// move virtual clock forward, firing all timers on the way
+static void replay_advance (mstime_t until)
+{
+	for (;;) {
+		int to = afrd_timeout ();
+		if ((to < 0) || ((int32_t)(until - g_mstime) < to))
+			break;
+
+		if (g_replay_realtime && to)
+			usleep (to * 1000);
+		g_mstime_virtual = g_mstime + to;
+		mstime_update ();
+		afrd_timers ();
+	}
+
+	if (g_replay_realtime && ((int32_t)(until - g_mstime) > 0))
+		usleep ((until - g_mstime) * 1000);
+	g_mstime_virtual = until;
+	mstime_update ();
+}
+
+// feed captured uevents into the daemon on a virtual clock
+static int afrd_replay ()
+{
+	mstime_t start = mstime_get ();
+	struct timespec wall_start, wall_end;
+	clock_gettime (CLOCK_MONOTONIC, &wall_start);
+
+	trace (1, "afrd replaying capture\n");
+	afrd_start ();
+	// config file is not watched during replay
+	mstime_disable (&g_ost_config);
+
+	int uevents = 0;
+	mstime_t stamp;
+	char *msg = g_uevent_batch.msg [0];
+	size_t size = sizeof (g_uevent_batch.msg [0]) - 1;
+	while (!g_shutdown && replay_next_uevent (&stamp, msg, &size)) {
+		replay_advance (stamp);
+		uevent_process (msg, size);
+		uevents++;
+		size = sizeof (g_uevent_batch.msg [0]) - 1;
+	}
+
+	// let the pending switches finish
+	int to;
+	while (!g_shutdown && ((to = afrd_busy_timeout ()) >= 0))
+		replay_advance (g_mstime + to);
+
+	clock_gettime (CLOCK_MONOTONIC, &wall_end);
+	trace (0, "replay: %d uevents, %d display mode writes in %u ms of virtual time (%ld ms real time)\n",
+		uevents, replay_write_count (g_mode_path), g_mstime - start,
+		(wall_end.tv_sec - wall_start.tv_sec) * 1000 +
+		(wall_end.tv_nsec - wall_start.tv_nsec) / 1000000);
+
+	return 0;
+}
+
+int afrd_run ()
+{
+	if (g_replay)
+		return afrd_replay ();
+
+	if (g_uevent_sock == -1)
+		return -1;
+
+	int ret = 0;
+
+	trace (1, "afrd running\n");
+
+	struct pollfd pfd [16];
+	pfd [0].events = POLLIN;
+	pfd [0].fd = g_uevent_sock;
+	// parsed vdec samples from sampler thread
+	pfd [1].events = POLLIN;
+	pfd [1].fd = sampler_fd ();
+	// completed display mode switches
+	pfd [2].events = POLLIN;
+	pfd [2].fd = actuator_fd ();
+
+	afrd_start ();
+
 	while (!g_shutdown) {
 		// flush log to disk
 		trace_sync ();
@@ -1055,11 +2439,7 @@ int afrd_run ()
 		// update the millisecond timer
 		safe_mstime_update (0);
 
-		int to = mstime_left (&g_ost_switch);
-		to = min_time (to, &g_ost_hdmi);
-		to = min_time (to, &g_ost_blackout);
-		to = min_time (to, &g_ost_config);
-		to = min_time (to, &g_ost_hdcp_check);
+		int to = afrd_timeout ();
 
 		// this should never happen as g_ost_config is always active, but
 		// anyway don't allow to sleep indefinitely 'cause we can't detect
@@ -1070,57 +2450,40 @@ int afrd_run ()
 		// wait until either a new uevent comes
 		// or the delayed mode switch timer expires
 		pfd [0].revents = 0;
+		pfd [1].revents = 0;
+		pfd [2].revents = 0;
+		int n_pfd = 3;
+		// sysfs attributes we watch for changes
+		n_pfd += watch_prep_poll (pfd + n_pfd, ARRAY_SIZE (pfd) - n_pfd);
 		// add API sockets into the pool
-		int n_pfd = 1 + apisock_prep_poll (pfd + 1, ARRAY_SIZE (pfd) - 1);
+		n_pfd += apisock_prep_poll (pfd + n_pfd, ARRAY_SIZE (pfd) - n_pfd);
 		int rc = poll (pfd, n_pfd, to);
 
 		// catch system time change events, this breaks our timers
 		safe_mstime_update (to);
 
+		struct timespec busy_start;
+		clock_gettime (CLOCK_MONOTONIC, &busy_start);
+
 		if (rc > 0) {
 			if (pfd [0].revents & POLLIN)
 				handle_uevents ();
+			if (pfd [1].revents & POLLIN)
+				handle_samples ();
+			if (pfd [2].revents & POLLIN)
+				handle_actuator ();
+			watch_handle (pfd, n_pfd);
+			if (link_changed ())
+				mstime_arm (&g_ost_settle, 0);
 			apisock_handle (pfd, n_pfd);
 		}
 
-		// disable screen at start of playback
-		if (mstime_expired (&g_ost_blackout) && !g_state.restore)
-			blackout ();
-
-		// if mode switch timer expired, switch the mode finally
-		if (mstime_expired (&g_ost_switch)) {
-			mstime_disable (&g_ost_switch);
-			framerate_switch (false);
-		}
-
-		// query supported video modes after HDMI has been plugged on
-		if (mstime_expired (&g_ost_hdmi)) {
-			mstime_disable (&g_ost_hdmi);
-			handle_hdmi_switch (-1);
-		}
-
-		// check config timestamp and reload it if so
-		if (mstime_expired (&g_ost_config)) {
-			// if we're doing other work, don't hog the CPU
-			if (!mstime_enabled (&g_ost_blackout) &&
-			    !mstime_enabled (&g_ost_switch) &&
-			    !mstime_enabled (&g_ost_hdmi)) {
-				mstime_arm (&g_ost_config, CONFIG_CHECK_PERIOD);
-				time_t cmt = mtime (g_config);
-				if ((cmt != 0) && (cmt != g_config_mtime)) {
-					trace (1, "config file %s changed, reloading\n", g_config);
-					ret = 1;
-					break;
-				}
-			} else
-				mstime_arm (&g_ost_config, 1000);
+		if (afrd_timers ()) {
+			ret = 1;
+			break;
 		}
 
-		// check if HDCP is supported but disabled
-		if (mstime_expired (&g_ost_hdcp_check)) {
-			mstime_arm (&g_ost_hdcp_check, 8000);
-			hdcp_check ();
-		}
+		loop_stall (&busy_start);
 	}
 
 	// restore framerate just in case
@@ -1137,6 +2500,12 @@ void afrd_frame_rate_hint (int hz)
 	mstime_arm (&g_frame_rate_hint.stamp, 1000);
 }
 
+void afrd_content_id (const char *id)
+{
+	g_content_id_hint.id = prior_content_id (id);
+	mstime_arm (&g_content_id_hint.stamp, 1000);
+}
+
 void afrd_refresh_rate (int hz)
 {
 	bool ok = (hz && (hz >= HZ_MIN) && (hz < HZ_MAX));
@@ -1157,9 +2526,16 @@ void afrd_reconf ()
 
 /* --------- * --------- * --------- * --------- * --------- * --------- */
 
-static void blacklist_rates_load (const char *kw)
+static void blacklist_rates_free ()
 {
+	free (g_mode_blacklist_rates);
+	g_mode_blacklist_rates = NULL;
 	g_mode_blacklist_rates_count = 0;
+}
+
+static void blacklist_rates_load (const char *kw)
+{
+	blacklist_rates_free ();
 
 	const char *str = cfg_get_str (kw, NULL);
 	if (!str)
@@ -1176,9 +2552,10 @@ static void blacklist_rates_load (const char *kw)
 			*next++ = 0;
 
 		float rate;
-		if ((sscanf (cur, "%f", &rate) == 1) && (rate >= 1) && (rate <= 1000) &&
-		    (g_mode_blacklist_rates_count < ARRAY_SIZE (g_mode_blacklist_rates))) {
+		if ((sscanf (cur, "%f", &rate) == 1) && (rate >= 1) && (rate <= 1000)) {
 			int irate = (int)(256.0 * rate + 0.5);
+			g_mode_blacklist_rates = (int *)realloc (g_mode_blacklist_rates,
+				sizeof (int) * (g_mode_blacklist_rates_count + 1));
 			g_mode_blacklist_rates [g_mode_blacklist_rates_count] = irate;
 			g_mode_blacklist_rates_count++;
 			trace (2, "\t+ "HZ_FMT"Hz\n", HZ_ARGS (irate));
@@ -1196,7 +2573,9 @@ int afrd_init ()
 	if (!g_cfg && (load_config (g_config) != 0))
 		return -1;
 
-	shmem_init (false);
+	// replay must not disturb the running daemon
+	if (!g_replay)
+		shmem_init (false);
 	androp_init ();
 
 	int log_enable = (cfg_get_int ("log.enable", 1) != 0);
@@ -1225,6 +2604,7 @@ int afrd_init ()
 	g_hdmi_state = cfg_get_str ("hdmi.state", DEFAULT_HDMI_STATE);
 
 	g_mode_path = cfg_get_str ("mode.path", DEFAULT_VIDEO_MODE);
+	g_mode_info = cfg_get_str ("mode.info", DEFAULT_VIDEO_INFO);
 	g_mode_prefer_exact = cfg_get_int ("mode.prefer.exact", DEFAULT_MODE_PREFER_EXACT);
 	g_mode_use_fract = cfg_get_int ("mode.use.fract", DEFAULT_MODE_USE_FRACT);
 	blacklist_rates_load ("mode.blacklist.rates");
@@ -1239,6 +2619,7 @@ int afrd_init ()
 	g_switch_blackout = cfg_get_int ("switch.blackout", DEFAULT_SWITCH_BLACKOUT);
 	g_switch_ignore = cfg_get_int ("switch.ignore", DEFAULT_SWITCH_IGNORE);
 	g_switch_hdmi = cfg_get_int ("switch.hdmi", DEFAULT_SWITCH_HDMI);
+	g_switch_link = cfg_get_int ("switch.link", DEFAULT_SWITCH_LINK);
 
 	trace (1, "\tswitch delays: on %d, off %d, retry %d ms\n",
 		g_switch_delay_on, g_switch_delay_off, g_switch_delay_retry);
@@ -1253,13 +2634,40 @@ int afrd_init ()
 	uevent_filter_load (&g_filter_hdmi, "uevent.filter.hdmi");
 	uevent_filter_load (&g_filter_hdcp, "uevent.filter.hdcp");
 
-	if (!uevent_open (16 * 1024)) {
-		trace (0, "failed to open uevent socket");
-		return EPERM;
+	uevent_classifier_init (&g_classifier);
+	uevent_classifier_add (&g_classifier, &g_filter_frhint);
+	uevent_classifier_add (&g_classifier, &g_filter_vdec);
+	uevent_classifier_add (&g_classifier, &g_filter_hdmi);
+	uevent_classifier_add (&g_classifier, &g_filter_hdcp);
+
+	g_hash_frame_rate_hint = uevent_hash ("FRAME_RATE_HINT", 15);
+	g_hash_frame_rate_end_hint = uevent_hash ("FRAME_RATE_END_HINT", 19);
+	g_hash_action = uevent_hash ("ACTION", 6);
+	g_hash_modalias = uevent_hash ("MODALIAS", 8);
+	g_hash_devpath = uevent_hash ("DEVPATH", 7);
+
+	if (g_sim && !sim_init (g_hdmi_state, g_mode_info, g_vdec_sysfs))
+		return -1;
+
+	if (!g_replay) {
+		if (!uevent_open (UEVENT_RCVBUF_MIN)) {
+			trace (0, "failed to open uevent socket");
+			return EPERM;
+		}
+		uevent_attach_filter ();
 	}
 
+	sysfs_attr_init (&g_attr_hdmi_state, g_hdmi_state, NULL);
+	watch_add (&g_attr_hdmi_state, 0, hdmi_state_watch);
+	sysfs_attr_init (&g_attr_vdec_status, g_vdec_sysfs, "vdec_status");
+	display_attr_init ();
+	link_init (g_hdmi_state, g_mode_info);
 	colorspace_init ();
-	apisock_init ();
+	sampler_init (g_vdec_sysfs);
+	actuator_init ();
+	prior_init ();
+	if (!g_replay)
+		apisock_init ();
 	handle_hdmi_switch (1);
 
 	return 0;
@@ -1269,24 +2677,35 @@ void afrd_fini ()
 {
 	handle_hdmi_switch (0);
 	apisock_fini ();
+	sampler_fini ();
+	actuator_fini ();
+	prior_fini ();
 	colorspace_fini ();
+	link_fini ();
+	display_attr_fini ();
+	watch_remove (&g_attr_hdmi_state);
+	sysfs_attr_fini (&g_attr_hdmi_state);
+	sysfs_attr_fini (&g_attr_vdec_status);
 
 	if (g_uevent_sock != -1) {
 		close (g_uevent_sock);
 		g_uevent_sock = -1;
 	}
+	if (g_sim)
+		sim_fini ();
 
 	uevent_filter_fini (&g_filter_frhint);
 	uevent_filter_fini (&g_filter_vdec);
 	uevent_filter_fini (&g_filter_hdmi);
 	uevent_filter_fini (&g_filter_hdcp);
 	strlist_free (&g_vdec_blacklist);
-	g_mode_blacklist_rates_count = 0;
+	blacklist_rates_free ();
 
 	g_enable = false;
 	g_hdmi_dev = NULL;
 	g_hdmi_state = NULL;
 	g_mode_path = NULL;
+	g_mode_info = NULL;
 	g_vdec_sysfs = NULL;
 
 	if (g_cfg) {
@@ -1302,6 +2721,8 @@ void afrd_fini ()
 void afrd_emerg ()
 {
 	shmem_emerg ();
+	// the thread may be stuck in the driver, write from here
+	actuator_detach ();
 	if (g_state.orig_mode.name [0])
 		framerate_restore (false);
 }
@@ -15,10 +15,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <poll.h>
 
 #include "mstime.h"
+#include "latency.h"
 #include "cfg_parse.h"
 
 // uncomment for more verbose debug messages
@@ -30,6 +32,7 @@
 #define DEFAULT_HDMI_DEV		"/sys/class/amhdmitx/amhdmitx0"
 #define DEFAULT_HDMI_STATE		"/sys/class/switch/hdmi/state"
 #define DEFAULT_VIDEO_MODE		"/sys/class/display/mode"
+#define DEFAULT_VIDEO_INFO		"/sys/class/display/vinfo"
 #define DEFAULT_VDEC_SYSFS		"/sys/class/vdec"
 #define DEFAULT_HDCP_AUTHENTICATED	"/sys/module/hdmitx20/parameters/hdmi_authenticated"
 #define DEFAULT_SWITCH_DELAY_ON		250
@@ -39,7 +42,7 @@
 #define DEFAULT_SWITCH_BLACKOUT		150
 #define DEFAULT_SWITCH_IGNORE		200
 #define DEFAULT_SWITCH_HDMI		2000
-#define DEFAULT_SWITCH_HDCP		2000
+#define DEFAULT_SWITCH_LINK		5000
 #define DEFAULT_MODE_PREFER_EXACT	0
 #define DEFAULT_MODE_USE_FRACT		0
 
@@ -54,8 +57,41 @@ typedef struct
 	int framerate;
 	bool interlaced;
 	bool fractional;
+	// display accepts the fractional variant of this mode
+	bool fract_ok;
 } display_mode_t;
 
+/// kinds of display mode transitions, they keep the screen dark for different time
+typedef enum
+{
+	/// same mode, only fractional rate changes (goes through null mode)
+	SWITCH_FRAC,
+	/// another refresh rate of same resolution
+	SWITCH_RATE,
+	/// another resolution, or the screen was disabled before
+	SWITCH_FULL,
+
+	/// number of transition kinds
+	SWITCH_TYPES
+} switch_type_t;
+
+/// display control writes to be done by the actuator thread
+typedef struct
+{
+	/// display mode to set, empty name to just disable the screen
+	display_mode_t mode;
+	/// go through null mode before setting the mode
+	bool null;
+	/// color space to set before the mode, empty to leave it as is
+	char cs [32];
+	/// HDCP mode to restore after the switch, 0 for none
+	int hdcp;
+	/// write HDCP mode even if it is known to be set, to restart authentication
+	bool hdcp_restart;
+	/// leave display mode as is, just write HDCP mode
+	bool hdcp_only;
+} display_plan_t;
+
 #define HZ_FMT		"%u.%02u"
 #define HZ_ARGS(hz)	((hz) >> 8), ((100 * ((hz) & 255) + 128) >> 8)
 
@@ -97,6 +133,10 @@ extern display_mode_t *g_modes;
 extern int g_modes_n;
 // current video mode
 extern display_mode_t g_current_mode;
+// identifies the display by its EDID or the set of modes it supports, 0 if unknown
+extern uint32_t g_display_id;
+// hash of connected display EDID, 0 if unknown
+extern uint32_t g_display_edid;
 // true if screen is disabled
 extern bool g_blackened;
 // the delay before switching display mode
@@ -120,31 +160,53 @@ extern int afrd_run ();
 extern void afrd_fini ();
 extern void afrd_emerg ();
 
+// open display mode sysfs attributes
+extern void display_attr_init ();
+// close display mode sysfs attributes
+extern void display_attr_fini ();
 // read the list of all supported display modes and current display mode
 extern int display_modes_init ();
 // free the list of supported modes
 extern void display_modes_fini ();
+// use a known list of supported modes of display with given EDID hash
+extern void display_modes_set (const display_mode_t *modes, int count, uint32_t edid_id);
+// read EDID of connected display and return its hash, 0 if none
+extern uint32_t display_edid_id ();
 // query the current video mode
 extern void display_mode_get_current ();
 // check if two display modes have same attributes
 extern bool display_mode_equal (display_mode_t *mode1, display_mode_t *mode2);
 // return display mode refresh rate in 24.8 fixed-point format
-extern int display_mode_hz (display_mode_t *mode);
+extern int display_mode_hz (const display_mode_t *mode);
+// fractional variant of integer framerate in 24.8 fixed-point format, 0 if none
+extern int display_mode_frac_hz (int framerate);
 // set fractional framerate if that is closer to hz (24.8 fixed-point)
 extern void display_mode_set_hz (display_mode_t *mode, int hz);
-// switch video mode
-extern void display_mode_switch (display_mode_t *mode, bool force);
+// the kind of transition from current display mode to given one
+extern switch_type_t display_mode_transition (display_mode_t *mode, bool force);
+// switch video mode, return false if mode is already set
+extern bool display_mode_switch (display_mode_t *mode, bool force);
 // disable the screen
 extern void display_mode_null ();
+// do the display control writes of a plan, return true if display mode was set
+// (runs on actuator thread)
+extern bool display_plan_run (const display_plan_t *plan, latency_steps_t *steps);
 
 // detect current HDCP mode
 extern void hdcp_init ();
 // terminate HDCP stuff
 extern void hdcp_fini ();
-// restore HDCP state as detected
+// HDCP mode as detected: 0 - not supported, 1 - HDCP 1.4, 2 - HDCP 2.2
+extern int hdcp_mode ();
+// use a known HDCP mode instead of detecting it
+extern void hdcp_set_mode (int mode);
+// restore HDCP state as detected, the write is queued to the actuator
 extern void hdcp_restore (bool force);
-// check if HDCP is supported but disabled and enable it back if so
-extern void hdcp_check ();
+// the HDCP mode to restore after a display mode switch, 0 if none
+extern int hdcp_plan ();
+// set HDCP mode unless the driver has kept it, or always if restart
+// is true (runs on actuator thread)
+extern void hdcp_apply (int mode, bool restart);
 
 // load config from file
 extern int load_config (const char *config);
@@ -153,9 +215,8 @@ extern const char *cfg_get_str (const char *key, const char *defval);
 extern int cfg_get_int (const char *key, int defval);
 
 // helper functions for sysfs
-extern char *sysfs_read (const char *device_attr);
-// unlike _read, removes trailing spaces and newlines
-extern char *sysfs_get_str (const char *device, const char *attr);
+// read attribute into buffer, zero-terminate, return length or -1 on error
+extern int sysfs_read_buf (const char *device_attr, char *buf, size_t size);
 extern int sysfs_get_int (const char *device, const char *attr);
 
 extern int sysfs_write (const char *device_attr, const char *value);
@@ -164,6 +225,66 @@ extern int sysfs_set_int (const char *device, const char *attr, int value);
 
 extern int sysfs_exists (const char *device_attr);
 
+/// a persistent handle to a sysfs attribute
+typedef struct
+{
+	/// full path to the attribute
+	char path [128];
+	/// file descriptors for reading and writing, -1 if not open; reads and
+	/// polls are done by main thread, writes by the actuator thread
+	int rfd, wfd;
+	/// generations of the handles, each thread reopens its file when
+	/// sysfs_invalidate() is called
+	unsigned rgen, wgen;
+	/// true for control attributes written with sysfs_attr_set()
+	atomic_bool control;
+	/// last value written to or read from a control attribute
+	char value [32];
+	/// value generation, it is trusted until sysfs_forget() is called
+	unsigned value_gen;
+} sysfs_attr_t;
+
+// set the path to attribute (device/attr, or just device if attr is NULL)
+extern void sysfs_attr_init (sysfs_attr_t *sa, const char *device, const char *attr);
+// close the attribute files, only when no other thread uses the attribute
+extern void sysfs_attr_fini (sysfs_attr_t *sa);
+// read attribute into caller buffer, zero-terminate, return length or -1 on error
+extern int sysfs_attr_read (sysfs_attr_t *sa, char *buf, size_t size);
+// the descriptor to poll() for POLLPRI change notifications, -1 if none
+extern int sysfs_attr_poll_fd (sysfs_attr_t *sa);
+// same but strips spaces, returns a pointer inside buf or NULL on error
+extern char *sysfs_attr_get_str (sysfs_attr_t *sa, char *buf, size_t size);
+extern int sysfs_attr_get_int (sysfs_attr_t *sa);
+extern int sysfs_attr_write (sysfs_attr_t *sa, const char *value);
+// write a control attribute unless it is known to hold this value already,
+// return 0 if written, 1 if skipped, -1 on error
+extern int sysfs_attr_set (sysfs_attr_t *sa, const char *value);
+// read a control attribute to learn what it holds, from the thread writing it
+extern int sysfs_attr_reread (sysfs_attr_t *sa);
+// write a control attribute even if it is known to hold this value already,
+// for writes that have side effects; return 0 if written, -1 on error
+extern int sysfs_attr_force (sysfs_attr_t *sa, const char *value);
+// reopen all attribute handles on next access (hotplug, reload)
+extern void sysfs_invalidate ();
+// forget known values of control attributes, someone else may have changed them
+extern void sysfs_forget ();
+// copy the value a control attribute is known to hold into buf, NULL if unknown
+extern const char *sysfs_attr_known (sysfs_attr_t *sa, char *buf, size_t size);
+// get the number of control attribute writes done and skipped as redundant
+extern void sysfs_write_stats (uint32_t *written, uint32_t *skipped);
+
+/// something that serves sysfs attributes instead of the kernel
+typedef struct
+{
+	/// read attribute into buffer, zero-terminate, return length or -1 on error
+	int (*read) (const char *path, char *buf, size_t size);
+	/// write value into attribute, return 0 or -1 on error
+	int (*write) (const char *path, const char *value);
+} sysfs_backend_t;
+
+// route all sysfs traffic to backend, NULL to talk to the kernel
+extern void sysfs_backend (const sysfs_backend_t *backend);
+
 // " \t\r\n"
 extern const char *spaces;
 
@@ -173,10 +294,118 @@ extern int strskip (const char *str, const char *starts);
 extern void strip_trailing_spaces (char *eol, const char *start);
 // Evaluates the number pointed by line until a non-digit is encountered
 extern int parse_int (char **line);
-// Similar but first looks for number prefix in line and sets ok to false on error
-extern unsigned long find_ulong (const char *str, const char *prefix, bool *ok);
-// Same but returns a unsigned long long
-extern unsigned long long find_ulonglong (const char *str, const char *prefix, bool *ok);
+
+/**
+ * A piece of text inside a caller buffer, not zero-terminated.
+ * The functions below tokenize sysfs attribute contents in place,
+ * without copying anything or building intermediate strings.
+ */
+typedef struct
+{
+	char *str;
+	size_t len;
+} strspan_t;
+
+// Return true for the characters strspan_word () and strspan_trim () skip
+static inline bool strspan_space (char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+// Make a span from a pointer and length
+static inline strspan_t strspan (char *str, size_t len)
+{
+	strspan_t s = { str, len };
+	return s;
+}
+
+// Cut the next token up to sep from s, return false if s is exhausted
+static inline bool strspan_next (strspan_t *s, char sep, strspan_t *tok)
+{
+	if (!s->len)
+		return false;
+
+	char *end = (char *)memchr (s->str, sep, s->len);
+	tok->str = s->str;
+	if (end) {
+		tok->len = end - s->str;
+		s->len -= tok->len + 1;
+		s->str = end + 1;
+	} else {
+		tok->len = s->len;
+		s->str += s->len;
+		s->len = 0;
+	}
+
+	return true;
+}
+
+// Cut the next space-delimited word from s, return false if there are no more
+static inline bool strspan_word (strspan_t *s, strspan_t *tok)
+{
+	while (s->len && strspan_space (*s->str)) {
+		s->str++;
+		s->len--;
+	}
+	if (!s->len)
+		return false;
+
+	tok->str = s->str;
+	while (s->len && !strspan_space (*s->str)) {
+		s->str++;
+		s->len--;
+	}
+	tok->len = s->str - tok->str;
+
+	// step over the delimiter, so that strspan_cstr () can't break s
+	if (s->len) {
+		s->str++;
+		s->len--;
+	}
+	return true;
+}
+
+// Strip leading and trailing spaces
+extern void strspan_trim (strspan_t *s);
+// Split s at first sep into trimmed key and value, return false if no sep
+extern bool strspan_kv (const strspan_t *s, char sep, strspan_t *key, strspan_t *val);
+
+// Return true if span equals str
+static inline bool strspan_eq (const strspan_t *s, const char *str)
+{
+	size_t len = strlen (str);
+	return (s->len == len) && (memcmp (s->str, str, len) == 0);
+}
+
+// Return true if span starts with prefix
+static inline bool strspan_starts (const strspan_t *s, const char *prefix)
+{
+	size_t len = strlen (prefix);
+	return (s->len >= len) && (memcmp (s->str, prefix, len) == 0);
+}
+
+// Parse the decimal number at span start, advance past it; sets ok to false if no digits
+static inline unsigned long long strspan_ull (strspan_t *s, bool *ok)
+{
+	unsigned long long v = 0;
+	size_t n = 0;
+
+	while ((n < s->len) && (s->str [n] >= '0') && (s->str [n] <= '9')) {
+		v = (v * 10) + (s->str [n] - '0');
+		n++;
+	}
+
+	if (!n)
+		*ok = false;
+	s->str += n;
+	s->len -= n;
+	return v;
+}
+
+// Find prefix in span and parse the number after it, sets ok to false on error
+extern unsigned long long strspan_find_ull (const strspan_t *s, const char *prefix, bool *ok);
+// Zero-terminate span in place, overwriting the separator after it
+extern char *strspan_cstr (strspan_t *s);
 
 typedef struct
 {
@@ -216,6 +445,51 @@ typedef struct
 	uint32_t original_hz;
 	/// afrd version suffix
 	char ver_sfx [8];
+	/// number of uevents received from kernel
+	uint32_t uevents_received;
+	/// number of uevents dropped by socket filter (wakeups avoided)
+	uint32_t uevents_filtered;
+	/// number of uevents lost because of socket overflow; with socket filter
+	/// an upper bound, as it includes uevents filtered off around the overflow
+	uint32_t uevents_dropped;
+	/// number of socket overflows (ENOBUFS)
+	uint32_t uevent_overflows;
+	/// histogram of uevents received per wakeup: 1, 2-3, 4-7, 8-15, 16-31, 32+
+	uint32_t uevent_batch [6];
+	/// longest main loop iteration, microseconds
+	uint32_t loop_stall_max;
+	/// number of main loop iterations longer than 10ms
+	uint32_t loop_stalls;
+	/// longest time to read and parse a vdec attribute, microseconds
+	uint32_t sample_time_max;
+	/// number of active video decoders
+	uint32_t vdec_decoders;
+	/// number of channels in last vdec_status sample
+	uint32_t vdec_channels;
+	/// number of frame rate samples taken during playback
+	uint32_t monitor_samples;
+	/// total time spent on taking them, microseconds
+	uint32_t monitor_time;
+	/// number of times frame rate changed during playback
+	uint32_t monitor_switches;
+	/// judder and drop score of last evaluated playback, 1/1000 of frames
+	uint32_t judder_score;
+	/// number of display refresh rates demoted for a movie frame rate
+	uint32_t judder_demotions;
+	/// number of times a known display was plugged in and cached modes used
+	uint32_t display_cache_hits;
+	/// time for display link to settle after last mode switch, ms
+	uint32_t switch_settle_ms;
+	/// histograms of mode switch step durations, see latency_phase_t
+	uint32_t latency [LAT_PHASES][LATENCY_BUCKETS];
+	/// number of control attribute writes done, and skipped as they would change nothing
+	uint32_t sysfs_writes;
+	uint32_t sysfs_writes_skipped;
+	/// display mode switches replaced by newer ones before they started
+	uint32_t switches_superseded;
+	/// display mode switches after which display link came back, or did not
+	uint32_t switches_settled;
+	uint32_t switches_failed;
 	/// a copy of crc32 from first field
 	uint32_t crc32_copy;
 } __attribute__((packed)) afrd_shmem_t;
@@ -223,6 +497,8 @@ typedef struct
 // afrd statistics
 extern afrd_shmem_t g_afrd_stats;
 
+// build the path to a file in the directory where afrd.ipc lives
+extern void shmem_file_path (char *path, size_t size, const char *name);
 // initialize shared-memory stats
 extern bool shmem_init (bool read);
 // finalize the shared memory object
@@ -245,6 +521,8 @@ extern void apisock_handle (struct pollfd *pfd, int pfd_count);
 
 // afrd API: next video starting in <1.0 sec will use this frame rate
 extern void afrd_frame_rate_hint (int hz);
+// afrd API: next video starting in <1.0 sec has this content id
+extern void afrd_content_id (const char *id);
 // afrd API: set display refresh rate
 extern void afrd_refresh_rate (int hz);
 // afrd API: reload configuration file
@@ -113,9 +113,11 @@ static void apisock_cmd (char *cmd, int fd, struct sockaddr *src_addr, socklen_t
 			static const char *help =
 				"help\n\tdisplay this help text\n"
 				"frame_rate_hint <fr>\n\ttell afrd the video starting in <1.0 seconds will use <fr>/1000 frames per second (e.g. 23976 = 23.976 fps)\n"
+				"content_id <id>\n\ttell afrd the video starting in <1.0 seconds is identified by <id>, to recall its frame rate next time\n"
 				"refresh_rate <rr>\n\ttell afrd to set display refresh rate as close to <rr>/1000 Hz as possible, no arg to restore original rate\n"
 				"color_space <cs>\n\toverride colorspace, empty arg to restore default behavior\n"
 				"status\n\tget current afrd status\n"
+				"latency\n\tget mode switch step durations: count, p50 and p99 in microseconds, histogram\n"
 				"reconf\n\ttell afrd to reload configuration file as soon as possible\n";
 			sendto (fd, help, strlen (help), 0, src_addr, addrlen);
 		} else if (apisock_is_cmd (&cmd, "frame_rate_hint")) {
@@ -123,8 +125,12 @@ static void apisock_cmd (char *cmd, int fd, struct sockaddr *src_addr, socklen_t
 			cmd += strspn (cmd, spaces);
 			if (!*cmd)
 				afrd_frame_rate_hint ((fr * 256) / 1000);
+		} else if (apisock_is_cmd (&cmd, "content_id")) {
+			if (*cmd)
+				afrd_content_id (cmd);
+			cmd = strchr (cmd, 0);
 		} else if (apisock_is_cmd (&cmd, "status")) {
-			char status [200];
+			char status [1024];
 			int sl = snprintf (status, sizeof (status),
 				"stamp:%d\n"
 				"enabled:%d\n"
@@ -133,7 +139,29 @@ static void apisock_cmd (char *cmd, int fd, struct sockaddr *src_addr, socklen_t
 				"version:%d.%d.%d\n"
 				"build:%s\n"
 				"current hz:%d\n"
-				"original hz:%d\n",
+				"original hz:%d\n"
+				"uevents:%u\n"
+				"uevents filtered:%u\n"
+				"uevents dropped:%u\n"
+				"uevent overflows:%u\n"
+				"uevent batches:%u %u %u %u %u %u\n"
+				"loop stall max:%u\n"
+				"loop stalls:%u\n"
+				"sample time max:%u\n"
+				"decoders:%u\n"
+				"vdec channels:%u\n"
+				"monitor samples:%u\n"
+				"monitor time:%u\n"
+				"monitor switches:%u\n"
+				"judder score:%u\n"
+				"judder demotions:%u\n"
+				"display cache hits:%u\n"
+				"switch settle ms:%u\n"
+				"sysfs writes:%u\n"
+				"sysfs writes skipped:%u\n"
+				"switches superseded:%u\n"
+				"switches settled:%u\n"
+				"switches failed:%u\n",
 				g_afrd_stats.crc32,
 				g_afrd_stats.enabled ? 1 : 0,
 				g_afrd_stats.switched ? 1 : 0,
@@ -141,8 +169,48 @@ static void apisock_cmd (char *cmd, int fd, struct sockaddr *src_addr, socklen_t
 				g_afrd_stats.ver_major, g_afrd_stats.ver_minor, g_afrd_stats.ver_micro,
 				g_afrd_stats.bdate,
 				g_afrd_stats.current_hz * 1000 / 256,
-				g_afrd_stats.original_hz * 1000 / 256);
+				g_afrd_stats.original_hz * 1000 / 256,
+				g_afrd_stats.uevents_received,
+				g_afrd_stats.uevents_filtered,
+				g_afrd_stats.uevents_dropped,
+				g_afrd_stats.uevent_overflows,
+				g_afrd_stats.uevent_batch [0], g_afrd_stats.uevent_batch [1],
+				g_afrd_stats.uevent_batch [2], g_afrd_stats.uevent_batch [3],
+				g_afrd_stats.uevent_batch [4], g_afrd_stats.uevent_batch [5],
+				g_afrd_stats.loop_stall_max,
+				g_afrd_stats.loop_stalls,
+				g_afrd_stats.sample_time_max,
+				g_afrd_stats.vdec_decoders,
+				g_afrd_stats.vdec_channels,
+				g_afrd_stats.monitor_samples,
+				g_afrd_stats.monitor_time,
+				g_afrd_stats.monitor_switches,
+				g_afrd_stats.judder_score,
+				g_afrd_stats.judder_demotions,
+				g_afrd_stats.display_cache_hits,
+				g_afrd_stats.switch_settle_ms,
+				g_afrd_stats.sysfs_writes,
+				g_afrd_stats.sysfs_writes_skipped,
+				g_afrd_stats.switches_superseded,
+				g_afrd_stats.switches_settled,
+				g_afrd_stats.switches_failed);
 			sendto (fd, status, sl, 0, src_addr, addrlen);
+		} else if (apisock_is_cmd (&cmd, "latency")) {
+			char reply [4096];
+			int sl = 0;
+			for (int phase = 0; (phase < LAT_PHASES) && (sl < sizeof (reply)); phase++) {
+				sl += snprintf (reply + sl, sizeof (reply) - sl, "%s:%u %u %u",
+					latency_phase_name (phase), latency_count (phase),
+					latency_percentile (phase, 50), latency_percentile (phase, 99));
+				for (int i = 0; (i < LATENCY_BUCKETS) && (sl < sizeof (reply)); i++)
+					sl += snprintf (reply + sl, sizeof (reply) - sl, "%s%u",
+						i ? "," : " ", g_afrd_stats.latency [phase][i]);
+				if (sl < sizeof (reply))
+					sl += snprintf (reply + sl, sizeof (reply) - sl, "\n");
+			}
+			if (sl > sizeof (reply))
+				sl = sizeof (reply);
+			sendto (fd, reply, sl, 0, src_addr, addrlen);
 		} else if (apisock_is_cmd (&cmd, "reconf")) {
 			afrd_reconf ();
 		} else if (apisock_is_cmd (&cmd, "refresh_rate")) {
@@ -0,0 +1,53 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Common stuff for standalone benchmarks and checks.
+ *
+ * The benchmarks link the afrd modules they exercise directly,
+ * so this provides what main.c does for the daemon.
+ */
+
+#include "bench.h"
+
+#include <time.h>
+#include <stdarg.h>
+
+struct cfg_struct *g_cfg = NULL;
+int g_verbose = 0;
+int g_bench_failed = 0;
+
+void trace (int level, const char *format, ...)
+{
+	if (level > g_verbose)
+		return;
+
+	va_list args;
+	va_start (args, format);
+	vprintf (format, args);
+	va_end (args);
+}
+
+uint64_t bench_ns ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_fail (const char *format, ...)
+{
+	printf ("FAIL: ");
+	va_list args;
+	va_start (args, format);
+	vprintf (format, args);
+	va_end (args);
+	g_bench_failed++;
+}
+
+void bench_report (const char *name, uint64_t ns, unsigned iterations)
+{
+	printf ("  %-28s %8.1f ns\n", name, (double)ns / iterations);
+}
@@ -0,0 +1,25 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Common stuff for standalone benchmarks and checks
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "afrd.h"
+
+/// number of failed checks so far
+extern int g_bench_failed;
+
+/// nanoseconds on the monotonic clock
+extern uint64_t bench_ns ();
+/// report a failed check
+extern void bench_fail (const char *format, ...) __attribute__((format(printf,1,2)));
+/// print the time per iteration of a benchmark loop
+extern void bench_report (const char *name, uint64_t ns, unsigned iterations);
+
+#endif /* __BENCH_H__ */
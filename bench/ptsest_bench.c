@@ -0,0 +1,207 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Feeds the PTS frame rate estimator with dump_vdec_chunks-like
+ * timestamp windows of synthetic streams, checks that it never settles
+ * on a wrong frame rate and counts the polls it takes to decide.
+ */
+
+#include "bench.h"
+#include "ptsest.h"
+
+// number of chunks in every dump, like the simulated decoder
+#define DUMP_CHUNKS		16
+// give up if the estimator didn't decide after that many polls
+#define MAX_POLLS		40
+// number of polls timed for the cost per poll
+#define BENCH_POLLS		200000
+
+// the frame rates the estimator knows about, .8 fixed-point
+static const int g_rates [] =
+{
+	FP8 (23,976), FP8 (24,000), FP8 (25,000), FP8 (29,970),
+	FP8 (30,000), FP8 (50,000), FP8 (59,940), FP8 (60,000),
+};
+
+static const struct
+{
+	const char *name;
+	// milliseconds between polls
+	int poll;
+	// timestamps rounded to this many microseconds
+	int round;
+	// timestamps randomly off by up to this many microseconds
+	int jitter;
+	// percent of frames missing from the stream
+	int drop;
+	// false if timestamps may be too rough to ever tell 59.94 from 60
+	bool decide;
+} g_cases [] =
+{
+	{ "exact, 250ms polls", 250, 1, 0, 0, true },
+	{ "exact, 500ms polls", 500, 1, 0, 0, true },
+	{ "pts in ms", 250, 1000, 0, 0, true },
+	{ "jitter 500us", 250, 1, 500, 0, true },
+	{ "10% frames dropped", 250, 1, 0, 10, true },
+	{ "pts in ms, jitter, drops", 500, 1000, 300, 5, false },
+};
+
+static uint32_t g_seed;
+
+// a small reproducible PRNG (xorshift32)
+static uint32_t bench_rand ()
+{
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 17;
+	g_seed ^= g_seed << 5;
+	return g_seed;
+}
+
+// the pts of every frame and whether it's in the stream at all
+static uint64_t g_pts [MAX_POLLS * 60 + DUMP_CHUNKS];
+static bool g_dropped [MAX_POLLS * 60 + DUMP_CHUNKS];
+
+static void make_stream (int c, int hz)
+{
+	g_seed = 0x9e3779b9U ^ (hz * 7919) ^ c;
+	for (int f = 0; f < ARRAY_SIZE (g_pts); f++) {
+		int64_t pts = (f * 256000000ULL + hz / 2) / hz;
+		if (g_cases [c].jitter)
+			pts += (int)(bench_rand () % (2 * g_cases [c].jitter + 1)) - g_cases [c].jitter;
+		pts = ((pts + g_cases [c].round / 2) / g_cases [c].round) * g_cases [c].round;
+		g_pts [f] = 10000000 + pts;
+		g_dropped [f] = (bench_rand () % 100) < g_cases [c].drop;
+	}
+}
+
+// the chunks waiting to be decoded at some time, in decode order: I/P, then two Bs
+static int dump_chunks (int hz, int ms, uint64_t *pts)
+{
+	static const int reorder [4] = { 0, 3, 1, 2 };
+	int first = (int)(((uint64_t)ms * hz) / 256000) & ~3;
+	int n = 0;
+	for (int i = 0; i < DUMP_CHUNKS; i++) {
+		int chunk = first + (i & ~3) + reorder [i & 3];
+		if (!g_dropped [chunk])
+			pts [n++] = g_pts [chunk];
+	}
+	return n;
+}
+
+// the known frame rate closest to estimator output
+static int nearest_rate (int hz)
+{
+	int best = 0;
+	for (int i = 1; i < ARRAY_SIZE (g_rates); i++)
+		if (abs (g_rates [i] - hz) < abs (g_rates [best] - hz))
+			best = i;
+	return g_rates [best];
+}
+
+// run a stream by the estimator, print polls and intervals till decision and lock
+static void check_stream (int c, int hz)
+{
+	pts_est_t est;
+	pts_est_reset (&est);
+	make_stream (c, hz);
+
+	int decided = 0, decided_samples = 0, locked = 0;
+	for (int poll = 1; poll <= MAX_POLLS && !locked; poll++) {
+		uint64_t pts [DUMP_CHUNKS];
+		int n = dump_chunks (hz, poll * g_cases [c].poll, pts);
+		pts_est_feed (&est, pts, n);
+
+		int confidence;
+		int raw_hz = pts_est_hz (&est, &confidence);
+		// afrd ignores the estimator below 50% confidence
+		if (confidence < 50)
+			continue;
+
+		if (nearest_rate (raw_hz) != hz) {
+			bench_fail ("%s, "HZ_FMT"fps: estimated "HZ_FMT"fps at poll %d, confidence %d%%\n",
+				g_cases [c].name, HZ_ARGS (hz), HZ_ARGS (raw_hz), poll, confidence);
+			return;
+		}
+
+		if (!decided) {
+			decided = poll;
+			decided_samples = est.samples;
+		}
+		if (est.locked_at)
+			locked = poll;
+	}
+
+	if (!decided && g_cases [c].decide) {
+		bench_fail ("%s, "HZ_FMT"fps: no decision after %d polls\n",
+			g_cases [c].name, HZ_ARGS (hz), MAX_POLLS);
+		return;
+	}
+
+	printf ("  %-26s %6u.%02u ", g_cases [c].name, HZ_ARGS (hz));
+	if (decided)
+		printf ("%5d %9d ", decided, decided_samples);
+	else
+		printf ("%5s %9s ", "-", "-");
+	if (locked)
+		printf ("%6d %9u\n", locked, est.locked_at);
+	else
+		printf ("%6s %9s\n", "-", "-");
+}
+
+// time a poll: feeding a dump and asking for the frame rate
+static void bench_polls ()
+{
+	static uint64_t dumps [64][DUMP_CHUNKS];
+	static int dump_size [64];
+
+	int hz = FP8 (23,976);
+	make_stream (0, hz);
+	for (int i = 0; i < ARRAY_SIZE (dumps); i++)
+		dump_size [i] = dump_chunks (hz, (i + 1) * 250, dumps [i]);
+
+	pts_est_t est;
+	pts_est_reset (&est);
+	int confidence, sum = 0;
+
+	uint64_t start = bench_ns ();
+	for (int n = 0; n < BENCH_POLLS; n++) {
+		int i = n % ARRAY_SIZE (dumps);
+		if (!i)
+			pts_est_reset (&est);
+
+		uint64_t pts [DUMP_CHUNKS];
+		memcpy (pts, dumps [i], dump_size [i] * sizeof (pts [0]));
+		pts_est_feed (&est, pts, dump_size [i]);
+		sum += pts_est_hz (&est, &confidence);
+	}
+	bench_report ("feed and estimate", bench_ns () - start, BENCH_POLLS);
+
+	// keep the compiler from dropping the loop
+	if (!sum)
+		bench_fail ("no frame rate estimated\n");
+}
+
+int main (int argc, char **argv)
+{
+	if ((argc > 1) && (strcmp (argv [1], "-v") == 0))
+		g_verbose = 2;
+
+	printf ("pts estimator: %d-chunk dumps, polls and intervals until decision and lock\n",
+		DUMP_CHUNKS);
+	printf ("  %-26s %9s %5s %9s %6s %9s\n", "stream", "fps", "poll", "intervals",
+		"lock", "intervals");
+
+	static const int rates [] = { FP8 (23,976), FP8 (25,000), FP8 (29,970), FP8 (50,000), FP8 (59,940) };
+	for (int c = 0; c < ARRAY_SIZE (g_cases); c++)
+		for (int r = 0; r < ARRAY_SIZE (rates); r++)
+			check_stream (c, rates [r]);
+
+	printf ("per-poll cost:\n");
+	bench_polls ();
+
+	printf ("%s\n", g_bench_failed ? "FAILED" : "OK");
+	return g_bench_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Parses every sysfs attribute format afrd reads both with the span
+ * tokenizer, the way afrd does, and with the zero-terminated string
+ * functions it used before; checks that both give the same values and
+ * measures the time per parse.
+ */
+
+#include "bench.h"
+#include "sampler.h"
+
+// number of parses timed for every format
+#define BENCH_PARSES		100000
+
+static const char g_vdec_status [] =
+	"vdec channel 0 statistics:\n"
+	"  device name : amvdec_h264\n"
+	"  frame width : 1920\n"
+	" frame height : 1080\n"
+	"   frame rate : 24 fps\n"
+	"     bit rate : 856 kbps\n"
+	"       status : 63\n"
+	"    frame dur : 4004\n"
+	"   frame data : 19 KB\n"
+	"  frame count : 230\n"
+	"   drop count : 2\n"
+	"fra err count : 0\n"
+	" hw err count : 0\n"
+	"   total data : 1197 KB\n"
+	"vdec channel 1 statistics:\n"
+	"  device name : amvdec_h265\n"
+	"  frame width : 3840\n"
+	" frame height : 2160\n"
+	"   frame rate : 59 fps\n"
+	"     bit rate : 12000 kbps\n"
+	"       status : 63\n"
+	"    frame dur : 1601\n"
+	"   frame data : 90 KB\n"
+	"  frame count : 1822\n"
+	"   drop count : 0\n"
+	"fra err count : 0\n"
+	" hw err count : 0\n"
+	"   total data : 90211 KB\n";
+
+static const char g_blocks [] = "vdec,dsize=9388000,frames:24,dur:1001\n";
+
+static const char g_disp_cap [] =
+	"480p60hz\n576p50hz\n720p60hz\n720p50hz\n1080i60hz\n1080i50hz\n"
+	"1080p60hz*\n1080p50hz\n1080p24hz\n1080p30hz\n1080p25hz\n"
+	"2160p24hz\n2160p25hz\n2160p30hz\n2160p50hz\n2160p60hz\n"
+	"smpte24hz\n2160p50hz420\n2160p60hz420\n";
+
+static const char g_dc_cap [] =
+	"444,12bit\n444,10bit\n444,8bit\n422,12bit\n422,10bit\n422,8bit\n"
+	"420,12bit\n420,10bit\n420,8bit\nrgb,12bit\nrgb,10bit\nrgb,8bit\n";
+
+static const char g_hdcp_mode [] = "14\n";
+
+// dump_vdec_chunks text, filled in at startup
+static char g_chunks [64 * 80];
+static int g_chunks_len;
+#define CHUNKS		40
+
+// the parsing buffer, attributes are parsed in place
+static char g_buff [8192];
+
+// copy attribute text to the parsing buffer, return its length
+static int load (const char *text, int len)
+{
+	memcpy (g_buff, text, len);
+	g_buff [len] = 0;
+	return len;
+}
+
+// the number of parses done so far; results of the latest
+static struct
+{
+	vdec_channel_t channel [SAMPLE_MAX_CHANNELS];
+	int channels;
+	uint64_t pts [SAMPLE_MAX_PTS];
+	int count;
+	unsigned long long dsize, nframes, timeint;
+	// word lengths of a space-separated list and their sum
+	int words, chars;
+	int hdcp;
+	bool ok;
+} g_res [2];
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+/* the span tokenizer, same calls as afrd does                           */
+
+static void span_vdec_status (int len)
+{
+	g_res [0].channels = vdec_status_channels (g_buff, len, g_res [0].channel, SAMPLE_MAX_CHANNELS);
+}
+
+// as in sample_chunks ()
+static void span_chunks (int n)
+{
+	g_res [0].count = 0;
+	while ((n > 0) && (g_buff [n - 1] != '\n'))
+		n--;
+	strspan_t buff = strspan (g_buff, n);
+	strspan_t line;
+	while ((g_res [0].count < SAMPLE_MAX_PTS) && strspan_next (&buff, '\n', &line)) {
+		bool ok = true;
+		unsigned long long pts64 = strspan_find_ull (&line, "pts64=", &ok);
+		if (ok)
+			g_res [0].pts [g_res [0].count++] = pts64;
+	}
+}
+
+// as in sample_blocks ()
+static void span_blocks (int n)
+{
+	strspan_t buff = strspan (g_buff, n);
+	strspan_t line;
+	strspan_next (&buff, '\n', &line);
+
+	bool ok = true;
+	g_res [0].dsize = strspan_find_ull (&line, ",dsize=", &ok);
+	g_res [0].nframes = strspan_find_ull (&line, ",frames:", &ok);
+	g_res [0].timeint = strspan_find_ull (&line, ",dur:", &ok);
+	g_res [0].ok = ok;
+}
+
+// as in display_modes_init () and colorspace_refresh ()
+static void span_words (int n)
+{
+	g_res [0].words = g_res [0].chars = 0;
+	strspan_t list = strspan (g_buff, n);
+	strspan_trim (&list);
+
+	strspan_t word;
+	while (strspan_word (&list, &word)) {
+		if (word.str [word.len - 1] == '*')
+			word.len--;
+		char *cur = strspan_cstr (&word);
+		g_res [0].words++;
+		g_res [0].chars += strlen (cur);
+	}
+}
+
+// as in hdcp_init ()
+static void span_hdcp_mode (int n)
+{
+	strspan_t cur = strspan (g_buff, n);
+	strspan_trim (&cur);
+
+	g_res [0].hdcp = strspan_eq (&cur, "off") ? 0 :
+		strspan_eq (&cur, "14") ? 14 :
+		strspan_eq (&cur, "22") ? 22 : -1;
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+/* zero-terminated strings, as afrd parsed them before                   */
+
+static unsigned long long find_ulonglong (const char *str, const char *prefix, bool *ok)
+{
+	if (!*ok)
+		return 0;
+
+	const char *pfx = strstr (str, prefix);
+	if (!pfx) {
+		*ok = false;
+		return 0;
+	}
+
+	char *tmp;
+	pfx += strlen (prefix);
+	unsigned long long val = strtoull (pfx, &tmp, 10);
+	if (tmp > pfx)
+		return val;
+
+	*ok = false;
+	return 0;
+}
+
+static bool vdec_status_parse (char *line, const char **attr, const char **val)
+{
+	char *cur = line;
+
+	cur += strspn (cur, spaces);
+	*attr = cur;
+	while (*cur && (*cur != ':'))
+		cur++;
+	if (!*cur)
+		return false;
+	*cur = 0;
+	strip_trailing_spaces (cur, *attr);
+	cur++;
+	cur += strspn (cur, spaces);
+
+	*val = cur;
+	cur = strchr (cur, 0);
+	strip_trailing_spaces (cur, *val);
+	return true;
+}
+
+static void str_vdec_status (int len)
+{
+	vdec_channel_t *channel = g_res [1].channel;
+	vdec_channel_t *cur = NULL;
+	int count = 0;
+
+	char *line, *next;
+	for (line = g_buff; *line; line = next) {
+		next = line + strcspn (line, "\n");
+		if (*next)
+			*next++ = 0;
+
+		const char *attr, *val;
+		if (!vdec_status_parse (line, &attr, &val))
+			continue;
+
+		bool header = (strncmp (attr, "vdec channel", 12) == 0);
+		if (header || !cur) {
+			if (count >= SAMPLE_MAX_CHANNELS)
+				break;
+			cur = &channel [count++];
+			memset (cur, 0, sizeof (*cur));
+			if (header)
+				continue;
+		}
+
+		if (strcmp (attr, "device name") == 0)
+			strncpy (cur->name, val, sizeof (cur->name) - 1);
+		else if (strcmp (attr, "frame rate") == 0) {
+			char *endp;
+			int fps = strtol (val, &endp, 10);
+			endp += strspn (endp, spaces);
+			if ((*endp == 0) || (strcmp (endp, "fps") == 0))
+				cur->fps = fps;
+		} else if (strcmp (attr, "frame dur") == 0) {
+			char *endp;
+			int frame_dur = strtol (val, &endp, 10);
+			if (*endp == 0)
+				cur->frame_dur = frame_dur;
+		} else if (strcmp (attr, "frame width") == 0)
+			cur->width = strtol (val, NULL, 10);
+		else if (strcmp (attr, "frame height") == 0)
+			cur->height = strtol (val, NULL, 10);
+		else if (strcmp (attr, "frame count") == 0)
+			cur->frame_count = strtoul (val, NULL, 10);
+		else if (strcmp (attr, "drop count") == 0)
+			cur->drop_count = strtoul (val, NULL, 10);
+	}
+
+	int n = 0;
+	for (int i = 0; i < count; i++)
+		if (channel [i].name [0])
+			channel [n++] = channel [i];
+	g_res [1].channels = n;
+}
+
+static void str_chunks (int n)
+{
+	g_res [1].count = 0;
+	char *cur = g_buff;
+	while (*cur && (g_res [1].count < SAMPLE_MAX_PTS)) {
+		char *eol = strchr (cur, '\n');
+		if (!eol)
+			break;
+		*eol = '\0';
+
+		bool ok = true;
+		unsigned long long pts64 = find_ulonglong (cur, "pts64=", &ok);
+		if (ok)
+			g_res [1].pts [g_res [1].count++] = pts64;
+
+		cur = eol + 1;
+	}
+}
+
+static void str_blocks (int n)
+{
+	char *line = g_buff;
+	line [strcspn (line, "\n")] = 0;
+
+	bool ok = true;
+	g_res [1].dsize = find_ulonglong (line, ",dsize=", &ok);
+	g_res [1].nframes = find_ulonglong (line, ",frames:", &ok);
+	g_res [1].timeint = find_ulonglong (line, ",dur:", &ok);
+	g_res [1].ok = ok;
+}
+
+static void str_words (int n)
+{
+	g_res [1].words = g_res [1].chars = 0;
+
+	char *cur_r, *cur, *tokens = g_buff;
+	while ((cur = strtok_r (tokens, spaces, &cur_r)) != NULL) {
+		tokens = NULL;
+		int len = strlen (cur);
+		if (cur [len - 1] == '*')
+			cur [--len] = 0;
+		g_res [1].words++;
+		g_res [1].chars += strlen (cur);
+	}
+}
+
+static void str_hdcp_mode (int n)
+{
+	char *cur = g_buff + strspn (g_buff, spaces);
+	strip_trailing_spaces (strchr (cur, 0), cur);
+
+	g_res [1].hdcp = !strcmp (cur, "off") ? 0 :
+		!strcmp (cur, "14") ? 14 :
+		!strcmp (cur, "22") ? 22 : -1;
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+static const struct
+{
+	const char *name;
+	const char *text;
+	int *len;
+	void (*span) (int);
+	void (*str) (int);
+} g_formats [] =
+{
+	{ "vdec_status", g_vdec_status, NULL, span_vdec_status, str_vdec_status },
+	{ "dump_vdec_chunks", g_chunks, &g_chunks_len, span_chunks, str_chunks },
+	{ "dump_vdec_blocks", g_blocks, NULL, span_blocks, str_blocks },
+	{ "disp_cap", g_disp_cap, NULL, span_words, str_words },
+	{ "dc_cap", g_dc_cap, NULL, span_words, str_words },
+	{ "hdcp_mode", g_hdcp_mode, NULL, span_hdcp_mode, str_hdcp_mode },
+};
+
+static int format_len (int f)
+{
+	return g_formats [f].len ? *g_formats [f].len : (int)strlen (g_formats [f].text);
+}
+
+// check the values parsed by both ways against each other and known ones
+static void check_format (int f)
+{
+	const char *name = g_formats [f].name;
+	int len = format_len (f);
+
+	memset (g_res, 0, sizeof (g_res));
+	g_formats [f].span (load (g_formats [f].text, len));
+	g_formats [f].str (load (g_formats [f].text, len));
+
+	if (memcmp (&g_res [0], &g_res [1], sizeof (g_res [0])) != 0)
+		bench_fail ("%s: span tokenizer and string parser disagree\n", name);
+
+	switch (f) {
+		case 0:
+			if ((g_res [0].channels != 2) ||
+			    strcmp (g_res [0].channel [0].name, "amvdec_h264") ||
+			    (g_res [0].channel [0].fps != 24) || (g_res [0].channel [0].frame_dur != 4004) ||
+			    (g_res [0].channel [1].width != 3840) || (g_res [0].channel [1].height != 2160) ||
+			    (g_res [0].channel [0].frame_count != 230) || (g_res [0].channel [0].drop_count != 2))
+				bench_fail ("%s: wrong values\n", name);
+			break;
+
+		case 1:
+			if ((g_res [0].count != CHUNKS) || (g_res [0].pts [1] != 10000125125ULL))
+				bench_fail ("%s: wrong values\n", name);
+			break;
+
+		case 2:
+			if (!g_res [0].ok || (g_res [0].dsize != 9388000) ||
+			    (g_res [0].nframes != 24) || (g_res [0].timeint != 1001))
+				bench_fail ("%s: wrong values\n", name);
+			break;
+
+		case 3:
+			if ((g_res [0].words != 19) || (g_res [0].chars != 173))
+				bench_fail ("%s: wrong values (%d words, %d chars)\n",
+					name, g_res [0].words, g_res [0].chars);
+			break;
+
+		case 4:
+			if ((g_res [0].words != 12) || (g_res [0].chars != 104))
+				bench_fail ("%s: wrong values (%d words, %d chars)\n",
+					name, g_res [0].words, g_res [0].chars);
+			break;
+
+		case 5:
+			if (g_res [0].hdcp != 14)
+				bench_fail ("%s: wrong values\n", name);
+			break;
+	}
+}
+
+static void bench_format (int f)
+{
+	char name [64];
+	int len = format_len (f);
+
+	// the time to copy text to the parsing buffer is not counted
+	uint64_t start = bench_ns ();
+	for (int n = 0; n < BENCH_PARSES; n++)
+		load (g_formats [f].text, len);
+	uint64_t copy = bench_ns () - start;
+
+	for (int way = 0; way < 2; way++) {
+		void (*parse) (int) = way ? g_formats [f].str : g_formats [f].span;
+		start = bench_ns ();
+		for (int n = 0; n < BENCH_PARSES; n++) {
+			load (g_formats [f].text, len);
+			parse (len);
+		}
+		uint64_t spent = bench_ns () - start;
+
+		snprintf (name, sizeof (name), "%s, %s", g_formats [f].name, way ? "strings" : "spans");
+		bench_report (name, (spent > copy) ? spent - copy : 0, BENCH_PARSES);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	if ((argc > 1) && (strcmp (argv [1], "-v") == 0))
+		g_verbose = 2;
+
+	// chunks in decode order, like the decoder dumps them
+	static const int reorder [4] = { 0, 3, 1, 2 };
+	for (int i = 0; i < CHUNKS; i++) {
+		int chunk = (i & ~3) + reorder [i & 3];
+		unsigned long long pts64 = 10000000000ULL + (chunk * 1001000000ULL + 12000) / 24000;
+		g_chunks_len += snprintf (g_chunks + g_chunks_len, sizeof (g_chunks) - g_chunks_len,
+			"chunk %d: size=%u pts=%u pts64=%llu\n",
+			chunk, 10000 + (chunk * 7919) % 20000, (unsigned)pts64, pts64);
+	}
+
+	printf ("sysfs attribute parsers:\n");
+	for (int f = 0; f < ARRAY_SIZE (g_formats); f++) {
+		check_format (f);
+		bench_format (f);
+	}
+
+	printf ("%s\n", g_bench_failed ? "FAILED" : "OK");
+	return g_bench_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
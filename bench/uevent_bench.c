@@ -0,0 +1,277 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Checks the compiled uevent classifier against plain regexec() matching
+ * of every filter rule, and measures the per-uevent cost of both.
+ * Also checks that the socket filter built from the classifier
+ * never drops an uevent some filter would match.
+ */
+
+#include "bench.h"
+#include "uevent_filter.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+// number of uevents parsed for every timing
+#define BENCH_UEVENTS		200000
+
+static const struct
+{
+	const char *name;
+	const char *filter;
+} g_filters [] =
+{
+	// the filters from config files
+	{ "frhint", "ACTION=change SUBSYSTEM=amhdmitx DEVNAME=amhdmitx0" },
+	{ "vdec", "ACTION=(add|remove) DEVPATH=/devices/platform/vdec/.* SUBSYSTEM=platform" },
+	{ "hdmi", "ACTION=change DEVPATH=/devices/virtual/amhdmitx/amhdmitx0/hdmi DEVTYPE=hdmi" },
+	{ "hdcp", "ACTION=change DEVTYPE=hdcp STATE=HDMI=0" },
+	// alternations, brackets and quantifiers which can't use the fast paths
+	{ "alt-action", "ACTION=add|remove DEVPATH=/devices/platform/vdec/.*" },
+	{ "alt-devpath", "ACTION=change DEVPATH=/devices/virtual/amhdmitx/.*|/devices/platform/hdmi.*" },
+	{ "alt-group", "ACTION=(add|remove) SUBSYSTEM=plat|platform MODALIAS=platform:amvdec_(h264|h265)" },
+	{ "brackets", "ACTION=[|a-z]+ DEVTYPE=hdm?i|hdcp" },
+};
+
+// uevents as the kernel sends them, with '|' in place of zeros
+static const char *g_uevents [] =
+{
+	// the interesting ones
+	"add@/devices/platform/vdec/vdec.0|ACTION=add|DEVPATH=/devices/platform/vdec/vdec.0|SUBSYSTEM=platform|MODALIAS=platform:amvdec_h264|SEQNUM=1001",
+	"remove@/devices/platform/vdec/vdec.0|ACTION=remove|DEVPATH=/devices/platform/vdec/vdec.0|SUBSYSTEM=platform|MODALIAS=platform:amvdec_h265|SEQNUM=1002",
+	"change@/devices/virtual/amhdmitx/amhdmitx0|ACTION=change|DEVPATH=/devices/virtual/amhdmitx/amhdmitx0|SUBSYSTEM=amhdmitx|DEVNAME=amhdmitx0|FRAME_RATE_HINT=4004|SEQNUM=1003",
+	"change@/devices/virtual/amhdmitx/amhdmitx0/hdmi|ACTION=change|DEVPATH=/devices/virtual/amhdmitx/amhdmitx0/hdmi|SUBSYSTEM=amhdmitx|DEVTYPE=hdmi|STATE=HDMI=1|SEQNUM=1004",
+	"change@/devices/virtual/amhdmitx/amhdmitx0/hdcp|ACTION=change|DEVPATH=/devices/virtual/amhdmitx/amhdmitx0/hdcp|SUBSYSTEM=amhdmitx|DEVTYPE=hdcp|STATE=HDMI=0|SEQNUM=1005",
+	"change@/devices/platform/hdmitx|ACTION=change|DEVPATH=/devices/platform/hdmitx|SUBSYSTEM=platform|DEVTYPE=hdmi|SEQNUM=1006",
+	"move@/devices/platform/vdec/vdec.1|ACTION=move|DEVPATH=/devices/platform/vdec/vdec.1|SUBSYSTEM=platform|MODALIAS=platform:amvdec_mpeg12|SEQNUM=1007",
+	"remove@/devices/platform/vdec/vdec.1|ACTION=remove|DEVPATH=/devices/platform/vdec/vdec.1|SUBSYSTEM=plat|MODALIAS=platform:amvdec_h265|SEQNUM=1008",
+	// the noise of a busy box
+	"change@/devices/platform/battery/power_supply/battery|ACTION=change|DEVPATH=/devices/platform/battery/power_supply/battery|SUBSYSTEM=power_supply|POWER_SUPPLY_NAME=battery|POWER_SUPPLY_STATUS=Charging|POWER_SUPPLY_CAPACITY=87|SEQNUM=2001",
+	"change@/devices/virtual/thermal/thermal_zone0|ACTION=change|DEVPATH=/devices/virtual/thermal/thermal_zone0|SUBSYSTEM=thermal|NAME=soc_thermal|TEMP=61000|SEQNUM=2002",
+	"add@/devices/platform/usb/usb1/1-1|ACTION=add|DEVPATH=/devices/platform/usb/usb1/1-1|SUBSYSTEM=usb|MAJOR=189|MINOR=1|DEVNAME=bus/usb/001/002|DEVTYPE=usb_device|PRODUCT=46d/c52b/1211|TYPE=0/0/0|BUSNUM=001|DEVNUM=002|SEQNUM=2003",
+	"add@/devices/platform/usb/usb1/1-1/1-1:1.0|ACTION=add|DEVPATH=/devices/platform/usb/usb1/1-1/1-1:1.0|SUBSYSTEM=usb|DEVTYPE=usb_interface|PRODUCT=46d/c52b/1211|TYPE=0/0/0|INTERFACE=3/1/1|MODALIAS=usb:v046Dpc52Bd1211dc00dsc00dp00ic03isc01ip01in00|SEQNUM=2004",
+	"remove@/devices/virtual/bdi/179:0|ACTION=remove|DEVPATH=/devices/virtual/bdi/179:0|SUBSYSTEM=bdi|SEQNUM=2005",
+	"change@/devices/virtual/switch/hdmi|ACTION=change|DEVPATH=/devices/virtual/switch/hdmi|SUBSYSTEM=switch|SWITCH_NAME=hdmi|SWITCH_STATE=1|SEQNUM=2006",
+	"add@/devices/virtual/net/wlan0/queues/rx-0|ACTION=add|DEVPATH=/devices/virtual/net/wlan0/queues/rx-0|SUBSYSTEM=queues|SEQNUM=2007",
+	"change@/devices/platform/battery/power_supply/usb|ACTION=change|DEVPATH=/devices/platform/battery/power_supply/usb|SUBSYSTEM=power_supply|POWER_SUPPLY_NAME=usb|POWER_SUPPLY_ONLINE=1|SEQNUM=2008",
+};
+
+#define NFILTERS	ARRAY_SIZE (g_filters)
+#define NUEVENTS	ARRAY_SIZE (g_uevents)
+
+static uevent_filter_t g_uevf [NFILTERS];
+static uevent_classifier_t g_classifier;
+
+// raw uevents, zero-separated
+static char g_msg [NUEVENTS][1024];
+static int g_msg_len [NUEVENTS];
+
+// check a single rule the way afrd did before the classifier: regexec, whole value
+static bool regexec_rule (uevent_filter_t *uevf, int i, const char *value)
+{
+	regmatch_t match [1];
+	if (regexec (&uevf->rex [i], value, 1, match, 0) == REG_NOMATCH)
+		return false;
+	return (match [0].rm_so == 0) && (match [0].rm_eo == strlen (value));
+}
+
+// match uevent against all filters with regexec, return bitmask of matched filters
+static uint32_t match_regexec (char *msg, int size)
+{
+	uint32_t matches [NFILTERS];
+	memset (matches, 0, sizeof (matches));
+
+	const char *end = msg + size;
+	msg += strlen (msg) + 1;
+	while (msg < end) {
+		char *eos = strchr (msg, 0);
+		char *val = strchr (msg, '=');
+		if (val)
+			*val++ = 0;
+		else
+			val = eos;
+
+		for (int f = 0; f < NFILTERS; f++)
+			for (int i = 0; i < g_uevf [f].size; i++)
+				if ((strcmp (g_uevf [f].attr [i], msg) == 0) &&
+				    regexec_rule (&g_uevf [f], i, val))
+					matches [f] |= 1 << i;
+
+		msg = eos + 1;
+	}
+
+	uint32_t result = 0;
+	for (int f = 0; f < NFILTERS; f++)
+		if (g_uevf [f].size && (matches [f] == (1U << g_uevf [f].size) - 1))
+			result |= 1 << f;
+	return result;
+}
+
+// match uevent with the classifier the way handle_uevent() does
+static uint32_t match_classifier (char *msg, int size)
+{
+	const char *end = msg + size;
+	uevent_classifier_reset (&g_classifier);
+
+	msg += strlen (msg) + 1;
+	while (msg < end) {
+		char *eos = memchr (msg, 0, end - msg);
+		if (!eos)
+			eos = (char *)end;
+
+		char *val = memchr (msg, '=', eos - msg);
+		size_t key_len;
+		if (val) {
+			key_len = val - msg;
+			*val++ = 0;
+		} else {
+			key_len = eos - msg;
+			val = eos;
+		}
+
+		uint32_t hash = uevent_hash (msg, key_len);
+		if (!uevent_classifier_match (&g_classifier, hash, msg, val, eos - val))
+			return 0;
+
+		msg = eos + 1;
+	}
+
+	uint32_t result = 0;
+	for (int f = 0; f < NFILTERS; f++)
+		if (uevent_filter_matched (&g_uevf [f]))
+			result |= 1 << f;
+	return result;
+}
+
+static void check_matches ()
+{
+	char msg [1024];
+	for (int u = 0; u < NUEVENTS; u++) {
+		memcpy (msg, g_msg [u], g_msg_len [u]);
+		uint32_t want = match_regexec (msg, g_msg_len [u]);
+		memcpy (msg, g_msg [u], g_msg_len [u]);
+		uint32_t got = match_classifier (msg, g_msg_len [u]);
+
+		if (got != want)
+			bench_fail ("uevent %d (%s): classifier matched %#x, regexec %#x\n",
+				u, g_msg [u], got, want);
+	}
+}
+
+// send all uevents through a socket with the BPF program of a set of filters
+static void check_bpf (const char *name, uint32_t set)
+{
+	uevent_classifier_t uevc;
+	uevent_classifier_init (&uevc);
+	for (int f = 0; f < NFILTERS; f++)
+		if (set & (1 << f))
+			uevent_classifier_add (&uevc, &g_uevf [f]);
+
+	struct sock_filter prog [256];
+	int n = uevent_classifier_bpf (&uevc, prog, ARRAY_SIZE (prog));
+	if (!n) {
+		printf ("  %-28s no socket filter\n", name);
+		return;
+	}
+
+	int sv [2];
+	if (socketpair (AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		bench_fail ("%s: socketpair: %s\n", name, strerror (errno));
+		return;
+	}
+
+	struct sock_fprog fprog = {
+		.len = n,
+		.filter = prog,
+	};
+
+	if (setsockopt (sv [1], SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof (fprog)) < 0)
+		bench_fail ("%s: failed to attach socket filter: %s\n", name, strerror (errno));
+	else {
+		int dropped = 0;
+		char msg [1024];
+		for (int u = 0; u < NUEVENTS; u++) {
+			memcpy (msg, g_msg [u], g_msg_len [u]);
+			uint32_t want = match_regexec (msg, g_msg_len [u]) & set;
+
+			send (sv [0], g_msg [u], g_msg_len [u], 0);
+			ssize_t size = recv (sv [1], msg, sizeof (msg), MSG_DONTWAIT);
+			if (size == g_msg_len [u])
+				continue;
+
+			dropped++;
+			if (want)
+				bench_fail ("%s: socket filter dropped uevent %d (%s) matching %#x\n",
+					name, u, g_msg [u], want);
+		}
+
+		printf ("  %-28s %3d insns, %d of %d uevents dropped\n",
+			name, n, dropped, (int)NUEVENTS);
+	}
+
+	close (sv [0]);
+	close (sv [1]);
+}
+
+static void bench_matches (const char *name, uint32_t (*match) (char *, int))
+{
+	char msg [1024];
+	uint32_t hits = 0;
+
+	uint64_t start = bench_ns ();
+	for (int n = 0; n < BENCH_UEVENTS; n++) {
+		int u = n % NUEVENTS;
+		memcpy (msg, g_msg [u], g_msg_len [u]);
+		hits += (match (msg, g_msg_len [u]) != 0);
+	}
+	bench_report (name, bench_ns () - start, BENCH_UEVENTS);
+
+	// keep the compiler from dropping the loop
+	if (!hits)
+		bench_fail ("%s matched nothing\n", name);
+}
+
+int main (int argc, char **argv)
+{
+	if ((argc > 1) && (strcmp (argv [1], "-v") == 0))
+		g_verbose = 3;
+
+	uevent_classifier_init (&g_classifier);
+	for (int f = 0; f < NFILTERS; f++) {
+		if (!uevent_filter_init (&g_uevf [f], g_filters [f].name, g_filters [f].filter))
+			bench_fail ("filter %s failed to load\n", g_filters [f].name);
+		uevent_classifier_add (&g_classifier, &g_uevf [f]);
+	}
+
+	for (int u = 0; u < NUEVENTS; u++) {
+		g_msg_len [u] = snprintf (g_msg [u], sizeof (g_msg [u]), "%s|", g_uevents [u]);
+		for (int i = 0; i < g_msg_len [u]; i++)
+			if (g_msg [u][i] == '|')
+				g_msg [u][i] = 0;
+	}
+
+	printf ("uevent classifier: %d filters, %d uevents\n", (int)NFILTERS, (int)NUEVENTS);
+	check_matches ();
+
+	printf ("socket filters:\n");
+	check_bpf ("config filters", 0x0f);
+	check_bpf ("alt-action", 0x10);
+	check_bpf ("alt-devpath", 0x20);
+	check_bpf ("alt-group", 0x40);
+	check_bpf ("brackets", 0x80);
+	check_bpf ("config and alternations", 0x6f);
+
+	printf ("per-uevent cost:\n");
+	bench_matches ("regexec every rule", match_regexec);
+	bench_matches ("classifier", match_classifier);
+
+	for (int f = 0; f < NFILTERS; f++)
+		uevent_filter_fini (&g_uevf [f]);
+
+	printf ("%s\n", g_bench_failed ? "FAILED" : "OK");
+	return g_bench_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,308 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Capturing uevents & sysfs traffic and replaying it offline
+ */
+
+#include "afrd.h"
+#include "capture.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// virtual time when replay starts
+#define REPLAY_EPOCH	1000
+
+bool g_replay = false;
+bool g_replay_realtime = false;
+
+// capture file handle
+static int g_capture_h = -1;
+// monotonic time when capture started
+static struct timespec g_capture_start;
+
+// the whole capture file loaded for replay
+static uint8_t *g_replay_data;
+static size_t g_replay_size;
+// pointers to all records in capture
+static capture_rec_t **g_replay_rec;
+static int g_replay_rec_n;
+// index of next uevent record to replay
+static int g_replay_next;
+
+// values written to sysfs during replay
+static struct
+{
+	char *path;
+	char *value;
+	int count;
+} *g_replay_writes;
+static int g_replay_writes_n;
+
+bool capture_open (const char *fn)
+{
+	capture_close ();
+
+	g_capture_h = open (fn, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (g_capture_h < 0) {
+		trace (0, "failed to create capture file %s\n", fn);
+		return false;
+	}
+
+	write (g_capture_h, CAPTURE_MAGIC, sizeof (CAPTURE_MAGIC) - 1);
+	clock_gettime (CLOCK_MONOTONIC, &g_capture_start);
+
+	trace (1, "capturing uevents and sysfs data to %s\n", fn);
+	return true;
+}
+
+void capture_close ()
+{
+	if (g_capture_h >= 0) {
+		close (g_capture_h);
+		g_capture_h = -1;
+	}
+}
+
+static void capture_write (capture_type_t type, const char *name, const char *data, size_t size)
+{
+	if (g_capture_h < 0)
+		return;
+
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	size_t name_len = name ? strlen (name) : 0;
+	capture_rec_t rec = {
+		.stamp = (now.tv_sec - g_capture_start.tv_sec) * 1000 +
+			(now.tv_nsec - g_capture_start.tv_nsec) / 1000000,
+		.type = type,
+		.name_len = name_len,
+		.data_len = size,
+	};
+
+	struct iovec iov [3] = {
+		{ &rec, sizeof (rec) },
+		{ (void *)name, name_len },
+		{ (void *)data, size },
+	};
+	writev (g_capture_h, iov, 3);
+}
+
+void capture_uevent (const char *msg, size_t size)
+{
+	capture_write (CAP_UEVENT, NULL, msg, size);
+}
+
+void capture_sysfs (capture_type_t type, const char *path, const char *data, size_t size)
+{
+	capture_write (type, path, data, size);
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+static inline const char *rec_name (capture_rec_t *rec)
+{
+	return (const char *)(rec + 1);
+}
+
+static inline const char *rec_data (capture_rec_t *rec)
+{
+	return rec_name (rec) + rec->name_len;
+}
+
+static bool rec_is (capture_rec_t *rec, const char *path, size_t path_len)
+{
+	return (rec->type == CAP_SYSFS_READ) && (rec->name_len == path_len) &&
+		(memcmp (rec_name (rec), path, path_len) == 0);
+}
+
+static int replay_sysfs_read (const char *path, char *buf, size_t size);
+static int replay_sysfs_write (const char *path, const char *value);
+
+// serves sysfs attributes from the capture
+static const sysfs_backend_t g_replay_backend =
+{
+	replay_sysfs_read, replay_sysfs_write
+};
+
+bool replay_load (const char *fn)
+{
+	replay_free ();
+
+	int h = open (fn, O_RDONLY | O_CLOEXEC);
+	if (h < 0) {
+		trace (0, "failed to open capture file %s\n", fn);
+		return false;
+	}
+
+	struct stat st;
+	if ((fstat (h, &st) != 0) || (st.st_size < sizeof (CAPTURE_MAGIC) - 1)) {
+		close (h);
+		return false;
+	}
+
+	g_replay_size = st.st_size;
+	g_replay_data = malloc (g_replay_size);
+	bool ok = (read (h, g_replay_data, g_replay_size) == g_replay_size) &&
+		(memcmp (g_replay_data, CAPTURE_MAGIC, sizeof (CAPTURE_MAGIC) - 1) == 0);
+	close (h);
+
+	if (!ok) {
+		trace (0, "%s is not an afrd capture file\n", fn);
+		replay_free ();
+		return false;
+	}
+
+	size_t ofs = sizeof (CAPTURE_MAGIC) - 1;
+	while (ofs + sizeof (capture_rec_t) <= g_replay_size) {
+		capture_rec_t *rec = (capture_rec_t *)(g_replay_data + ofs);
+		size_t next = ofs + sizeof (capture_rec_t) + rec->name_len + rec->data_len;
+		if (next > g_replay_size)
+			break; // truncated capture
+
+		if ((g_replay_rec_n & 255) == 0)
+			g_replay_rec = realloc (g_replay_rec, (g_replay_rec_n + 256) * sizeof (capture_rec_t *));
+		g_replay_rec [g_replay_rec_n++] = rec;
+		ofs = next;
+	}
+
+	g_replay = true;
+	g_replay_next = 0;
+	sysfs_backend (&g_replay_backend);
+	g_mstime_virtual = REPLAY_EPOCH;
+	mstime_update ();
+
+	trace (1, "loaded %d records from capture %s\n", g_replay_rec_n, fn);
+	return true;
+}
+
+void replay_free ()
+{
+	if (g_replay) {
+		sysfs_backend (NULL);
+		g_replay = false;
+	}
+
+	for (int i = 0; i < g_replay_writes_n; i++) {
+		free (g_replay_writes [i].path);
+		free (g_replay_writes [i].value);
+	}
+	free (g_replay_writes);
+	g_replay_writes = NULL;
+	g_replay_writes_n = 0;
+
+	free (g_replay_rec);
+	g_replay_rec = NULL;
+	g_replay_rec_n = 0;
+
+	free (g_replay_data);
+	g_replay_data = NULL;
+	g_replay_size = 0;
+}
+
+bool replay_next_uevent (mstime_t *stamp, char *msg, size_t *size)
+{
+	for (; g_replay_next < g_replay_rec_n; g_replay_next++) {
+		capture_rec_t *rec = g_replay_rec [g_replay_next];
+		if (rec->type != CAP_UEVENT)
+			continue;
+
+		size_t len = rec->data_len;
+		if (len > *size)
+			len = *size;
+		memcpy (msg, rec_data (rec), len);
+		*size = len;
+		*stamp = REPLAY_EPOCH + rec->stamp;
+
+		g_replay_next++;
+		return true;
+	}
+
+	return false;
+}
+
+mstime_t replay_duration ()
+{
+	if (!g_replay_rec_n)
+		return REPLAY_EPOCH;
+	return REPLAY_EPOCH + g_replay_rec [g_replay_rec_n - 1]->stamp;
+}
+
+static int replay_find_write (const char *path)
+{
+	for (int i = 0; i < g_replay_writes_n; i++)
+		if (strcmp (g_replay_writes [i].path, path) == 0)
+			return i;
+	return -1;
+}
+
+static int replay_sysfs_read (const char *path, char *buf, size_t size)
+{
+	const char *data = NULL;
+	size_t len = 0;
+
+	// the values we've written ourselves take precedence
+	int w = replay_find_write (path);
+	if (w >= 0) {
+		data = g_replay_writes [w].value;
+		len = strlen (data);
+	} else {
+		// use the last read before current virtual time, or the first one after
+		uint32_t now = mstime_get () - REPLAY_EPOCH;
+		size_t path_len = strlen (path);
+		capture_rec_t *found = NULL;
+		for (int i = 0; i < g_replay_rec_n; i++) {
+			capture_rec_t *rec = g_replay_rec [i];
+			if (!rec_is (rec, path, path_len))
+				continue;
+			if (found && (rec->stamp > now))
+				break;
+			found = rec;
+		}
+
+		if (!found)
+			return -1;
+
+		data = rec_data (found);
+		len = found->data_len;
+	}
+
+	if (len > size - 1)
+		len = size - 1;
+	memcpy (buf, data, len);
+	buf [len] = 0;
+	return len;
+}
+
+static int replay_sysfs_write (const char *path, const char *value)
+{
+	trace (1, "replay: +%u ms write [%s] into %s\n",
+		mstime_get () - REPLAY_EPOCH, value, path);
+
+	int w = replay_find_write (path);
+	if (w < 0) {
+		w = g_replay_writes_n++;
+		g_replay_writes = realloc (g_replay_writes, g_replay_writes_n * sizeof (*g_replay_writes));
+		g_replay_writes [w].path = strdup (path);
+		g_replay_writes [w].value = NULL;
+		g_replay_writes [w].count = 0;
+	}
+
+	free (g_replay_writes [w].value);
+	g_replay_writes [w].value = strdup (value);
+	g_replay_writes [w].count++;
+	return 0;
+}
+
+int replay_write_count (const char *path)
+{
+	int w = replay_find_write (path);
+	return (w < 0) ? 0 : g_replay_writes [w].count;
+}
@@ -0,0 +1,73 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Capturing uevents & sysfs traffic and replaying it offline
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "mstime.h"
+
+/*
+ * Capture file starts with CAPTURE_MAGIC, followed by records,
+ * every record starts with capture_rec_t header followed by name_len
+ * bytes of sysfs attribute path and data_len bytes of data.
+ */
+#define CAPTURE_MAGIC		"AFRDCAP1"
+
+typedef enum
+{
+	/// raw netlink uevent payload
+	CAP_UEVENT,
+	/// the contents of a sysfs attribute that was read
+	CAP_SYSFS_READ,
+	/// a value written into sysfs attribute
+	CAP_SYSFS_WRITE,
+} capture_type_t;
+
+typedef struct
+{
+	/// milliseconds since capture start, monotonic
+	uint32_t stamp;
+	/// record type (capture_type_t)
+	uint8_t type;
+	/// reserved, must be 0
+	uint8_t reserved;
+	/// length of attribute path
+	uint16_t name_len;
+	/// length of data
+	uint32_t data_len;
+} __attribute__((packed)) capture_rec_t;
+
+/// true if we're replaying a capture instead of talking to hardware
+extern bool g_replay;
+/// replay at original speed instead of as fast as possible
+extern bool g_replay_realtime;
+
+/// start capturing uevents and sysfs traffic into file
+extern bool capture_open (const char *fn);
+/// stop capturing
+extern void capture_close ();
+/// record a raw uevent
+extern void capture_uevent (const char *msg, size_t size);
+/// record a sysfs read or write
+extern void capture_sysfs (capture_type_t type, const char *path, const char *data, size_t size);
+
+/// load a capture file for replaying
+extern bool replay_load (const char *fn);
+/// free the loaded capture
+extern void replay_free ();
+/// get next uevent from capture, returns false at end of capture
+extern bool replay_next_uevent (mstime_t *stamp, char *msg, size_t *size);
+/// get time stamp of the last record in capture
+extern mstime_t replay_duration ();
+/// number of writes into sysfs attribute during replay
+extern int replay_write_count (const char *path);
+
+#endif /* __CAPTURE_H__ */
@@ -6,6 +6,7 @@
  */
 
 #include "afrd.h"
+#include "actuator.h"
 #include "colorspace.h"
 #include <regex.h>
 #include <string.h>
@@ -62,8 +63,10 @@ static struct parse_list parse_cr [] = {
 
 /* this attribute contains a list of supported color spaces */
 const char *g_cs_list_path;
+static sysfs_attr_t g_cs_list_attr;
 /* this attribute contains the current color space */
 const char *g_cs_path;
+static sysfs_attr_t g_cs_attr;
 
 struct colorspace_t
 {
@@ -91,17 +94,17 @@ static struct cs_filter_t g_cs_filter [32];
 /* Number of filters in the array */
 static int g_cs_filter_size = 0;
 /* Default color space */
-static char *g_cs_default = 0;
+static char g_cs_default [32];
 
 /* Override colorspace via API */
 static struct colorspace_t g_override_cs;
 static bool g_override_cs_enabled = false;
 
-static bool parse_str (const char *str, int *val, struct parse_list *list)
+static bool parse_str (const strspan_t *str, int *val, struct parse_list *list)
 {
 	int i;
 	for (i = 0; list [i].name; i++)
-		if (!strcmp (str, list [i].name)) {
+		if (strspan_eq (str, list [i].name)) {
 			*val = list [i].val;
 			return true;
 		}
@@ -120,14 +123,16 @@ static bool colorspace_parse (char *filt, struct colorspace_t *cs, bool reserved
 	if (!filt)
 		return false;
 
-	char *cur_r, *cur, *tokens = filt;
-	while ((cur = strtok_r (tokens, ",", &cur_r)) != NULL)
+	strspan_t tokens = strspan (filt, strlen (filt));
+	strspan_t cur;
+	while (strspan_next (&tokens, ',', &cur))
 	{
-		tokens = NULL;
+		if (!cur.len)
+			continue;
 
-		if (!parse_str (cur, &cs->cs, parse_cs) &&
-		    !parse_str (cur, &cs->cd, parse_cd) &&
-		    !parse_str (cur, &cs->cr, parse_cr))
+		if (!parse_str (&cur, &cs->cs, parse_cs) &&
+		    !parse_str (&cur, &cs->cd, parse_cd) &&
+		    !parse_str (&cur, &cs->cr, parse_cr))
 			return false;
 	}
 
@@ -169,11 +174,11 @@ static const char *colorspace_str (struct colorspace_t *cs)
 static bool colorspace_parse_filter (const char *csel)
 {
 	char *csel_dup = strdup (csel);
-	char *cur_r, *cur, *tokens = csel_dup;
-	while ((cur = strtok_r (tokens, spaces, &cur_r)) != NULL)
+	strspan_t tokens = strspan (csel_dup, strlen (csel_dup));
+	strspan_t word;
+	while (strspan_word (&tokens, &word))
 	{
-		tokens = NULL;
-		cur += strspn (cur, spaces);
+		char *cur = strspan_cstr (&word);
 
 		if (g_cs_filter_size >= ARRAY_SIZE (g_cs_filter)) {
 			trace (1, "\tignoring excessive color space filter: %s\n", cur);
@@ -217,19 +222,20 @@ bool colorspace_refresh ()
 	if (!g_cs_list_path || !g_cs_path)
 		return false;
 
-	char *list = sysfs_read (g_cs_list_path);
-	if (!list)
+	char list [1024];
+	int n = sysfs_attr_read (&g_cs_list_attr, list, sizeof (list));
+	if (n < 0)
 		return false;
 
 	trace (1, "loading available Color Spaces\n");
 
-	char *cur_r, *cur, *tokens = list;
-	while ((cur = strtok_r (tokens, spaces, &cur_r)) != NULL)
+	strspan_t tokens = strspan (list, n);
+	strspan_t word;
+	while (strspan_word (&tokens, &word))
 	{
-		tokens = NULL;
-		cur += strspn (cur, spaces);
+		char *cur = strspan_cstr (&word);
 
-		if (g_cs_supported_size > ARRAY_SIZE (g_cs_supported)) {
+		if (g_cs_supported_size >= ARRAY_SIZE (g_cs_supported)) {
 			trace (1, "\tignoring excessive supported color space: %s\n", cur);
 			continue;
 		}
@@ -244,15 +250,37 @@ bool colorspace_refresh ()
 		g_cs_supported_size++;
 	}
 
-	free (list);
-
-	if (g_cs_default)
-		free (g_cs_default);
-	g_cs_default = sysfs_read (g_cs_path);
+	char cs [sizeof (g_cs_default)];
+	const char *def = sysfs_attr_get_str (&g_cs_attr, cs, sizeof (cs));
+	strncpy (g_cs_default, def ? def : "", sizeof (g_cs_default) - 1);
 
 	return true;
 }
 
+int colorspace_caps_get (colorspace_cap_t *caps, int max)
+{
+	int n = 0;
+	for (; (n < g_cs_supported_size) && (n < max); n++) {
+		memset (&caps [n], 0, sizeof (caps [n]));
+		caps [n].cs = g_cs_supported [n].cs;
+		caps [n].cd = g_cs_supported [n].cd;
+		caps [n].cr = g_cs_supported [n].cr;
+	}
+
+	return n;
+}
+
+void colorspace_caps_set (const colorspace_cap_t *caps, int count)
+{
+	g_cs_supported_size = 0;
+	for (int i = 0; (i < count) && (i < ARRAY_SIZE (g_cs_supported)); i++) {
+		g_cs_supported [i].cs = caps [i].cs;
+		g_cs_supported [i].cd = caps [i].cd;
+		g_cs_supported [i].cr = caps [i].cr;
+		g_cs_supported_size++;
+	}
+}
+
 static bool colorspace_supported (struct colorspace_t *cs)
 {
 	for (int i = 0; i < g_cs_supported_size; i++) {
@@ -279,22 +307,24 @@ static bool colorspace_supported (struct colorspace_t *cs)
 	return false;
 }
 
-bool colorspace_apply (const char *mode)
+bool colorspace_plan (const char *mode, char *cs, size_t size)
 {
+	cs [0] = 0;
 	if (!g_cs_list_path || !g_cs_path)
 		return false;
 
-	const char *cs_attr;
-
 	/* default colorspace parameters */
 	struct colorspace_t def_cs = {COLORSPACE_YUV444, COLORDEPTH_24B, COLORRANGE_FUL};
-	colorspace_parse (g_cs_default, &def_cs, false);
+	// colorspace_parse() modifies the string
+	char cs_str [64];
+	strcpy (cs_str, g_cs_default);
+	colorspace_parse (cs_str, &def_cs, false);
 
-	/* current colorspace setting */
+	/* current colorspace setting, the one we have set last if we know it */
 	struct colorspace_t cur_cs = def_cs;
-	char *cur_cs_str = sysfs_read (g_cs_path);
-	colorspace_parse (cur_cs_str, &cur_cs, false);
-	free (cur_cs_str);
+	const char *known = sysfs_attr_known (&g_cs_attr, cs_str, sizeof (cs_str));
+	colorspace_parse (known ? cs_str : sysfs_attr_get_str (&g_cs_attr, cs_str, sizeof (cs_str)),
+		&cur_cs, false);
 
 	/* colorspace override */
 	if (g_override_cs_enabled) {
@@ -336,9 +366,17 @@ bool colorspace_apply (const char *mode)
 	cur_cs = def_cs;
 
 apply:
-	cs_attr = colorspace_str (&cur_cs);
-	trace (1, "Setting color space to %s\n", cs_attr);
-	return sysfs_write (g_cs_path, cs_attr) == 0;
+	snprintf (cs, size, "%s", colorspace_str (&cur_cs));
+	return true;
+}
+
+bool colorspace_apply (const char *cs)
+{
+	if (!cs [0])
+		return false;
+
+	trace (1, "Setting color space to %s\n", cs);
+	return sysfs_attr_set (&g_cs_attr, cs) >= 0;
 }
 
 void afrd_override_colorspace (char **cs)
@@ -354,6 +392,7 @@ void afrd_override_colorspace (char **cs)
 	*cs = cur;
 }
 
+// called before actuator thread starts
 void colorspace_init ()
 {
 	g_override_cs_enabled = false;
@@ -366,6 +405,9 @@ void colorspace_init ()
 	if (!g_cs_path)
 		return;
 
+	sysfs_attr_init (&g_cs_list_attr, g_cs_list_path, NULL);
+	sysfs_attr_init (&g_cs_attr, g_cs_path, NULL);
+
 	const char *cs_select = cfg_get_str ("cs.select", NULL);
 	if (!cs_select)
 		return;
@@ -378,6 +420,8 @@ void colorspace_init ()
 
 void colorspace_fini ()
 {
+	actuator_wait ();
+
 	for (int i = 0; i < g_cs_filter_size; i++) {
 		struct cs_filter_t *csf = &g_cs_filter [i];
 		regfree (&csf->rex);
@@ -385,8 +429,9 @@ void colorspace_fini ()
 
 	g_cs_filter_size = 0;
 
-	if (g_cs_default)
-		free (g_cs_default);
+	g_cs_default [0] = 0;
+	sysfs_attr_init (&g_cs_list_attr, NULL, NULL);
+	sysfs_attr_init (&g_cs_attr, NULL, NULL);
 
 	g_cs_list_path = g_cs_path = NULL;
 }
@@ -8,7 +8,18 @@
 #ifndef __COLORSPACE_H__
 #define __COLORSPACE_H__
 
+#include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+/// a color space supported by display, in a compact form for caching
+typedef struct
+{
+	uint8_t cs;
+	uint8_t cd;
+	uint8_t cr;
+	uint8_t reserved;
+} colorspace_cap_t;
 
 /// load colorspace-related stuff from config file
 extern void colorspace_init ();
@@ -16,7 +27,13 @@ extern void colorspace_init ();
 extern void colorspace_fini ();
 /// refresh current list of supported color spaces
 extern bool colorspace_refresh ();
-/// select and apply color space dependent on video mode
-extern bool colorspace_apply (const char *mode);
+/// get the list of supported color spaces, returns the number of entries
+extern int colorspace_caps_get (colorspace_cap_t *caps, int max);
+/// use a known list of supported color spaces instead of refreshing it
+extern void colorspace_caps_set (const colorspace_cap_t *caps, int count);
+/// select color space for video mode into cs, false if color space is not managed
+extern bool colorspace_plan (const char *mode, char *cs, size_t size);
+/// set the color space chosen by colorspace_plan (), runs on actuator thread
+extern bool colorspace_apply (const char *cs);
 
 #endif /* __COLORSPACE_H__ */
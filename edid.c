@@ -0,0 +1,277 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Decoding display modes from EDID.
+ *
+ * We look at CEA-861 short video descriptors (including the 4:2:0-only
+ * ones and HDMI 1.4 4K VICs) and at detailed timing descriptors, and
+ * translate them to the mode names that AMLogic hdmitx driver knows.
+ * Timings the driver can't output are ignored.
+ */
+
+#include "afrd.h"
+#include "edid.h"
+
+// a timing that has a name in hdmitx driver
+typedef struct
+{
+	uint8_t vic;
+	uint16_t width;
+	uint16_t height;
+	uint8_t rate;
+	bool interlaced;
+	const char *name;
+} edid_timing_t;
+
+static const edid_timing_t edid_timing [] =
+{
+	{   2,  720,  480, 60, false, "480p60hz" },
+	{   3,  720,  480, 60, false, "480p60hz" },
+	{   4, 1280,  720, 60, false, "720p60hz" },
+	{   5, 1920, 1080, 60, true,  "1080i60hz" },
+	{   6, 1440,  480, 60, true,  "480i60hz" },
+	{   7, 1440,  480, 60, true,  "480i60hz" },
+	{  16, 1920, 1080, 60, false, "1080p60hz" },
+	{  17,  720,  576, 50, false, "576p50hz" },
+	{  18,  720,  576, 50, false, "576p50hz" },
+	{  19, 1280,  720, 50, false, "720p50hz" },
+	{  20, 1920, 1080, 50, true,  "1080i50hz" },
+	{  21, 1440,  576, 50, true,  "576i50hz" },
+	{  22, 1440,  576, 50, true,  "576i50hz" },
+	{  31, 1920, 1080, 50, false, "1080p50hz" },
+	{  32, 1920, 1080, 24, false, "1080p24hz" },
+	{  33, 1920, 1080, 25, false, "1080p25hz" },
+	{  34, 1920, 1080, 30, false, "1080p30hz" },
+	{  93, 3840, 2160, 24, false, "2160p24hz" },
+	{  94, 3840, 2160, 25, false, "2160p25hz" },
+	{  95, 3840, 2160, 30, false, "2160p30hz" },
+	{  96, 3840, 2160, 50, false, "2160p50hz" },
+	{  97, 3840, 2160, 60, false, "2160p60hz" },
+	{  98, 4096, 2160, 24, false, "smpte24hz" },
+	{  99, 4096, 2160, 25, false, "smpte25hz" },
+	{ 100, 4096, 2160, 30, false, "smpte30hz" },
+	{ 101, 4096, 2160, 50, false, "smpte50hz" },
+	{ 102, 4096, 2160, 60, false, "smpte60hz" },
+	// 64:27 variants of 3840x2160
+	{ 103, 3840, 2160, 24, false, "2160p24hz" },
+	{ 104, 3840, 2160, 25, false, "2160p25hz" },
+	{ 105, 3840, 2160, 30, false, "2160p30hz" },
+	{ 106, 3840, 2160, 50, false, "2160p50hz" },
+	{ 107, 3840, 2160, 60, false, "2160p60hz" },
+};
+
+// HDMI 1.4 VSDB VICs 1 to 4 are same as these CEA-861-F VICs
+static const uint8_t hdmi_vic [] = { 95, 94, 93, 98 };
+
+// CEA-861 timings at these rates are defined for both N and N*1000/1001 Hz
+static bool rate_has_fract (int rate)
+{
+	return (rate == 24) || (rate == 30) || (rate == 60) ||
+		(rate == 120) || (rate == 240);
+}
+
+static int hex_digit (char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	return -1;
+}
+
+int edid_from_hex (const char *hex, int len, uint8_t *edid, int size)
+{
+	int n = 0, hi = -1;
+	for (int i = 0; (i < len) && (n < size); i++) {
+		int d = hex_digit (hex [i]);
+		if (d < 0)
+			continue;
+
+		if (hi < 0)
+			hi = d;
+		else {
+			edid [n++] = (hi << 4) | d;
+			hi = -1;
+		}
+	}
+
+	return n;
+}
+
+int edid_blocks (const uint8_t *edid, int size)
+{
+	static const uint8_t header [8] = { 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0 };
+	if ((size < EDID_BLOCK) || (memcmp (edid, header, sizeof (header)) != 0))
+		return 0;
+
+	// base block tells how many extension blocks follow
+	int blocks = 1 + edid [126];
+	if (blocks > EDID_MAX_BLOCKS)
+		blocks = EDID_MAX_BLOCKS;
+	if (blocks > size / EDID_BLOCK)
+		blocks = size / EDID_BLOCK;
+
+	for (int b = 0; b < blocks; b++) {
+		uint8_t sum = 0;
+		for (int i = 0; i < EDID_BLOCK; i++)
+			sum += edid [b * EDID_BLOCK + i];
+		if (sum != 0)
+			return b;
+	}
+
+	return blocks;
+}
+
+static void mode_add (edid_mode_t *modes, int *count, int max,
+	const edid_timing_t *t, bool fract_ok)
+{
+	for (int i = 0; i < *count; i++)
+		if (modes [i].name == t->name) {
+			modes [i].fract_ok |= fract_ok;
+			return;
+		}
+
+	if (*count >= max)
+		return;
+
+	modes [*count].name = t->name;
+	modes [*count].fract_ok = fract_ok;
+	(*count)++;
+}
+
+static void vic_add (edid_mode_t *modes, int *count, int max, int vic)
+{
+	for (size_t i = 0; i < ARRAY_SIZE (edid_timing); i++)
+		if (edid_timing [i].vic == vic) {
+			const edid_timing_t *t = &edid_timing [i];
+			mode_add (modes, count, max, t, rate_has_fract (t->rate));
+			return;
+		}
+}
+
+// decode a detailed timing descriptor, 18 bytes
+static void dtd_add (edid_mode_t *modes, int *count, int max, const uint8_t *dtd)
+{
+	unsigned clock = dtd [0] | (dtd [1] << 8);
+	// zero pixel clock means this is not a timing
+	if (!clock)
+		return;
+
+	unsigned hactive = dtd [2] | ((dtd [4] & 0xf0) << 4);
+	unsigned hblank = dtd [3] | ((dtd [4] & 0x0f) << 8);
+	unsigned vactive = dtd [5] | ((dtd [7] & 0xf0) << 4);
+	unsigned vblank = dtd [6] | ((dtd [7] & 0x0f) << 8);
+	bool interlaced = (dtd [17] & 0x80) != 0;
+
+	unsigned total = (hactive + hblank) * (vactive + vblank);
+	if (!total)
+		return;
+
+	// (field) refresh rate in mHz, pixel clock is in 10 kHz units
+	unsigned mhz = ((uint64_t)clock * 10000000 + total / 2) / total;
+	unsigned rate = (mhz + 500) / 1000;
+	unsigned frac_mhz = (rate * 1000000 + 500) / 1001;
+	bool fract = abs ((int)(mhz - frac_mhz)) < abs ((int)(mhz - rate * 1000));
+
+	if (interlaced)
+		vactive *= 2;
+
+	for (size_t i = 0; i < ARRAY_SIZE (edid_timing); i++) {
+		const edid_timing_t *t = &edid_timing [i];
+		if ((t->width == hactive) && (t->height == vactive) &&
+		    (t->interlaced == interlaced) && (t->rate == rate)) {
+			mode_add (modes, count, max, t, fract && rate_has_fract (rate));
+			return;
+		}
+	}
+}
+
+// decode CEA-861 data block collection
+static void cea_data_blocks (edid_mode_t *modes, int *count, int max,
+	const uint8_t *cur, const uint8_t *end)
+{
+	while (cur < end) {
+		int tag = cur [0] >> 5;
+		int len = cur [0] & 31;
+		const uint8_t *data = cur + 1;
+		cur = data + len;
+		if (cur > end)
+			break;
+
+		switch (tag) {
+			case 2:
+				// video data block, short video descriptors
+				for (int i = 0; i < len; i++) {
+					int vic = data [i];
+					// VICs 1 to 64 may have the native flag set
+					if ((vic >= 129) && (vic <= 192))
+						vic &= 0x7f;
+					vic_add (modes, count, max, vic);
+				}
+				break;
+
+			case 3: {
+				// HDMI 1.4 vendor-specific data block
+				if ((len < 8) || (data [0] != 0x03) || (data [1] != 0x0c) || (data [2] != 0))
+					break;
+
+				int flags = data [7];
+				int i = 8;
+				if (flags & 0x80)
+					i += 2; // video & audio latency
+				if (flags & 0x40)
+					i += 2; // interlaced latency
+				if (!(flags & 0x20) || (i + 1 >= len))
+					break; // no HDMI video info
+
+				int nvic = data [i + 1] >> 5;
+				for (i += 2; (nvic > 0) && (i < len); nvic--, i++)
+					if ((data [i] >= 1) && (data [i] <= ARRAY_SIZE (hdmi_vic)))
+						vic_add (modes, count, max, hdmi_vic [data [i] - 1]);
+				break;
+			}
+
+			case 7:
+				// YCbCr 4:2:0 video data block, modes that are only 4:2:0
+				if ((len >= 1) && (data [0] == 14))
+					for (int i = 1; i < len; i++)
+						vic_add (modes, count, max, data [i]);
+				break;
+		}
+	}
+}
+
+int edid_modes (const uint8_t *edid, int blocks, edid_mode_t *modes, int max)
+{
+	int count = 0;
+	if (blocks < 1)
+		return 0;
+
+	// the four 18-byte descriptors of base block
+	for (int i = 54; i + 18 <= 126; i += 18)
+		dtd_add (modes, &count, max, edid + i);
+
+	for (int b = 1; b < blocks; b++) {
+		const uint8_t *ext = edid + b * EDID_BLOCK;
+		// CEA-861 extension, revision 3 or later has data blocks
+		if (ext [0] != 0x02)
+			continue;
+
+		int dtd_start = ext [2];
+		if ((dtd_start < 4) || (dtd_start > 127))
+			continue;
+
+		if (ext [1] >= 3)
+			cea_data_blocks (modes, &count, max, ext + 4, ext + dtd_start);
+
+		for (int i = dtd_start; i + 18 <= 127; i += 18)
+			dtd_add (modes, &count, max, ext + i);
+	}
+
+	return count;
+}
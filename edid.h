@@ -0,0 +1,39 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Decoding display modes from EDID
+ */
+
+#ifndef __EDID_H__
+#define __EDID_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/// EDID block size
+#define EDID_BLOCK		128
+/// Maximal number of EDID blocks we look at
+#define EDID_MAX_BLOCKS		4
+/// Maximal number of display modes we collect from EDID
+#define EDID_MAX_MODES		48
+
+/// a display mode found in EDID
+typedef struct
+{
+	/// mode name as display driver knows it
+	const char *name;
+	/// the display accepts the 1000/1001 fractional variant of this mode
+	bool fract_ok;
+} edid_mode_t;
+
+/// decode the hex dump from hdmitx rawedid, return number of bytes
+extern int edid_from_hex (const char *hex, int len, uint8_t *edid, int size);
+/// check EDID header and block checksums, return number of good leading blocks
+extern int edid_blocks (const uint8_t *edid, int size);
+/// collect display modes from CEA-861 VICs and detailed timings, return count
+extern int edid_modes (const uint8_t *edid, int blocks, edid_mode_t *modes, int max);
+
+#endif /* __EDID_H__ */
@@ -0,0 +1,232 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Bayesian fusion of frame rate evidence from several sources.
+ *
+ * Every source is modelled as reporting the true frame rate with
+ * probability p (its reliability), and any other candidate rate
+ * otherwise. Every sample adds log-likelihoods to candidate rates,
+ * so an occasional outlier only lowers the posterior instead of
+ * throwing away everything collected so far. Source reliability
+ * is learned by comparing it with the rate we've finally settled on.
+ */
+
+#include "afrd.h"
+#include "fusion.h"
+
+// the candidate frame rates, .8 fixed-point
+static const int fusion_rate [FUSION_RATES] =
+{
+	FP8 (23,976), FP8 (24,000),
+	FP8 (25,000),
+	FP8 (29,970), FP8 (30,000),
+	FP8 (50,000),
+	FP8 (59,940), FP8 (60,000),
+};
+
+// source reliability before we learn anything, 1/1000 units;
+// chosen so that 1, 1, 3 and 4 samples are enough to accept
+static const uint16_t fusion_rel_default [FUSION_SOURCES] =
+{
+	990,	// FRH
+	990,	// CHUNKS at 90% confidence
+	520,	// BLOCKS
+	400,	// VDEC
+};
+
+// weight of default reliability, in samples
+#define REL_PSEUDO_SAMPLES	20
+// halve reliability counters when they reach this, to forget old history
+#define REL_MAX_SAMPLES		1000
+
+// log2 (x) for 16.16 fixed-point x > 0, in 1/256 units
+static int log2_fp (uint32_t x)
+{
+	int r = 0;
+	while (x >= (2 << 16)) {
+		x >>= 1;
+		r += 256;
+	}
+	while (x < (1 << 16)) {
+		x <<= 1;
+		r -= 256;
+	}
+
+	// x is in [1, 2) now, get fraction bits by squaring
+	for (int bit = 128; bit; bit >>= 1) {
+		x = (uint32_t)(((uint64_t)x * x) >> 16);
+		if (x >= (2 << 16)) {
+			x >>= 1;
+			r += bit;
+		}
+	}
+
+	return r;
+}
+
+// 2^(-d/256) for d >= 0, 16.16 fixed-point
+static uint32_t exp2_neg (int d)
+{
+	static const uint32_t frac [17] =
+	{
+		65536, 62757, 60097, 57549, 55109, 52773, 50535, 48393,
+		46341, 44376, 42495, 40693, 38968, 37316, 35734, 34219, 32768
+	};
+
+	if (d >= 32 * 256)
+		return 0;
+
+	// interpolate between 1/16 steps
+	int i = (d & 255) >> 4, f = d & 15;
+	uint32_t v = frac [i] - (((frac [i] - frac [i + 1]) * f) >> 4);
+	return v >> (d >> 8);
+}
+
+static int rate_index (int hz)
+{
+	for (int i = 0; i < FUSION_RATES; i++)
+		if (abs (fusion_rate [i] - hz) <= 1)
+			return i;
+	return -1;
+}
+
+// evidence of a sure sample from a source of given reliability
+static int32_t rel_evidence (int p)
+{
+	// a useless source is one no better than a random guess
+	if (p * FUSION_RATES <= FUSION_ONE)
+		return 0;
+	if (p > FUSION_ONE - 5)
+		p = FUSION_ONE - 5;
+
+	// log2 (p / ((1 - p) / (N - 1)))
+	uint32_t num = ((uint32_t)p * (FUSION_RATES - 1) << 16) / FUSION_ONE;
+	uint32_t den = ((uint32_t)(FUSION_ONE - p) << 16) / FUSION_ONE;
+	return log2_fp (num) - log2_fp (den);
+}
+
+void fusion_reset (fusion_t *fusion, const fusion_rel_t *rel)
+{
+	memset (fusion, 0, sizeof (*fusion));
+
+	for (int src = 0; src < FUSION_SOURCES; src++) {
+		int p = fusion_rel_default [src];
+		if (rel && rel->total [src])
+			p = (rel->agree [src] * FUSION_ONE + p * REL_PSEUDO_SAMPLES) /
+				(rel->total [src] + REL_PSEUDO_SAMPLES);
+		fusion->evidence [src] = rel_evidence (p);
+	}
+
+	fusion->ready = true;
+}
+
+bool fusion_add (fusion_t *fusion, int src, int hz, int confidence)
+{
+	int idx = rate_index (hz);
+	if (idx < 0)
+		return false;
+
+	fusion->score [src][idx] += (fusion->evidence [src] * confidence) / 100;
+	fusion->samples [src]++;
+	return true;
+}
+
+bool fusion_set (fusion_t *fusion, int src, int hz, int confidence)
+{
+	memset (&fusion->score [src], 0, sizeof (fusion->score [src]));
+	fusion->samples [src] = 0;
+	return fusion_add (fusion, src, hz, confidence);
+}
+
+void fusion_prior (fusion_t *fusion, int src, int hz)
+{
+	int idx = rate_index (hz);
+	if (idx < 0)
+		return;
+
+	// log-odds needed to reach FUSION_ACCEPT against all other rates,
+	// plus a bit to stay clear of rounding errors
+	uint32_t odds = ((uint32_t)FUSION_ACCEPT * (FUSION_RATES - 1) << 16) /
+		(FUSION_ONE - FUSION_ACCEPT);
+	int32_t prior = log2_fp (odds) + 16 - fusion->evidence [src];
+
+	if (prior > fusion->prior [idx])
+		fusion->prior [idx] = prior;
+}
+
+int fusion_best (const fusion_t *fusion, int *posterior, int *src)
+{
+	*posterior = 0;
+	*src = -1;
+
+	int samples = 0;
+	for (int s = 0; s < FUSION_SOURCES; s++)
+		samples += fusion->samples [s];
+	if (!samples)
+		return 0;
+
+	int32_t total [FUSION_RATES];
+	int best = 0;
+	for (int i = 0; i < FUSION_RATES; i++) {
+		total [i] = fusion->prior [i];
+		for (int s = 0; s < FUSION_SOURCES; s++)
+			total [i] += fusion->score [s][i];
+		if (total [i] > total [best])
+			best = i;
+	}
+
+	// posterior (best) = 1 / sum (2 ^ (total [i] - total [best]))
+	uint64_t sum = 0;
+	for (int i = 0; i < FUSION_RATES; i++)
+		sum += exp2_neg (total [best] - total [i]);
+	*posterior = (int)(((uint64_t)FUSION_ONE << 16) / sum);
+
+	// the source that favours the winner the most
+	int32_t best_margin = 0;
+	for (int s = 0; s < FUSION_SOURCES; s++) {
+		if (!fusion->samples [s])
+			continue;
+
+		int32_t margin = INT32_MAX;
+		for (int i = 0; i < FUSION_RATES; i++)
+			if ((i != best) && (fusion->score [s][best] - fusion->score [s][i] < margin))
+				margin = fusion->score [s][best] - fusion->score [s][i];
+
+		if (margin > best_margin) {
+			best_margin = margin;
+			*src = s;
+		}
+	}
+
+	return fusion_rate [best];
+}
+
+void fusion_learn (const fusion_t *fusion, int hz, fusion_rel_t *rel)
+{
+	int idx = rate_index (hz);
+	if (idx < 0)
+		return;
+
+	for (int s = 0; s < FUSION_SOURCES; s++) {
+		if (!fusion->samples [s])
+			continue;
+
+		// what this source alone thinks the rate is
+		int best = 0;
+		for (int i = 1; i < FUSION_RATES; i++)
+			if (fusion->score [s][i] > fusion->score [s][best])
+				best = i;
+
+		if (best == idx)
+			rel->agree [s]++;
+		rel->total [s]++;
+
+		if (rel->total [s] >= REL_MAX_SAMPLES) {
+			rel->agree [s] /= 2;
+			rel->total [s] /= 2;
+		}
+	}
+}
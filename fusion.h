@@ -0,0 +1,63 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Bayesian fusion of frame rate evidence from several sources
+ */
+
+#ifndef __FUSION_H__
+#define __FUSION_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/// Number of candidate frame rates
+#define FUSION_RATES		8
+/// Number of fps sources, must match SRC_COUNT
+#define FUSION_SOURCES		4
+
+/// Posterior probabilities are expressed in 1/1000 units
+#define FUSION_ONE		1000
+/// accept frame rate when its posterior reaches this
+#define FUSION_ACCEPT		980
+/// switch provisionally when posterior reaches this
+#define FUSION_PROVISIONAL	900
+
+/// How often every source agreed with the settled frame rate
+typedef struct
+{
+	uint16_t agree [FUSION_SOURCES];
+	uint16_t total [FUSION_SOURCES];
+} fusion_rel_t;
+
+/// Frame rate posterior state
+typedef struct
+{
+	/// true after fusion_reset()
+	bool ready;
+	/// log-likelihood of every candidate rate from every source, 1/256 bits
+	int32_t score [FUSION_SOURCES][FUSION_RATES];
+	/// log-prior of every candidate rate, 1/256 bits
+	int32_t prior [FUSION_RATES];
+	/// number of samples from every source
+	uint16_t samples [FUSION_SOURCES];
+	/// evidence of a sure sample from every source, 1/256 bits
+	int32_t evidence [FUSION_SOURCES];
+} fusion_t;
+
+/// start over with given source reliability (NULL for defaults)
+extern void fusion_reset (fusion_t *fusion, const fusion_rel_t *rel);
+/// add a sample from a source, confidence in percent
+extern bool fusion_add (fusion_t *fusion, int src, int hz, int confidence);
+/// replace the evidence from a source that accumulates samples by itself
+extern bool fusion_set (fusion_t *fusion, int src, int hz, int confidence);
+/// make a single sure sample from src enough to accept hz
+extern void fusion_prior (fusion_t *fusion, int src, int hz);
+/// most probable frame rate, its posterior and the most convincing source
+extern int fusion_best (const fusion_t *fusion, int *posterior, int *src);
+/// update source reliability after frame rate was settled
+extern void fusion_learn (const fusion_t *fusion, int hz, fusion_rel_t *rel);
+
+#endif /* __FUSION_H__ */
@@ -8,67 +8,139 @@
  */
 
 #include "afrd.h"
+#include "actuator.h"
+#include "link.h"
+#include "watch.h"
 
 // 0 - not supported, 1 - HDCP 1.4, 2 - HDCP 2.2
 int g_hdcp_enabled = 0;
 
+static sysfs_attr_t g_attr_hdcp_mode;
+static sysfs_attr_t g_attr_hdcp_auth;
+
+// how often to check HDCP authentication if the driver does not notify, ms
+#define HDCP_CHECK_PERIOD	8000
+
+static const char g_hdcp_mode_str [][3] =
+{
+	"0", "14", "22"
+};
+
+// HDCP authentication changed, enable HDCP back if it was lost
+static void hdcp_auth_changed (sysfs_attr_t *sa, const char *value, bool changed)
+{
+	if ((g_hdcp_enabled == 0) || g_blackened)
+		return;
+
+	// a switch in progress will restore HDCP itself
+	if (actuator_busy () || link_watching ())
+		return;
+
+	if (strcmp (value, "0") == 0)
+		hdcp_restore (true);
+}
+
+static void hdcp_attr_init ()
+{
+	if (g_attr_hdcp_mode.path [0])
+		return;
+
+	sysfs_attr_init (&g_attr_hdcp_mode, g_hdmi_dev, "hdcp_mode");
+	sysfs_attr_init (&g_attr_hdcp_auth, DEFAULT_HDCP_AUTHENTICATED, NULL);
+	watch_add (&g_attr_hdcp_auth, HDCP_CHECK_PERIOD, hdcp_auth_changed);
+}
+
 void hdcp_init ()
 {
-	char *hdcp = sysfs_get_str (g_hdmi_dev, "hdcp_mode");
-	char *cur = hdcp + strspn (hdcp, spaces);
-	strip_trailing_spaces (strchr (cur, 0), cur);
+	hdcp_attr_init ();
+
+	char buff [32];
+	int n = sysfs_attr_read (&g_attr_hdcp_mode, buff, sizeof (buff));
 	g_hdcp_enabled = 0;
-	if (!strcmp (cur, "off")) {
+	if (n < 0) {
+		trace (1, "HDCP mode is unknown\n");
+		return;
+	}
+
+	strspan_t cur = strspan (buff, n);
+	strspan_trim (&cur);
+
+	if (strspan_eq (&cur, "off")) {
 		g_hdcp_enabled = 0;
 		trace (1, "HDCP is not enabled\n");
 	}
-	else if (!strcmp (cur, "14")) {
+	else if (strspan_eq (&cur, "14")) {
 		g_hdcp_enabled = 1;
 		trace (1, "HDCP 1.4 is enabled\n");
 	}
-	else if (!strcmp (cur, "22")) {
+	else if (strspan_eq (&cur, "22")) {
 		g_hdcp_enabled = 2;
 		trace (1, "HDCP 2.2 is enabled\n");
 	}
 	else
-		trace (1, "Unrecognized HDCP mode: %s\n", cur);
-	free (hdcp);
+		trace (1, "Unrecognized HDCP mode: %.*s\n", (int)cur.len, cur.str);
+}
+
+int hdcp_mode ()
+{
+	return g_hdcp_enabled;
+}
+
+void hdcp_set_mode (int mode)
+{
+	hdcp_attr_init ();
+	g_hdcp_enabled = mode;
 }
 
 void hdcp_fini ()
 {
+	actuator_wait ();
 	g_hdcp_enabled = 0;
+	watch_remove (&g_attr_hdcp_auth);
+	sysfs_attr_init (&g_attr_hdcp_mode, NULL, NULL);
+	sysfs_attr_init (&g_attr_hdcp_auth, NULL, NULL);
 }
 
 void hdcp_restore (bool force)
 {
-	static const char hdcp_mode [][3] =
-	{
-		"0", "14", "22"
-	};
-
 	if (force && (g_hdcp_enabled == 0))
 		g_hdcp_enabled = 1;
 
 	if ((g_hdcp_enabled == 0) || g_blackened)
 		return;
 
-	const char *mode = hdcp_mode [g_hdcp_enabled];
-	sysfs_set_str (g_hdmi_dev, "hdcp_mode", mode);
-	trace (1, "Setting HDCP mode to %s\n", mode);
+	hdcp_attr_init ();
+
+	// the driver may block on it like on a mode write, so let the actuator do it;
+	// writing HDCP mode restarts authentication, so it is a must when forced
+	display_plan_t plan;
+	memset (&plan, 0, sizeof (plan));
+	plan.hdcp = g_hdcp_enabled;
+	plan.hdcp_restart = force;
+	plan.hdcp_only = true;
+	actuator_submit (&plan);
 }
 
-void hdcp_check ()
+int hdcp_plan ()
 {
-	if ((g_hdcp_enabled == 0) || g_blackened)
-		return;
+	if (g_hdcp_enabled == 0)
+		return 0;
 
-	char *auth = sysfs_read (DEFAULT_HDCP_AUTHENTICATED);
-	char *cur = auth + strspn (auth, spaces);
-	strip_trailing_spaces (strchr (cur, 0), cur);
-	bool disabled = (strcmp (cur, "0") == 0);
-	free (auth);
+	hdcp_attr_init ();
+	return g_hdcp_enabled;
+}
+
+void hdcp_apply (int mode, bool restart)
+{
+	const char *str = g_hdcp_mode_str [mode];
+	if (restart)
+		sysfs_attr_force (&g_attr_hdcp_mode, str);
+	else {
+		// check if the driver has kept HDCP mode over the mode switch
+		sysfs_attr_reread (&g_attr_hdcp_mode);
+		if (sysfs_attr_set (&g_attr_hdcp_mode, str) > 0)
+			return;
+	}
 
-	if (disabled)
-		hdcp_restore (false);
+	trace (1, "Setting HDCP mode to %s\n", str);
 }
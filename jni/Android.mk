@@ -5,8 +5,8 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := afrd
 LOCAL_SRC_FILES := $(addprefix ../,main.c afrd.c sysfs.c cfg_parse/cfg_parse.c \
-	cfg.c modes.c mstime.c uevent_filter.c colorspace.c strfun.c shmem.c \
-	apisock.c crc32.c androp.c hdcp.c)
+	cfg.c modes.c mstime.c uevent_filter.c ptsest.c colorspace.c strfun.c shmem.c \
+	apisock.c crc32.c androp.c hdcp.c capture.c sampler.c prior.c fusion.c edid.c latency.c actuator.c link.c watch.c sim.c)
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../cfg_parse
 LOCAL_CFLAGS := -DBDATE="\"$(shell date +"%Y-%m-%d %H:%M:%S")\""
 
@@ -0,0 +1,125 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Histograms of time spent on every step of a display mode switch.
+ *
+ * Durations are counted in log2-sized buckets right in the shared
+ * memory, so that the percentiles can be estimated by any client.
+ */
+
+#include "afrd.h"
+#include "latency.h"
+
+static const char *g_phase_name [LAT_PHASES] =
+{
+	"queue", "trigger", "detect", "query", "decide",
+	"frac", "colorspace", "null", "mode", "hdcp", "switch", "link"
+};
+
+static uint64_t timespec_us (const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+uint64_t latency_now ()
+{
+	// replay runs on a virtual clock
+	if (g_mstime_virtual)
+		return (uint64_t)g_mstime_virtual * 1000;
+
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return timespec_us (&ts);
+}
+
+uint64_t latency_from_realtime (const struct timespec *ts)
+{
+	struct timespec real;
+	clock_gettime (CLOCK_REALTIME, &real);
+	uint64_t now = latency_now ();
+
+	// how long ago the event happened
+	int64_t age = timespec_us (&real) - timespec_us (ts);
+	if (age < 0)
+		age = 0;
+	if ((uint64_t)age > now)
+		age = now;
+
+	return now - age;
+}
+
+void latency_add (latency_phase_t phase, uint64_t us)
+{
+	int bucket = 0;
+	while ((us >> bucket) && (bucket < LATENCY_BUCKETS - 1))
+		bucket++;
+
+	g_afrd_stats.latency [phase][bucket]++;
+}
+
+void latency_since (latency_phase_t phase, uint64_t start)
+{
+	uint64_t now = latency_now ();
+	latency_add (phase, (now > start) ? now - start : 0);
+}
+
+void latency_step (latency_steps_t *steps, latency_phase_t phase, uint64_t start)
+{
+	uint64_t now = latency_now ();
+	uint64_t us = (now > start) ? now - start : 0;
+	steps->us [phase] = (us > UINT32_MAX) ? UINT32_MAX : us;
+	steps->mask |= 1U << phase;
+}
+
+void latency_commit (const latency_steps_t *steps)
+{
+	for (int phase = 0; phase < LAT_PHASES; phase++)
+		if (steps->mask & (1U << phase))
+			latency_add (phase, steps->us [phase]);
+}
+
+uint32_t latency_count (latency_phase_t phase)
+{
+	uint32_t total = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		total += g_afrd_stats.latency [phase][i];
+	return total;
+}
+
+uint32_t latency_percentile (latency_phase_t phase, int percent)
+{
+	uint32_t total = latency_count (phase);
+	if (!total)
+		return 0;
+
+	// the rank of the duration we're looking for, 1-based
+	uint32_t rank = ((uint64_t)total * percent + 99) / 100;
+	if (!rank)
+		rank = 1;
+
+	uint32_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		uint32_t n = g_afrd_stats.latency [phase][i];
+		if (seen + n < rank) {
+			seen += n;
+			continue;
+		}
+
+		// assume durations are evenly spread inside the bucket
+		uint32_t lo = i ? (1U << (i - 1)) : 0;
+		uint32_t hi = 1U << i;
+		if (i == LATENCY_BUCKETS - 1)
+			return lo;
+		return lo + (uint64_t)(hi - lo) * (rank - seen) / n;
+	}
+
+	return 0;
+}
+
+const char *latency_phase_name (latency_phase_t phase)
+{
+	return g_phase_name [phase];
+}
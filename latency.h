@@ -0,0 +1,79 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Histograms of time spent on every step of a display mode switch
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/// Number of histogram buckets: 0-1 us, 1-2 us, 2-4 us, ..., 2^24 us and more
+#define LATENCY_BUCKETS		26
+
+/// the steps of a display mode switch we measure
+typedef enum
+{
+	/// uevent waiting in netlink socket until we handle it
+	LAT_QUEUE,
+	/// from receiving the uevent that started playback to delay_framerate_switch ()
+	LAT_TRIGGER,
+	/// from delay_framerate_switch () to the decision what frame rate to use
+	LAT_DETECT,
+	/// reading and parsing one fps source
+	LAT_QUERY,
+	/// choosing the display mode
+	LAT_DECIDE,
+	/// writing frac_rate_policy
+	LAT_FRAC,
+	/// choosing and setting color space
+	LAT_COLORSPACE,
+	/// blanking the screen with the null mode
+	LAT_NULL,
+	/// writing the display mode
+	LAT_MODE,
+	/// restoring HDCP mode
+	LAT_HDCP,
+	/// from receiving the uevent that started playback to display mode switch done
+	LAT_SWITCH,
+	/// from writing display mode to display link up again
+	LAT_LINK,
+
+	/// number of steps
+	LAT_PHASES
+} latency_phase_t;
+
+/// step durations measured off the main thread, accounted later
+typedef struct
+{
+	/// bit mask of measured steps
+	uint32_t mask;
+	/// step durations in microseconds
+	uint32_t us [LAT_PHASES];
+} latency_steps_t;
+
+/// current time in microseconds, virtual during replay
+extern uint64_t latency_now ();
+/// the latency_now () time of an event stamped with CLOCK_REALTIME
+extern uint64_t latency_from_realtime (const struct timespec *ts);
+/// account the time elapsed since start (a latency_now () value)
+extern void latency_since (latency_phase_t phase, uint64_t start);
+/// account a duration in microseconds
+extern void latency_add (latency_phase_t phase, uint64_t us);
+/// remember the time elapsed since start into steps without accounting it
+extern void latency_step (latency_steps_t *steps, latency_phase_t phase, uint64_t start);
+/// account all step durations remembered by latency_step ()
+extern void latency_commit (const latency_steps_t *steps);
+/// estimate given percentile of step durations from its histogram, in microseconds
+extern uint32_t latency_percentile (latency_phase_t phase, int percent);
+/// number of times a step was measured
+extern uint32_t latency_count (latency_phase_t phase);
+/// short name of a step
+extern const char *latency_phase_name (latency_phase_t phase);
+
+#endif /* __LATENCY_H__ */
@@ -0,0 +1,137 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Detecting when display link comes back after a mode switch.
+ *
+ * The link is up when HDMI is plugged, the display driver reports
+ * the new mode in vinfo and HDCP, if it is used, is authenticated.
+ * The attributes are watched for change notifications, so drivers
+ * that call sysfs_notify() wake us up immediately; for the others
+ * the caller has to re-check the state on a timer.
+ */
+
+#include "afrd.h"
+#include "link.h"
+#include "watch.h"
+
+#include <ctype.h>
+
+static sysfs_attr_t g_link_hdmi_state;
+static sysfs_attr_t g_link_hdcp_auth;
+static sysfs_attr_t g_link_vinfo;
+
+// the display mode we wait for, empty name if not watching
+static display_mode_t g_link_mode;
+// a watched attribute has changed since last link_changed ()
+static bool g_link_changed;
+
+void link_init (const char *hdmi_state, const char *vinfo)
+{
+	sysfs_attr_init (&g_link_hdmi_state, hdmi_state, NULL);
+	sysfs_attr_init (&g_link_hdcp_auth, DEFAULT_HDCP_AUTHENTICATED, NULL);
+	sysfs_attr_init (&g_link_vinfo, vinfo, NULL);
+	link_unwatch ();
+}
+
+void link_fini ()
+{
+	link_unwatch ();
+	sysfs_attr_init (&g_link_hdmi_state, NULL, NULL);
+	sysfs_attr_init (&g_link_hdcp_auth, NULL, NULL);
+	sysfs_attr_init (&g_link_vinfo, NULL, NULL);
+}
+
+static void link_attr_changed (sysfs_attr_t *sa, const char *value, bool changed)
+{
+	if (changed)
+		g_link_changed = true;
+}
+
+void link_watch (const display_mode_t *mode)
+{
+	g_link_mode = *mode;
+	g_link_changed = false;
+	watch_add (&g_link_hdmi_state, 0, link_attr_changed);
+	watch_add (&g_link_hdcp_auth, 0, link_attr_changed);
+	watch_add (&g_link_vinfo, 0, link_attr_changed);
+}
+
+void link_unwatch ()
+{
+	memset (&g_link_mode, 0, sizeof (g_link_mode));
+	watch_remove (&g_link_hdmi_state);
+	watch_remove (&g_link_hdcp_auth);
+	watch_remove (&g_link_vinfo);
+}
+
+bool link_changed ()
+{
+	bool changed = g_link_changed;
+	g_link_changed = false;
+	return changed;
+}
+
+bool link_watching ()
+{
+	return g_link_mode.name [0] != 0;
+}
+
+// check if vinfo shows the mode we wait for, -1 if it can't tell
+static int link_vinfo_check ()
+{
+	char buff [512];
+	if (sysfs_attr_read (&g_link_vinfo, buff, sizeof (buff)) < 0)
+		return -1;
+
+	//     name:                  1080p60hz
+	char *name = strstr (buff, "name:");
+	if (!name)
+		return -1;
+
+	name += 5;
+	while (*name && isspace ((unsigned char)*name))
+		name++;
+	size_t len = 0;
+	while (name [len] && !isspace ((unsigned char)name [len]))
+		len++;
+
+	return (len == strlen (g_link_mode.name)) &&
+		(memcmp (name, g_link_mode.name, len) == 0);
+}
+
+// check if HDCP link is authenticated, -1 if it can't tell
+static int link_hdcp_check ()
+{
+	char buff [16];
+	int n = sysfs_attr_read (&g_link_hdcp_auth, buff, sizeof (buff));
+	if (n < 0)
+		return -1;
+
+	strspan_t cur = strspan (buff, n);
+	strspan_trim (&cur);
+	return !strspan_eq (&cur, "0");
+}
+
+link_state_t link_check (const char **waiting)
+{
+	*waiting = NULL;
+
+	// can't tell if it fails, so assume plugged
+	if (sysfs_attr_get_int (&g_link_hdmi_state) == 0)
+		return LINK_UNPLUGGED;
+
+	if (link_vinfo_check () == 0) {
+		*waiting = "display mode";
+		return LINK_DOWN;
+	}
+
+	if (hdcp_mode () && !g_blackened && (link_hdcp_check () == 0)) {
+		*waiting = "HDCP authentication";
+		return LINK_DOWN;
+	}
+
+	return LINK_UP;
+}
@@ -0,0 +1,42 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Detecting when display link comes back after a mode switch
+ */
+
+#ifndef __LINK_H__
+#define __LINK_H__
+
+#include <stdbool.h>
+#include "afrd.h"
+
+/// display link state as seen from sysfs
+typedef enum
+{
+	/// the display is unplugged
+	LINK_UNPLUGGED,
+	/// the display is plugged but the new mode is not up yet
+	LINK_DOWN,
+	/// the new mode is up and HDCP (if used) is authenticated
+	LINK_UP,
+} link_state_t;
+
+/// open the attributes describing display link state
+extern void link_init (const char *hdmi_state, const char *vinfo);
+/// close the link state attributes
+extern void link_fini ();
+/// start watching for the display link to come up in given mode
+extern void link_watch (const display_mode_t *mode);
+/// stop watching the display link
+extern void link_unwatch ();
+/// true while waiting for the display link to come up
+extern bool link_watching ();
+/// check display link state; if it is down, *waiting tells what for
+extern link_state_t link_check (const char **waiting);
+/// true if a link state attribute has changed since the last call
+extern bool link_changed ();
+
+#endif /* __LINK_H__ */
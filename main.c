@@ -33,6 +33,8 @@
 #include <sys/resource.h>
 
 #include "afrd.h"
+#include "capture.h"
+#include "sim.h"
 
 const char *g_version = "0.3.2";
 const char *g_ver_sfx = "";
@@ -71,6 +73,10 @@ static void show_help (char *const *argv)
 	printf ("	-k	kill the running daemon (can be used with -D)\n");
 	printf ("	-l FILE	write the log to FILE (imposes -vvv)\n");
 	printf ("	-s	display running daemon stats\n");
+	printf ("	-c FILE	capture uevents and sysfs traffic into FILE\n");
+	printf ("	-R FILE	replay a capture offline instead of talking to hardware\n");
+	printf ("	-r	replay at original speed instead of as fast as possible\n");
+	printf ("	-S	run on a simulated device instead of hardware\n");
 	printf ("	-h	display this help\n");
 	printf ("	-v	verbose info about what's cooking\n");
 	printf ("	-V	display program version\n");
@@ -326,6 +332,38 @@ static void display_stats ()
 			g_afrd_stats.current_hz >> 8, (100 * (g_afrd_stats.current_hz & 255)) >> 8);
 		printf ("Original display refresh rate: %u.%02uHz\n",
 			g_afrd_stats.original_hz >> 8, (100 * (g_afrd_stats.original_hz & 255)) >> 8);
+		printf ("Received uevents: %u\n", g_afrd_stats.uevents_received);
+		printf ("Uevents dropped by socket filter: %u\n", g_afrd_stats.uevents_filtered);
+		printf ("Uevents lost on socket overflow: up to %u (%u overflows)\n",
+			g_afrd_stats.uevents_dropped, g_afrd_stats.uevent_overflows);
+		printf ("Uevents per wakeup: 1:%u 2-3:%u 4-7:%u 8-15:%u 16-31:%u 32+:%u\n",
+			g_afrd_stats.uevent_batch [0], g_afrd_stats.uevent_batch [1],
+			g_afrd_stats.uevent_batch [2], g_afrd_stats.uevent_batch [3],
+			g_afrd_stats.uevent_batch [4], g_afrd_stats.uevent_batch [5]);
+		printf ("Longest main loop iteration: %u us (%u over 10 ms)\n",
+			g_afrd_stats.loop_stall_max, g_afrd_stats.loop_stalls);
+		printf ("Longest vdec attribute sampling: %u us\n",
+			g_afrd_stats.sample_time_max);
+		printf ("Active video decoders: %u (%u vdec channels)\n",
+			g_afrd_stats.vdec_decoders, g_afrd_stats.vdec_channels);
+		printf ("Playback monitor: %u samples in %u us, %u frame rate changes\n",
+			g_afrd_stats.monitor_samples, g_afrd_stats.monitor_time,
+			g_afrd_stats.monitor_switches);
+		printf ("Last judder score: %u (%u rates demoted)\n",
+			g_afrd_stats.judder_score, g_afrd_stats.judder_demotions);
+		printf ("Known display reconnects: %u\n", g_afrd_stats.display_cache_hits);
+		printf ("Last mode switch settled in: %u ms\n", g_afrd_stats.switch_settle_ms);
+		printf ("Display control writes: %u (%u skipped as redundant)\n",
+			g_afrd_stats.sysfs_writes, g_afrd_stats.sysfs_writes_skipped);
+		printf ("Display mode switches superseded: %u\n", g_afrd_stats.switches_superseded);
+		printf ("Display link came back after %u switches, did not after %u\n",
+			g_afrd_stats.switches_settled, g_afrd_stats.switches_failed);
+		printf ("Mode switch step durations, us (count/p50/p99):\n");
+		for (int phase = 0; phase < LAT_PHASES; phase++) {
+			printf ("\t%-10s %6u %9u %9u\n", latency_phase_name (phase),
+				latency_count (phase), latency_percentile (phase, 50),
+				latency_percentile (phase, 99));
+		}
 	}
 
 	shmem_fini ();
@@ -340,7 +378,10 @@ int main (int argc, char *const *argv)
 
 	g_program = argv [0];
 
-	while ((ret = getopt (argc, argv, "Dp:kl:shvV")) >= 0)
+	const char *capture_fn = NULL;
+	const char *replay_fn = NULL;
+
+	while ((ret = getopt (argc, argv, "Dp:kl:sc:R:rShvV")) >= 0)
 		switch (ret) {
 			case 'D':
 				g_daemon = 1;
@@ -362,6 +403,22 @@ int main (int argc, char *const *argv)
 				display_stats ();
 				return 0;
 
+			case 'c':
+				capture_fn = optarg;
+				break;
+
+			case 'R':
+				replay_fn = optarg;
+				break;
+
+			case 'r':
+				g_replay_realtime = true;
+				break;
+
+			case 'S':
+				g_sim = true;
+				break;
+
 			case 'v':
 				g_verbose++;
 				break;
@@ -375,6 +432,16 @@ int main (int argc, char *const *argv)
 				return EXIT_FAILURE;
 		}
 
+	if (replay_fn && (g_daemon || g_kill_daemon)) {
+		fprintf (stderr, "%s: replay can't be used with -D or -k\n", g_program);
+		return EXIT_FAILURE;
+	}
+
+	if (replay_fn && g_sim) {
+		fprintf (stderr, "%s: replay can't be used with -S\n", g_program);
+		return EXIT_FAILURE;
+	}
+
 	if (g_daemon)
 		// switch to root namespace
 		switch_namespace (1);
@@ -393,6 +460,11 @@ int main (int argc, char *const *argv)
 		if ((ret = load_config (argv [optind++])) == 0)
 			break;
 
+	if (replay_fn && !replay_load (replay_fn))
+		return EXIT_FAILURE;
+	if (capture_fn && !capture_open (capture_fn))
+		return EXIT_FAILURE;
+
 	signal (SIGHUP, SIG_IGN);
 	signal (SIGINT, signal_handler);
 	signal (SIGQUIT, signal_handler);
@@ -412,6 +484,9 @@ int main (int argc, char *const *argv)
 			break;
 	}
 
+	capture_close ();
+	replay_free ();
+
 	if (g_cfg)
 		cfg_free (g_cfg);
 
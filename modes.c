@@ -8,21 +8,43 @@
  */
 
 #include "afrd.h"
+#include "actuator.h"
+#include "watch.h"
 #include "colorspace.h"
+#include "uevent_filter.h"
+#include "edid.h"
 #include <unistd.h>
 
 display_mode_t *g_modes = NULL;
 int g_modes_n = 0;
 display_mode_t g_current_mode;
 bool g_blackened = false;
+uint32_t g_display_id = 0;
+uint32_t g_display_edid = 0;
 
-static bool mode_parse (char *desc, display_mode_t *mode)
+// the display mode attributes
+static sysfs_attr_t g_attr_mode;
+static sysfs_attr_t g_attr_frac_rate;
+static sysfs_attr_t g_attr_disp_cap;
+static sysfs_attr_t g_attr_rawedid;
+
+// where a display mode in the list came from
+typedef enum
+{
+	MODE_SRC_DISP_CAP,
+	MODE_SRC_CURRENT,
+	MODE_SRC_EDID,
+	MODE_SRC_EXTRA,
+} mode_src_t;
+
+static bool mode_parse (const char *src, display_mode_t *mode)
 {
 	memset (mode, 0, sizeof (display_mode_t));
-	if (!desc)
+	if (!src)
 		return false;
 
-	strncpy (mode->name, desc, sizeof (mode->name));
+	strncpy (mode->name, src, sizeof (mode->name) - 1);
+	char *desc = mode->name;
 
 	if (strncmp (desc, "smpte", 5) == 0) {
 		mode->width = 4096;
@@ -61,6 +83,8 @@ static bool mode_parse (char *desc, display_mode_t *mode)
 	}
 
 	mode->framerate = parse_int (&desc);
+	// unless EDID tells otherwise
+	mode->fract_ok = (display_mode_frac_hz (mode->framerate) != 0);
 
 	// here follows 'hz' optionally followed by color space like '420'.
 	// we ignore them.
@@ -68,81 +92,223 @@ static bool mode_parse (char *desc, display_mode_t *mode)
 	return true;
 }
 
-void display_mode_add (display_mode_t *mode)
+// the list being built by display_modes_init ()
+static struct
 {
-	/* keep only non-fractional modes in list */
-	display_mode_t new_mode = *mode;
-	new_mode.fractional = false;
+	int size;
+	mode_src_t *src;
+} g_modes_build;
 
-	/* check if mode is already in list */
-	for (int i = 0; i < g_modes_n; i++)
-		if (display_mode_equal (&new_mode, &g_modes [i]))
-			return;
+static void display_mode_add (const display_mode_t *mode, mode_src_t src)
+{
+	if (g_modes_n >= g_modes_build.size)
+		return;
 
+	// keep only non-fractional modes in list
+	g_modes [g_modes_n] = *mode;
+	g_modes [g_modes_n].fractional = false;
+	g_modes_build.src [g_modes_n] = src;
 	g_modes_n++;
-	g_modes = (display_mode_t *)realloc (g_modes, sizeof (display_mode_t) * g_modes_n);
-	g_modes [g_modes_n - 1] = new_mode;
+}
+
+static int display_mode_cmp (const void *p1, const void *p2)
+{
+	int i1 = *(const int *)p1, i2 = *(const int *)p2;
+	const display_mode_t *m1 = &g_modes [i1], *m2 = &g_modes [i2];
+
+	if (m1->width != m2->width)
+		return m1->width - m2->width;
+	if (m1->height != m2->height)
+		return m1->height - m2->height;
+	if (m1->interlaced != m2->interlaced)
+		return m1->interlaced - m2->interlaced;
+	if (m1->framerate != m2->framerate)
+		return m1->framerate - m2->framerate;
+	// same mode from different sources, the first added wins
+	return i1 - i2;
+}
+
+// drop duplicate modes, keeping the first one added and the order of the rest
+static void display_modes_unique ()
+{
+	int *order = (int *)malloc (g_modes_n * sizeof (int));
+	bool *dup = (bool *)calloc (g_modes_n, sizeof (bool));
+	for (int i = 0; i < g_modes_n; i++)
+		order [i] = i;
+
+	qsort (order, g_modes_n, sizeof (int), display_mode_cmp);
+
+	for (int i = 1; i < g_modes_n; i++) {
+		int idx = order [i];
+		display_mode_t *first = &g_modes [order [i - 1]];
+		if (!display_mode_equal (first, &g_modes [idx]))
+			continue;
+
+		// EDID knows best if display accepts fractional rates
+		if (g_modes_build.src [idx] == MODE_SRC_EDID)
+			first->fract_ok = g_modes [idx].fract_ok;
+
+		// compare next duplicates with the one we keep
+		dup [idx] = true;
+		order [i] = order [i - 1];
+	}
+
+	int n = 0;
+	for (int i = 0; i < g_modes_n; i++)
+		if (!dup [i]) {
+			g_modes [n] = g_modes [i];
+			g_modes_build.src [n] = g_modes_build.src [i];
+			n++;
+		}
+	g_modes_n = n;
+
+	free (dup);
+	free (order);
+}
+
+// read and check raw EDID, return number of good blocks
+static int display_edid_read (uint8_t *edid, bool verbose)
+{
+	char hex [EDID_MAX_BLOCKS * EDID_BLOCK * 2 + 64];
+	int n = sysfs_attr_read (&g_attr_rawedid, hex, sizeof (hex));
+	if (n <= 0)
+		return 0;
+
+	int size = edid_from_hex (hex, n, edid, EDID_MAX_BLOCKS * EDID_BLOCK);
+	int blocks = edid_blocks (edid, size);
+	if (!blocks && verbose)
+		trace (1, "EDID is invalid or missing\n");
+	return blocks;
+}
+
+uint32_t display_edid_id ()
+{
+	uint8_t edid [EDID_MAX_BLOCKS * EDID_BLOCK];
+	int blocks = display_edid_read (edid, false);
+	return blocks ? uevent_hash ((const char *)edid, blocks * EDID_BLOCK) : 0;
+}
+
+// read display modes from EDID, return number of modes
+static int display_modes_edid (edid_mode_t *modes, int max)
+{
+	uint8_t edid [EDID_MAX_BLOCKS * EDID_BLOCK];
+	int blocks = display_edid_read (edid, true);
+	if (!blocks)
+		return 0;
 
-	trace (2, "\t+ "DISPMODE_FMT"\n", DISPMODE_ARGS (new_mode, display_mode_hz (&new_mode)));
+	// identify the display by its EDID
+	g_display_edid = uevent_hash ((const char *)edid, blocks * EDID_BLOCK);
+	g_display_id = g_display_edid;
+
+	return edid_modes (edid, blocks, modes, max);
 }
 
 int display_modes_init ()
 {
 	display_modes_fini ();
 
-	char *modes = sysfs_get_str (g_hdmi_dev, "disp_cap");
-	if (!modes)
+	char modes [4096];
+	int n = sysfs_attr_read (&g_attr_disp_cap, modes, sizeof (modes));
+	if (n < 0) {
+		trace (1, "failed to read sysfs attr from %s\n", g_attr_disp_cap.path);
 		return -1;
+	}
+
+	strspan_t list = strspan (modes, n);
+	strspan_trim (&list);
+
+	edid_mode_t edid [EDID_MAX_MODES];
+	int edid_n = display_modes_edid (edid, EDID_MAX_MODES);
+
+	// displays without EDID are identified by the set of modes they support
+	if (!g_display_id)
+		g_display_id = uevent_hash (list.str, list.len);
+
+	strlist_t xmodes;
+	strlist_load (&xmodes, "mode.extra", "extra video modes");
+
+	// a mode name takes at least two chars with separator
+	g_modes_build.size = (list.len + 1) / 2 + 1 + edid_n + xmodes.size;
+	g_modes = (display_mode_t *)malloc (g_modes_build.size * sizeof (display_mode_t));
+	g_modes_build.src = (mode_src_t *)malloc (g_modes_build.size * sizeof (mode_src_t));
 
 	trace (2, "Parsing supported video modes\n");
 
 	// parse the list of video modes supported by display
-	char *cur = modes;
-	while (cur && *cur) {
-		cur += strspn (cur, spaces);
-		int mode_len = strcspn (cur, spaces);
-		if (!mode_len)
-			break;
-
-		if (cur [mode_len - 1] == '*')
-			mode_len--;
-		cur [mode_len] = 0;
+	strspan_t word;
+	while (strspan_word (&list, &word)) {
+		// the current mode is marked with an asterisk
+		if (word.str [word.len - 1] == '*')
+			word.len--;
 
 		display_mode_t mode;
-		if (mode_parse (cur, &mode))
-			display_mode_add (&mode);
+		if (mode_parse (strspan_cstr (&word), &mode))
+			display_mode_add (&mode, MODE_SRC_DISP_CAP);
 		else
-			trace (2, "\t%s: unrecognized mode\n", cur);
-
-		cur += mode_len + 1;
+			trace (2, "\t%s: unrecognized mode\n", word.str);
 	}
 
-	free (modes);
-
 	display_mode_get_current ();
 
 	// on some weird configs current video mode may not be listed in disp_cap
 	if (g_current_mode.name [0])
-		display_mode_add (&g_current_mode);
+		display_mode_add (&g_current_mode, MODE_SRC_CURRENT);
+
+	// the modes that display supports but disp_cap didn't list; the SoC
+	// may be unable to output other mode sizes, so add only the rates
+	int driver_n = g_modes_n;
+	for (int i = 0; i < edid_n; i++) {
+		display_mode_t mode;
+		if (!mode_parse (edid [i].name, &mode))
+			continue;
+
+		mode.fract_ok = edid [i].fract_ok;
+		for (int j = 0; j < driver_n; j++)
+			if ((g_modes [j].width == mode.width) &&
+			    (g_modes [j].height == mode.height) &&
+			    (g_modes [j].interlaced == mode.interlaced)) {
+				display_mode_add (&mode, MODE_SRC_EDID);
+				break;
+			}
+	}
 
 	// add extra user-specified modes from config
-	strlist_t xmodes;
-	if (strlist_load (&xmodes, "mode.extra", "extra video modes")) {
-		for (int i = 0; i < xmodes.size; i++) {
-			display_mode_t mode;
-			if (mode_parse (xmodes.data [i], &mode))
-				display_mode_add (&mode);
-		}
-		strlist_free (&xmodes);
+	for (int i = 0; i < xmodes.size; i++) {
+		display_mode_t mode;
+		if (mode_parse (xmodes.data [i], &mode))
+			display_mode_add (&mode, MODE_SRC_EXTRA);
 	}
+	strlist_free (&xmodes);
+
+	display_modes_unique ();
 
+	for (int i = 0; i < g_modes_n; i++)
+		trace (2, "\t+ "DISPMODE_FMT"%s%s\n",
+			DISPMODE_ARGS (g_modes [i], display_mode_hz (&g_modes [i])),
+			g_modes [i].fract_ok ? ", fractional" : "",
+			(g_modes_build.src [i] == MODE_SRC_EDID) ? ", from EDID" : "");
+
+	free (g_modes_build.src);
+	g_modes_build.src = NULL;
 	return 0;
 }
 
 void display_mode_get_current ()
 {
+	// don't block on the writes in progress, the display is going
+	// to have the mode last handed to actuator, which we already know
+	if (actuator_busy ()) {
+		if (g_blackened)
+			trace (2, "\tdisplay is being blanked\n");
+		else
+			trace (2, "\tdisplay is being switched to "DISPMODE_FMT"\n",
+				DISPMODE_ARGS (g_current_mode, display_mode_hz (&g_current_mode)));
+		return;
+	}
+
 	// parse the current video mode
-	char *mode = sysfs_get_str (g_mode_path, NULL);
+	char buff [64];
+	char *mode = sysfs_attr_get_str (&g_attr_mode, buff, sizeof (buff));
 	if (!mode || !strcmp (mode, "null")) {
 		trace (1, "Current video mode is null!\n");
 		return;
@@ -150,19 +316,49 @@ void display_mode_get_current ()
 
 	if (!mode_parse (mode, &g_current_mode)) {
 		trace (1, "Failed to recognize current video mode '%s'\n", mode);
-		free (mode);
 		return;
 	}
 
 	g_current_mode.fractional = false;
-	char *frac_rate = sysfs_get_str (g_hdmi_dev, "frac_rate_policy");
-	if (!frac_rate)
+	int frac_rate = sysfs_attr_get_int (&g_attr_frac_rate);
+	if (frac_rate < 0)
 		trace (1, "failed to read frac_rate_policy!\n");
 	else
-	{
-		g_current_mode.fractional = strtol (frac_rate, NULL, 10) != 0;
-		free (frac_rate);
-	}
+		g_current_mode.fractional = (frac_rate != 0);
+}
+
+// someone else has changed display mode
+static void display_attr_changed (sysfs_attr_t *sa, const char *value, bool changed)
+{
+	if (!changed)
+		return;
+
+	trace (1, "%s was changed to [%s] outside of afrd\n", sa->path, value);
+	// what we know about display attributes is not true anymore
+	sysfs_forget ();
+	display_mode_get_current ();
+}
+
+// called before actuator thread starts
+void display_attr_init ()
+{
+	sysfs_attr_init (&g_attr_mode, g_mode_path, NULL);
+	sysfs_attr_init (&g_attr_frac_rate, g_hdmi_dev, "frac_rate_policy");
+	sysfs_attr_init (&g_attr_disp_cap, g_hdmi_dev, "disp_cap");
+	sysfs_attr_init (&g_attr_rawedid, g_hdmi_dev, "rawedid");
+	watch_add (&g_attr_mode, 0, display_attr_changed);
+	watch_add (&g_attr_frac_rate, 0, display_attr_changed);
+}
+
+void display_attr_fini ()
+{
+	actuator_wait ();
+	watch_remove (&g_attr_mode);
+	watch_remove (&g_attr_frac_rate);
+	sysfs_attr_fini (&g_attr_mode);
+	sysfs_attr_fini (&g_attr_frac_rate);
+	sysfs_attr_fini (&g_attr_disp_cap);
+	sysfs_attr_fini (&g_attr_rawedid);
 }
 
 void display_modes_fini ()
@@ -171,6 +367,20 @@ void display_modes_fini ()
 
 	g_modes = NULL;
 	g_modes_n = 0;
+	g_display_id = 0;
+	g_display_edid = 0;
+}
+
+void display_modes_set (const display_mode_t *modes, int count, uint32_t edid_id)
+{
+	display_modes_fini ();
+
+	g_modes = (display_mode_t *)malloc (count * sizeof (display_mode_t));
+	memcpy (g_modes, modes, count * sizeof (display_mode_t));
+	g_modes_n = count;
+	g_display_id = g_display_edid = edid_id;
+
+	display_mode_get_current ();
 }
 
 bool display_mode_equal (display_mode_t *mode1, display_mode_t *mode2)
@@ -185,31 +395,35 @@ bool display_mode_equal (display_mode_t *mode1, display_mode_t *mode2)
 	return (hz1 == hz2);
 }
 
-int display_mode_hz (display_mode_t *mode)
+int display_mode_frac_hz (int framerate)
 {
-	if (mode->fractional)
-		switch (mode->framerate) {
-			case  24: return ( 2997 * 256 + 62) / 125;
-			case  30: return ( 2997 * 256 + 50) / 100;
-			case  60: return ( 5994 * 256 + 50) / 100;
-			case 120: return (11988 * 256 + 50) / 100;
-			case 240: return (23976 * 256 + 50) / 100;
-		}
+	switch (framerate) {
+		case  24: return ( 2997 * 256 + 62) / 125;
+		case  30: return ( 2997 * 256 + 50) / 100;
+		case  60: return ( 5994 * 256 + 50) / 100;
+		case 120: return (11988 * 256 + 50) / 100;
+		case 240: return (23976 * 256 + 50) / 100;
+	}
+
+	return 0;
+}
 
-	return mode->framerate * 256;
+int display_mode_hz (const display_mode_t *mode)
+{
+	int hz_frac = mode->fractional ? display_mode_frac_hz (mode->framerate) : 0;
+	return hz_frac ? hz_frac : mode->framerate * 256;
 }
 
 void display_mode_set_hz (display_mode_t *mode, int hz)
 {
-	mode->fractional = true;
-	int hz_frac = display_mode_hz (mode);
+	mode->fractional = false;
+	int hz_frac = display_mode_frac_hz (mode->framerate);
 	int hz_int = mode->framerate * 256;
 
-	if (hz_frac == hz_int) {
-		// this mode has no fractional variant
-		mode->fractional = false;
+	// this mode has no fractional variant, or display doesn't accept it
+	if (!hz_frac || !mode->fract_ok)
 		return;
-	}
+	mode->fractional = true;
 
 	// find multiple of hz closest to hz_int
 	int hz_n = 1;
@@ -229,34 +443,45 @@ void display_mode_set_hz (display_mode_t *mode, int hz)
 		mode->fractional = false;
 }
 
-void display_mode_switch (display_mode_t *mode, bool force)
+switch_type_t display_mode_transition (display_mode_t *mode, bool force)
+{
+	if (g_blackened || force ||
+	    (mode->width != g_current_mode.width) ||
+	    (mode->height != g_current_mode.height) ||
+	    (mode->interlaced != g_current_mode.interlaced))
+		return SWITCH_FULL;
+
+	// same mode name means only fractional flag changes
+	if (strcmp (mode->name, g_current_mode.name) == 0)
+		return SWITCH_FRAC;
+
+	return SWITCH_RATE;
+}
+
+bool display_mode_switch (display_mode_t *mode, bool force)
 {
 	if (!g_blackened && !force &&
 	    display_mode_equal (mode, &g_current_mode)) {
 		trace (1, "Display mode is already "DISPMODE_FMT"\n",
 			DISPMODE_ARGS (*mode, display_mode_hz (mode)));
-		return;
+		return false;
 	}
 
-	char frac [2] = { mode->fractional ? '1' : '0', 0 };
-	sysfs_set_str (g_hdmi_dev, "frac_rate_policy", frac);
-
-	colorspace_apply (mode->name);
-
+	display_plan_t plan;
+	memset (&plan, 0, sizeof (plan));
+	plan.mode = *mode;
 	// fractional mode transition via special null mode
-	if (force ||
-	    ((strcmp (mode->name, g_current_mode.name) == 0) &&
-	     (mode->fractional != g_current_mode.fractional)))
-		display_mode_null ();
+	plan.null = !g_blackened && (force ||
+		((strcmp (mode->name, g_current_mode.name) == 0) &&
+		 (mode->fractional != g_current_mode.fractional)));
 
-	trace (1, "Switching display mode to "DISPMODE_FMT"\n",
-		DISPMODE_ARGS (*mode, display_mode_hz (mode)));
-
-	sysfs_write (g_mode_path, mode->name);
 	g_current_mode = *mode;
 	g_blackened = false;
+	colorspace_plan (mode->name, plan.cs, sizeof (plan.cs));
+	plan.hdcp = hdcp_plan ();
 
-	hdcp_restore (false);
+	actuator_submit (&plan);
+	return true;
 }
 
 void display_mode_null ()
@@ -264,7 +489,68 @@ void display_mode_null ()
 	if (g_blackened)
 		return;
 
-	trace (2, "Blackout screen\n");
-	sysfs_write (g_mode_path, "null");
+	display_plan_t plan;
+	memset (&plan, 0, sizeof (plan));
 	g_blackened = true;
+
+	actuator_submit (&plan);
+}
+
+bool display_plan_run (const display_plan_t *plan, latency_steps_t *steps)
+{
+	const display_mode_t *mode = &plan->mode;
+	uint64_t start = latency_now ();
+
+	if (plan->hdcp_only) {
+		hdcp_apply (plan->hdcp, plan->hdcp_restart);
+		latency_step (steps, LAT_HDCP, start);
+		return false;
+	}
+
+	if (!mode->name [0]) {
+		trace (2, "Blackout screen\n");
+		sysfs_attr_set (&g_attr_mode, "null");
+		latency_step (steps, LAT_NULL, start);
+		return false;
+	}
+
+	char frac [2] = { mode->fractional ? '1' : '0', 0 };
+
+	// a plan that was superseded while queued could have been planned
+	// from another mode, so check what the display is known to have now
+	char known_mode [sizeof (g_attr_mode.value)], known_frac [sizeof (g_attr_frac_rate.value)];
+	const char *cur_mode = sysfs_attr_known (&g_attr_mode, known_mode, sizeof (known_mode));
+	const char *cur_frac = sysfs_attr_known (&g_attr_frac_rate, known_frac, sizeof (known_frac));
+	bool null = plan->null ||
+		(cur_mode && cur_frac && (strcmp (cur_mode, mode->name) == 0) &&
+		 (strcmp (cur_frac, frac) != 0));
+
+	sysfs_attr_set (&g_attr_frac_rate, frac);
+	latency_step (steps, LAT_FRAC, start);
+
+	start = latency_now ();
+	colorspace_apply (plan->cs);
+	latency_step (steps, LAT_COLORSPACE, start);
+
+	if (null) {
+		trace (2, "Blackout screen\n");
+		start = latency_now ();
+		sysfs_attr_set (&g_attr_mode, "null");
+		latency_step (steps, LAT_NULL, start);
+	}
+
+	trace (1, "Switching display mode to "DISPMODE_FMT"\n",
+		DISPMODE_ARGS (*mode, display_mode_hz (mode)));
+
+	start = latency_now ();
+	sysfs_attr_set (&g_attr_mode, mode->name);
+	latency_step (steps, LAT_MODE, start);
+
+	if (plan->hdcp) {
+		start = latency_now ();
+		hdcp_apply (plan->hdcp, plan->hdcp_restart);
+		latency_step (steps, LAT_HDCP, start);
+	}
+
+	return true;
 }
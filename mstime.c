@@ -12,9 +12,13 @@
 #include <sys/time.h>
 
 mstime_t g_mstime;
+mstime_t g_mstime_virtual;
 
 mstime_t mstime_get ()
 {
+	if (g_mstime_virtual)
+		return g_mstime_virtual;
+
 	struct timeval tv;
 	gettimeofday (&tv, NULL);
 	return tv.tv_sec * 1000 + (tv.tv_usec / 1000);
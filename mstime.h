@@ -25,6 +25,9 @@ typedef uint32_t mstime_t;
 /// The global current time variable; call mstime_update() to refresh.
 extern mstime_t g_mstime;
 
+/// If not zero, mstime_get() returns this instead of real time (for replay).
+extern mstime_t g_mstime_virtual;
+
 /**
  * Get the current millisecond time.
  * This value has no real sense, it's only mea is to count time intervals.
@@ -0,0 +1,420 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Persistent cache of frame rates detected for recently played content.
+ * The cache is a small memory-mapped file next to afrd.ipc, so it
+ * survives daemon restarts and config reloads.
+ */
+
+#include "afrd.h"
+#include "prior.h"
+#include "capture.h"
+#include "uevent_filter.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define PRIOR_MAGIC		0x52504641	// "AFPR"
+
+typedef struct
+{
+	/// PRIOR_MAGIC
+	uint32_t magic;
+	/// sizeof (prior_entry_t), to detect format changes
+	uint16_t entry_size;
+	/// number of entries
+	uint16_t entries;
+	/// sizeof (prior_decoder_t)
+	uint16_t decoder_size;
+	/// number of decoders
+	uint16_t decoders;
+	/// sizeof (prior_pair_t)
+	uint16_t pair_size;
+	/// number of pairs
+	uint16_t pairs;
+	/// sizeof (prior_display_t)
+	uint16_t display_size;
+	/// number of displays
+	uint16_t displays;
+	/// sizeof (prior_cost_t)
+	uint16_t cost_size;
+	/// number of mode switch cost entries
+	uint16_t costs;
+	/// LRU clock, incremented on every use
+	uint32_t clock;
+	prior_entry_t entry [PRIOR_ENTRIES];
+	prior_decoder_t decoder [PRIOR_DECODERS];
+	prior_pair_t pair [PRIOR_PAIRS];
+	prior_display_t display [PRIOR_DISPLAYS];
+	prior_cost_t cost [PRIOR_COSTS];
+} prior_file_t;
+
+// a pair is demoted when at least that many playbacks were bad...
+#define PAIR_DEMOTE_BAD		2
+// ...and they make at least half of all playbacks
+#define PAIR_DEMOTE_SHARE	2
+// halve pair counters when they reach this, to forget old history
+#define PAIR_MAX_EVALS		64
+// weight of a new mode switch duration in the average, 1/N
+#define COST_WEIGHT		4
+
+// find a free table entry or the least recently used one
+#define PRIOR_VICTIM(victim, table, n) \
+	do { \
+		victim = NULL; \
+		for (int i_ = 0; i_ < (n); i_++) { \
+			if (!(table) [i_].used) { \
+				victim = &(table) [i_]; \
+				break; \
+			} \
+			if (!victim || ((int32_t)((table) [i_].used - victim->used) < 0)) \
+				victim = &(table) [i_]; \
+		} \
+	} while (0)
+
+static prior_file_t *g_prior;
+
+bool prior_init ()
+{
+	prior_fini ();
+
+	// replay must not depend on what was played before
+	if (g_replay) {
+		g_prior = (prior_file_t *)mmap (NULL, sizeof (prior_file_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		char path [200];
+		shmem_file_path (path, sizeof (path), "afrd.prior");
+
+		int h = open (path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+		if (h < 0) {
+			trace (1, "failed to open prior cache %s\n", path);
+			return false;
+		}
+
+		if (ftruncate (h, sizeof (prior_file_t)) == 0)
+			g_prior = (prior_file_t *)mmap (NULL, sizeof (prior_file_t),
+				PROT_READ | PROT_WRITE, MAP_SHARED, h, 0);
+		close (h);
+	}
+
+	if (g_prior == MAP_FAILED)
+		g_prior = NULL;
+	if (!g_prior) {
+		trace (1, "failed to map prior cache\n");
+		return false;
+	}
+
+	if ((g_prior->magic != PRIOR_MAGIC) ||
+	    (g_prior->entry_size != sizeof (prior_entry_t)) ||
+	    (g_prior->entries != PRIOR_ENTRIES) ||
+	    (g_prior->decoder_size != sizeof (prior_decoder_t)) ||
+	    (g_prior->decoders != PRIOR_DECODERS) ||
+	    (g_prior->pair_size != sizeof (prior_pair_t)) ||
+	    (g_prior->pairs != PRIOR_PAIRS) ||
+	    (g_prior->display_size != sizeof (prior_display_t)) ||
+	    (g_prior->displays != PRIOR_DISPLAYS) ||
+	    (g_prior->cost_size != sizeof (prior_cost_t)) ||
+	    (g_prior->costs != PRIOR_COSTS)) {
+		memset (g_prior, 0, sizeof (prior_file_t));
+		g_prior->magic = PRIOR_MAGIC;
+		g_prior->entry_size = sizeof (prior_entry_t);
+		g_prior->entries = PRIOR_ENTRIES;
+		g_prior->decoder_size = sizeof (prior_decoder_t);
+		g_prior->decoders = PRIOR_DECODERS;
+		g_prior->pair_size = sizeof (prior_pair_t);
+		g_prior->pairs = PRIOR_PAIRS;
+		g_prior->display_size = sizeof (prior_display_t);
+		g_prior->displays = PRIOR_DISPLAYS;
+		g_prior->cost_size = sizeof (prior_cost_t);
+		g_prior->costs = PRIOR_COSTS;
+	}
+
+	return true;
+}
+
+void prior_fini ()
+{
+	if (g_prior) {
+		munmap (g_prior, sizeof (prior_file_t));
+		g_prior = NULL;
+	}
+}
+
+static bool prior_key_equal (const prior_key_t *key1, const prior_key_t *key2)
+{
+	return (key1->width == key2->width) &&
+		(key1->height == key2->height) &&
+		(key1->content_id == key2->content_id) &&
+		(strncmp (key1->modalias, key2->modalias, sizeof (key1->modalias)) == 0);
+}
+
+static prior_entry_t *prior_find (const prior_key_t *key)
+{
+	for (int i = 0; i < PRIOR_ENTRIES; i++) {
+		prior_entry_t *pe = &g_prior->entry [i];
+		if (pe->used && prior_key_equal (&pe->key, key))
+			return pe;
+	}
+
+	return NULL;
+}
+
+static uint32_t prior_clock ()
+{
+	if (!++g_prior->clock)
+		g_prior->clock++;
+	return g_prior->clock;
+}
+
+static void prior_touch (prior_entry_t *pe)
+{
+	pe->used = prior_clock ();
+}
+
+const prior_entry_t *prior_lookup (const prior_key_t *key)
+{
+	if (!g_prior)
+		return NULL;
+
+	prior_entry_t *pe = prior_find (key);
+	if (!pe && key->content_id) {
+		// no luck with exact content, try any content with same parameters
+		prior_key_t any = *key;
+		any.content_id = 0;
+		pe = prior_find (&any);
+	}
+
+	if (pe)
+		prior_touch (pe);
+	return pe;
+}
+
+static void prior_store_key (const prior_key_t *key, int hz, int src)
+{
+	prior_entry_t *pe = prior_find (key);
+	if (!pe) {
+		PRIOR_VICTIM (pe, g_prior->entry, PRIOR_ENTRIES);
+		memset (pe, 0, sizeof (*pe));
+		pe->key = *key;
+	}
+
+	if (abs ((int)pe->hz - hz) > 1)
+		pe->hits = 0;
+	else if (pe->hits < 255)
+		pe->hits++;
+	pe->hz = hz;
+	pe->src = src;
+	prior_touch (pe);
+}
+
+void prior_store (const prior_key_t *key, int hz, int src)
+{
+	if (!g_prior)
+		return;
+
+	trace (2, "Remembering "HZ_FMT"fps from src %d for %s %ux%u content %08x\n",
+		HZ_ARGS (hz), src, key->modalias, key->width, key->height, key->content_id);
+
+	prior_store_key (key, hz, src);
+
+	// also remember it for any content with same parameters
+	if (key->content_id) {
+		prior_key_t any = *key;
+		any.content_id = 0;
+		prior_store_key (&any, hz, src);
+	}
+}
+
+fusion_rel_t *prior_reliability (const char *modalias)
+{
+	if (!g_prior || !modalias [0])
+		return NULL;
+
+	prior_decoder_t *pd = NULL;
+	for (int i = 0; i < PRIOR_DECODERS; i++) {
+		prior_decoder_t *d = &g_prior->decoder [i];
+		if (d->used && (strncmp (d->modalias, modalias, sizeof (d->modalias)) == 0)) {
+			pd = d;
+			break;
+		}
+	}
+
+	if (!pd) {
+		PRIOR_VICTIM (pd, g_prior->decoder, PRIOR_DECODERS);
+		memset (pd, 0, sizeof (*pd));
+		strncpy (pd->modalias, modalias, sizeof (pd->modalias) - 1);
+	}
+
+	pd->used = prior_clock ();
+	return &pd->rel;
+}
+
+static prior_pair_t *prior_pair_find (uint32_t display, int mode_hz, int movie_hz)
+{
+	for (int i = 0; i < PRIOR_PAIRS; i++) {
+		prior_pair_t *pp = &g_prior->pair [i];
+		if (pp->used && (pp->display == display) &&
+		    (abs ((int)pp->mode_hz - mode_hz) <= 1) &&
+		    (abs ((int)pp->movie_hz - movie_hz) <= 1))
+			return pp;
+	}
+
+	return NULL;
+}
+
+static bool pair_demoted (const prior_pair_t *pp)
+{
+	return (pp->bad >= PAIR_DEMOTE_BAD) &&
+		(pp->bad * PAIR_DEMOTE_SHARE >= pp->evals);
+}
+
+bool prior_pair_eval (uint32_t display, int mode_hz, int movie_hz, bool bad)
+{
+	if (!g_prior)
+		return false;
+
+	prior_pair_t *pp = prior_pair_find (display, mode_hz, movie_hz);
+	if (!pp) {
+		PRIOR_VICTIM (pp, g_prior->pair, PRIOR_PAIRS);
+		memset (pp, 0, sizeof (*pp));
+		pp->display = display;
+		pp->mode_hz = mode_hz;
+		pp->movie_hz = movie_hz;
+	}
+
+	pp->evals++;
+	if (bad)
+		pp->bad++;
+	if (pp->evals >= PAIR_MAX_EVALS) {
+		pp->evals /= 2;
+		pp->bad /= 2;
+	}
+
+	pp->used = prior_clock ();
+	return pair_demoted (pp);
+}
+
+bool prior_pair_demoted (uint32_t display, int mode_hz, int movie_hz)
+{
+	if (!g_prior)
+		return false;
+
+	prior_pair_t *pp = prior_pair_find (display, mode_hz, movie_hz);
+	return pp && pair_demoted (pp);
+}
+
+static prior_display_t *prior_display_find (uint32_t edid)
+{
+	for (int i = 0; i < PRIOR_DISPLAYS; i++) {
+		prior_display_t *pd = &g_prior->display [i];
+		if (pd->used && (pd->edid == edid))
+			return pd;
+	}
+
+	return NULL;
+}
+
+const prior_display_t *prior_display_lookup (uint32_t edid)
+{
+	if (!g_prior || !edid)
+		return NULL;
+
+	prior_display_t *pd = prior_display_find (edid);
+	if (pd)
+		pd->used = prior_clock ();
+	return pd;
+}
+
+bool prior_display_store (uint32_t edid, const display_mode_t *modes, int count,
+	const colorspace_cap_t *cs, int cs_count, int hdcp)
+{
+	if (!g_prior || !edid)
+		return false;
+
+	// don't remember a partial list
+	if ((count > PRIOR_DISPLAY_MODES) || (cs_count > PRIOR_DISPLAY_CS)) {
+		trace (2, "Display %08x has too many modes to remember\n", edid);
+		return false;
+	}
+
+	prior_display_t tmp;
+	memset (&tmp, 0, sizeof (tmp));
+	tmp.edid = edid;
+	tmp.modes = count;
+	tmp.colorspaces = cs_count;
+	tmp.hdcp = hdcp;
+	memcpy (tmp.mode, modes, count * sizeof (display_mode_t));
+	memcpy (tmp.cs, cs, cs_count * sizeof (colorspace_cap_t));
+
+	prior_display_t *pd = prior_display_find (edid);
+	if (!pd)
+		PRIOR_VICTIM (pd, g_prior->display, PRIOR_DISPLAYS);
+	else
+		tmp.used = pd->used;
+
+	bool changed = (memcmp (pd, &tmp, sizeof (tmp)) != 0);
+	*pd = tmp;
+	pd->used = prior_clock ();
+	return changed;
+}
+
+static prior_cost_t *prior_cost_find (uint32_t display)
+{
+	for (int i = 0; i < PRIOR_COSTS; i++) {
+		prior_cost_t *pc = &g_prior->cost [i];
+		if (pc->used && (pc->display == display))
+			return pc;
+	}
+
+	return NULL;
+}
+
+void prior_cost_eval (uint32_t display, switch_type_t type, int ms)
+{
+	if (!g_prior || !display)
+		return;
+
+	prior_cost_t *pc = prior_cost_find (display);
+	if (!pc) {
+		PRIOR_VICTIM (pc, g_prior->cost, PRIOR_COSTS);
+		memset (pc, 0, sizeof (*pc));
+		pc->display = display;
+	}
+
+	if (ms > UINT16_MAX)
+		ms = UINT16_MAX;
+
+	// first measurement sets the average, then it moves slowly
+	if (!pc->samples [type])
+		pc->ms [type] = ms;
+	else
+		pc->ms [type] = (pc->ms [type] * (COST_WEIGHT - 1) + ms + COST_WEIGHT / 2) / COST_WEIGHT;
+	if (pc->samples [type] < 255)
+		pc->samples [type]++;
+
+	pc->used = prior_clock ();
+}
+
+int prior_cost (uint32_t display, switch_type_t type)
+{
+	if (!g_prior || !display)
+		return -1;
+
+	prior_cost_t *pc = prior_cost_find (display);
+	if (!pc || !pc->samples [type])
+		return -1;
+
+	return pc->ms [type];
+}
+
+uint32_t prior_content_id (const char *id)
+{
+	// 0 means "no content id"
+	uint32_t hash = uevent_hash (id, strlen (id));
+	return hash ? hash : 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Persistent cache of frame rates detected for recently played content
+ * and of fps source reliability learned for every video decoder,
+ * and playback quality of movie frame rates on display refresh rates,
+ * and capabilities of recently connected displays,
+ * and how long their mode switches take
+ */
+
+#ifndef __PRIOR_H__
+#define __PRIOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "afrd.h"
+#include "fusion.h"
+#include "colorspace.h"
+
+/// Maximal number of entries in cache, least recently used are evicted
+#define PRIOR_ENTRIES		64
+/// Maximal number of video decoders we learn fps source reliability for
+#define PRIOR_DECODERS		16
+/// Maximal number of (display, refresh rate, movie rate) combinations we rate
+#define PRIOR_PAIRS		64
+/// Maximal number of displays we remember capabilities of
+#define PRIOR_DISPLAYS		8
+/// Maximal number of display modes and color spaces remembered for a display
+#define PRIOR_DISPLAY_MODES	48
+#define PRIOR_DISPLAY_CS	32
+/// Maximal number of displays we remember mode switch durations for
+#define PRIOR_COSTS		8
+
+/// the key of a prior cache entry
+typedef struct
+{
+	/// video decoder driver name
+	char modalias [32];
+	/// decoded frame size
+	uint16_t width, height;
+	/// hash of content id passed through API, 0 if none
+	uint32_t content_id;
+} prior_key_t;
+
+/// the frame rate we've detected last time for the content
+typedef struct
+{
+	prior_key_t key;
+	/// detected frame rate, 24.8 fixed-point
+	uint32_t hz;
+	/// the fps source that confirmed it (hz_source_t)
+	uint8_t src;
+	/// number of times this entry was confirmed
+	uint8_t hits;
+	uint16_t reserved;
+	/// LRU clock value when entry was used last time, 0 if entry is free
+	uint32_t used;
+} prior_entry_t;
+
+/// learned fps source reliability for a video decoder
+typedef struct
+{
+	/// video decoder driver name
+	char modalias [32];
+	fusion_rel_t rel;
+	/// LRU clock value when entry was used last time, 0 if entry is free
+	uint32_t used;
+} prior_decoder_t;
+
+/// playback quality of a movie frame rate on a display refresh rate
+typedef struct
+{
+	/// display identifier (g_display_id)
+	uint32_t display;
+	/// display refresh rate and movie frame rate, 24.8 fixed-point
+	uint32_t mode_hz;
+	uint32_t movie_hz;
+	/// number of playbacks evaluated, and how many of them were bad
+	uint16_t evals;
+	uint16_t bad;
+	/// LRU clock value when entry was used last time, 0 if entry is free
+	uint32_t used;
+} prior_pair_t;
+
+/// capabilities of a display, as detected last time it was connected
+typedef struct
+{
+	/// hash of display EDID (g_display_edid)
+	uint32_t edid;
+	/// number of display modes and color spaces
+	uint8_t modes;
+	uint8_t colorspaces;
+	/// HDCP mode (see hdcp_mode ())
+	uint8_t hdcp;
+	uint8_t reserved;
+	display_mode_t mode [PRIOR_DISPLAY_MODES];
+	colorspace_cap_t cs [PRIOR_DISPLAY_CS];
+	/// LRU clock value when entry was used last time, 0 if entry is free
+	uint32_t used;
+} prior_display_t;
+
+/// how long the screen stays dark on every kind of mode switch, per display
+typedef struct
+{
+	/// display identifier (g_display_id)
+	uint32_t display;
+	/// average time until display link settles, ms
+	uint16_t ms [SWITCH_TYPES];
+	/// number of switches measured, saturates at 255
+	uint8_t samples [SWITCH_TYPES];
+	/// LRU clock value when entry was used last time, 0 if entry is free
+	uint32_t used;
+} prior_cost_t;
+
+/// open (or create) the prior cache file
+extern bool prior_init ();
+/// close the prior cache file
+extern void prior_fini ();
+/// find the entry for given key, NULL if none
+extern const prior_entry_t *prior_lookup (const prior_key_t *key);
+/// remember the frame rate detected for given key
+extern void prior_store (const prior_key_t *key, int hz, int src);
+/// get (or create) fps source reliability data for a decoder, NULL if no cache
+extern fusion_rel_t *prior_reliability (const char *modalias);
+/// remember how well movie_hz played on mode_hz, returns true if pair is demoted now
+extern bool prior_pair_eval (uint32_t display, int mode_hz, int movie_hz, bool bad);
+/// check if movie_hz was playing badly on mode_hz
+extern bool prior_pair_demoted (uint32_t display, int mode_hz, int movie_hz);
+/// find the capabilities of a display by EDID hash, NULL if unknown
+extern const prior_display_t *prior_display_lookup (uint32_t edid);
+/// remember display capabilities, returns false if they are same as before
+extern bool prior_display_store (uint32_t edid, const display_mode_t *modes, int count,
+	const colorspace_cap_t *cs, int cs_count, int hdcp);
+/// remember how long a mode switch of given kind took on a display
+extern void prior_cost_eval (uint32_t display, switch_type_t type, int ms);
+/// expected duration of a mode switch of given kind in ms, -1 if never measured
+extern int prior_cost (uint32_t display, switch_type_t type);
+/// hash a content id string
+extern uint32_t prior_content_id (const char *id);
+
+#endif /* __PRIOR_H__ */
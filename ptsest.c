@@ -0,0 +1,218 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Streaming frame rate estimator from video chunk timestamps
+ */
+
+#include "afrd.h"
+#include "ptsest.h"
+
+// the frame rates we vote for, .8 fixed-point
+static const int pts_est_rate [PTS_EST_RATES] =
+{
+	FP8 (23,976), FP8 (24,000),
+	FP8 (25,000),
+	FP8 (29,970), FP8 (30,000),
+	FP8 (50,000),
+	FP8 (59,940), FP8 (60,000),
+};
+
+// vote of an interval spanning k frames is VOTE_FULL / k
+#define VOTE_FULL		12
+// timestamps are often rounded to milliseconds by demuxers
+#define PTS_JITTER		1000
+// the longest interval we're interested in, microseconds
+#define PTS_MAX_INTERVAL	(PTS_EST_MAX_SKIP * 41709 + PTS_JITTER)
+// if timestamps go backwards that much, it's a new stream (or a seek)
+#define PTS_RESTART		1000000
+// timestamps are in whole microseconds, so are deviations from a rate
+#define PTS_FIT_SLACK		20
+
+void pts_est_reset (pts_est_t *est)
+{
+	memset (est, 0, sizeof (*est));
+}
+
+static int compare_pts (const void *a, const void *b)
+{
+	uint64_t ptsa = *(uint64_t *)a;
+	uint64_t ptsb = *(uint64_t *)b;
+	return (ptsa > ptsb) - (ptsa < ptsb);
+}
+
+// frame duration in microseconds
+static uint32_t pts_est_dur (int i)
+{
+	return (256000000U + pts_est_rate [i] / 2) / pts_est_rate [i];
+}
+
+// start a new run of consecutive frames at i-th rate
+static void pts_est_fit_start (pts_est_t *est, int i, uint64_t pts)
+{
+	est->fit_base [i] = pts;
+	est->fit_frames [i] = 0;
+	est->fit_lo [i] = est->fit_hi [i] = 0;
+}
+
+// track how far timestamps stray from i-th rate over current run
+static void pts_est_fit (pts_est_t *est, int i, uint64_t pts, uint32_t k)
+{
+	est->fit_frames [i] += k;
+	uint64_t expected = (est->fit_frames [i] * 256000000ULL + pts_est_rate [i] / 2) / pts_est_rate [i];
+	int32_t dev = (int64_t)(pts - est->fit_base [i]) - (int64_t)expected;
+	if (dev < est->fit_lo [i])
+		est->fit_lo [i] = dev;
+	if (dev > est->fit_hi [i])
+		est->fit_hi [i] = dev;
+}
+
+static void pts_est_interval (pts_est_t *est, uint64_t pts)
+{
+	uint32_t delta = pts - est->last_pts;
+	if (delta > PTS_MAX_INTERVAL) {
+		// we missed too many chunks between polls
+		for (int i = 0; i < PTS_EST_RATES; i++)
+			pts_est_fit_start (est, i, pts);
+		return;
+	}
+
+	bool matched = false, single = false;
+	est->samples++;
+
+	for (int i = 0; i < PTS_EST_RATES; i++) {
+		uint32_t dur = pts_est_dur (i);
+		uint32_t k = (delta + dur / 2) / dur;
+		uint32_t tol = PTS_JITTER + (k * dur) / 200;
+		if ((k < 1) || (k > PTS_EST_MAX_SKIP) ||
+		    (abs ((int)(delta - k * dur)) > tol)) {
+			pts_est_fit_start (est, i, pts);
+			continue;
+		}
+
+		est->votes [i] += VOTE_FULL / k;
+		est->frames [i] += k;
+		est->time [i] += delta;
+		pts_est_fit (est, i, pts, k);
+		matched = true;
+		single |= (k == 1);
+	}
+
+	if (!matched)
+		est->outliers++;
+	else if (single) {
+		if (!est->min_dur || (delta < est->min_dur))
+			est->min_dur = delta;
+		if (delta > est->max_dur)
+			est->max_dur = delta;
+	}
+}
+
+int pts_est_feed (pts_est_t *est, uint64_t *pts, int count)
+{
+	if (count <= 0)
+		return 0;
+
+	// chunks come in decoding order, B-frames break monotonicity
+	qsort (pts, count, sizeof (pts [0]), compare_pts);
+
+	if (est->have_pts && (pts [count - 1] + PTS_RESTART < est->last_pts)) {
+		trace (2, "\t> timestamps went backwards, restarting estimation\n");
+		pts_est_reset (est);
+	}
+
+	int fresh = 0;
+	for (int i = 0; i < count; i++) {
+		// skip the chunks we've already seen on previous polls
+		if (est->have_pts && (pts [i] <= est->last_pts))
+			continue;
+
+		if (est->have_pts)
+			pts_est_interval (est, pts [i]);
+		else
+			for (int r = 0; r < PTS_EST_RATES; r++)
+				pts_est_fit_start (est, r, pts [i]);
+
+		est->last_pts = pts [i];
+		est->have_pts = true;
+		fresh++;
+	}
+
+	return fresh;
+}
+
+// tell which of two neighbour rates timestamps fit better, -1 if can't yet
+static int pts_est_fit_pick (pts_est_t *est, int a, int b)
+{
+	int32_t spread_a = est->fit_hi [a] - est->fit_lo [a];
+	int32_t spread_b = est->fit_hi [b] - est->fit_lo [b];
+	int best = (spread_a <= spread_b) ? a : b;
+	int32_t margin = abs (spread_a - spread_b);
+
+	// timestamp noise is what's left around the right rate, which
+	// is at least half the spread of single-frame intervals
+	int32_t noise = (spread_a <= spread_b) ? spread_a : spread_b;
+	if (noise < (int32_t)(est->max_dur - est->min_dur) / 2)
+		noise = (est->max_dur - est->min_dur) / 2;
+
+	// the rates must drift apart over the run more than the noise
+	uint32_t frames = est->fit_frames [a] < est->fit_frames [b] ?
+		est->fit_frames [a] : est->fit_frames [b];
+	uint32_t drift = frames * abs ((int)pts_est_dur (a) - (int)pts_est_dur (b));
+	if ((drift > noise) && (margin > noise / 2 + PTS_FIT_SLACK))
+		return best;
+
+	return -1;
+}
+
+int pts_est_hz (pts_est_t *est, int *confidence)
+{
+	*confidence = 0;
+
+	int best = -1;
+	for (int i = 0; i < PTS_EST_RATES; i++)
+		if (est->votes [i] && ((best < 0) || (est->votes [i] > est->votes [best])))
+			best = i;
+
+	if (best < 0)
+		return 0;
+
+	// share of intervals that agree with the winner
+	int share = (est->votes [best] * 100) / (VOTE_FULL * est->samples);
+	if (share >= 50) {
+		int samples = est->samples;
+		if (samples > PTS_EST_FULL_SAMPLES)
+			samples = PTS_EST_FULL_SAMPLES;
+		*confidence = (share * samples) / PTS_EST_FULL_SAMPLES;
+	}
+
+	// the average over all agreeing intervals is very precise...
+	int hz = (est->frames [best] * 256000000ULL + est->time [best] / 2) / est->time [best];
+
+	// ...but it takes long to tell apart rates 0.1% away, go by the fit
+	int nearest = 0;
+	for (int i = 1; i < PTS_EST_RATES; i++)
+		if (abs (pts_est_rate [i] - hz) < abs (pts_est_rate [nearest] - hz))
+			nearest = i;
+	for (int i = 0; i < PTS_EST_RATES; i++) {
+		if ((i == nearest) || !est->votes [i] ||
+		    (abs (pts_est_rate [i] - pts_est_rate [nearest]) * 100 > pts_est_rate [nearest]))
+			continue;
+
+		int pick = pts_est_fit_pick (est, nearest, i);
+		if (pick >= 0)
+			est->fit_rate = pick + 1;
+
+		if (est->fit_rate == i + 1)
+			hz = pts_est_rate [i];
+		else if (est->fit_rate != nearest + 1)
+			*confidence = 0;
+	}
+
+	if ((*confidence >= 90) && !est->locked_at)
+		est->locked_at = est->samples;
+
+	return hz;
+}
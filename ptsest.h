@@ -0,0 +1,69 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Streaming frame rate estimator from video chunk timestamps
+ */
+
+#ifndef __PTSEST_H__
+#define __PTSEST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/// Number of standard frame rates the estimator votes for
+#define PTS_EST_RATES		8
+/// Frame skips up to this many frames are still usable
+#define PTS_EST_MAX_SKIP	4
+/// Number of consistent intervals needed for full confidence
+#define PTS_EST_FULL_SAMPLES	8
+
+/**
+ * Frame interval histogram built from PTS of decoded chunks.
+ * Every interval between consecutive timestamps votes for every
+ * standard frame rate it is a whole multiple of (a frame skip),
+ * with a lower vote for larger multiples. The winning rate is
+ * refined from the total time and frame count it has collected.
+ * Rates just 0.1% apart (23.976 and 24) get the same votes; which one
+ * it is, is told by how far the timestamps stray from either rate.
+ */
+typedef struct
+{
+	/// the largest timestamp seen so far, microseconds
+	uint64_t last_pts;
+	/// false until first timestamp is seen
+	bool have_pts;
+	/// total number of usable intervals
+	uint32_t samples;
+	/// intervals not matching any standard frame rate
+	uint32_t outliers;
+	/// votes for every standard frame rate
+	uint32_t votes [PTS_EST_RATES];
+	/// total frames spanned by intervals that voted for the rate
+	uint32_t frames [PTS_EST_RATES];
+	/// total time spanned by intervals that voted for the rate, microseconds
+	uint64_t time [PTS_EST_RATES];
+	/// number of samples when confidence first reached 100%, 0 if not yet
+	uint32_t locked_at;
+	/// shortest and longest single-frame interval, microseconds
+	uint32_t min_dur, max_dur;
+	/// the first timestamp of current run of consecutive frames at every rate
+	uint64_t fit_base [PTS_EST_RATES];
+	/// number of frames in current run at every rate
+	uint32_t fit_frames [PTS_EST_RATES];
+	/// the range of timestamp deviations from every rate over current run
+	int32_t fit_lo [PTS_EST_RATES], fit_hi [PTS_EST_RATES];
+	/// 1 + index of the rate told apart from its neighbour, 0 if not yet
+	int fit_rate;
+} pts_est_t;
+
+/// forget everything, e.g. when a new video starts
+extern void pts_est_reset (pts_est_t *est);
+/// feed a batch of timestamps in any order, returns number of new ones
+extern int pts_est_feed (pts_est_t *est, uint64_t *pts, int count);
+/// get estimated frame rate (24.8 fixed-point) and confidence (0-100)
+extern int pts_est_hz (pts_est_t *est, int *confidence);
+
+#endif /* __PTSEST_H__ */
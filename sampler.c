@@ -0,0 +1,359 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Background sampling of video decoder sysfs attributes.
+ *
+ * Some vdec drivers take a lot of time to render their dumps, so
+ * the attributes are read and parsed by a worker thread. Parsed
+ * samples are passed back to main loop through a single-producer
+ * single-consumer lock-free ring, and an eventfd wakes up the loop.
+ */
+
+#include "afrd.h"
+#include "sampler.h"
+#include "capture.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+// number of samples in ring, must be a power of two
+#define SAMPLE_RING		8
+
+// the sampled vdec sysfs attributes, owned by producer
+static sysfs_attr_t g_sample_attr [SAMPLE_COUNT];
+// worker thread, if running
+static pthread_t g_sample_thread;
+static bool g_sample_threaded = false;
+// wakes up the worker when there are requests
+static int g_sample_wake_fd = -1;
+// wakes up the main loop when there are samples
+static int g_sample_done_fd = -1;
+
+// requested sample kinds and their generation
+static atomic_uint g_sample_requests;
+static atomic_uint g_sample_gen;
+static atomic_bool g_sample_quit;
+// longest sampling time in microseconds
+static atomic_uint g_sample_time_max;
+
+// the ring: producer advances head, consumer advances tail
+static vdec_sample_t g_sample_ring [SAMPLE_RING];
+static atomic_uint g_sample_head;
+static atomic_uint g_sample_tail;
+
+// attribute contents are read here, used only by producer
+static char g_sample_buff [16384];
+
+static int sample_read (sample_kind_t kind)
+{
+	return sysfs_attr_read (&g_sample_attr [kind], g_sample_buff, sizeof (g_sample_buff));
+}
+
+static void sample_chunks (vdec_sample_t *sample)
+{
+	sample->chunks.count = 0;
+	int n = sample_read (SAMPLE_CHUNKS);
+	if (n < 100) {
+		sample->failed = true;
+		return;
+	}
+
+	// ignore the incomplete line at the end, if any
+	while ((n > 0) && (g_sample_buff [n - 1] != '\n'))
+		n--;
+	strspan_t buff = strspan (g_sample_buff, n);
+	strspan_t line;
+	while ((sample->chunks.count < SAMPLE_MAX_PTS) && strspan_next (&buff, '\n', &line)) {
+		bool ok = true;
+		unsigned long long pts64 = strspan_find_ull (&line, "pts64=", &ok);
+		if (ok)
+			sample->chunks.pts [sample->chunks.count++] = pts64;
+	}
+}
+
+static void sample_blocks (vdec_sample_t *sample)
+{
+	int n = sample_read (SAMPLE_BLOCKS);
+	if (n <= 0) {
+		sample->failed = true;
+		return;
+	}
+
+	// only the first line is interesting
+	strspan_t buff = strspan (g_sample_buff, n);
+	strspan_t line;
+	strspan_next (&buff, '\n', &line);
+	bool ok = true;
+
+	sample->blocks.dsize = strspan_find_ull (&line, ",dsize=", &ok);
+	sample->blocks.nframes = strspan_find_ull (&line, ",frames:", &ok);
+	sample->blocks.timeint = strspan_find_ull (&line, ",dur:", &ok);
+	sample->blocks.ok = ok;
+}
+
+int vdec_status_channels (char *buff, int len, vdec_channel_t *channel, int max)
+{
+	vdec_channel_t *cur = NULL;
+	int count = 0;
+
+	strspan_t text = strspan (buff, len);
+	strspan_t line;
+	while (strspan_next (&text, '\n', &line)) {
+		strspan_t attr, val;
+		if (!strspan_kv (&line, ':', &attr, &val))
+			continue;
+
+		dtrace (2, "\tattr [%.*s] val [%.*s]\n",
+			(int)attr.len, attr.str, (int)val.len, val.str);
+
+		// every channel starts with a "vdec channel N statistics" line,
+		// old kernels have just one channel without a header
+		bool header = strspan_starts (&attr, "vdec channel");
+		if (header || !cur) {
+			if (count >= max) {
+				cur = NULL;
+				break;
+			}
+			cur = &channel [count++];
+			memset (cur, 0, sizeof (*cur));
+			if (header)
+				continue;
+		}
+
+		bool ok = true;
+		if (strspan_eq (&attr, "device name")) {
+			size_t n = (val.len < sizeof (cur->name)) ? val.len : sizeof (cur->name) - 1;
+			memcpy (cur->name, val.str, n);
+		} else if (strspan_eq (&attr, "frame rate")) {
+			int fps = strspan_ull (&val, &ok);
+			strspan_trim (&val);
+			if (!ok || (val.len && !strspan_eq (&val, "fps")))
+				trace (2, "\tgarbage at end of 'frame rate': [%.*s]\n", (int)val.len, val.str);
+			else
+				cur->fps = fps;
+		} else if (strspan_eq (&attr, "frame dur")) {
+			int frame_dur = strspan_ull (&val, &ok);
+			if (!ok || val.len)
+				trace (2, "\tgarbage at end of 'frame dur': [%.*s]\n", (int)val.len, val.str);
+			else
+				cur->frame_dur = frame_dur;
+		} else if (strspan_eq (&attr, "frame width"))
+			cur->width = strspan_ull (&val, &ok);
+		else if (strspan_eq (&attr, "frame height"))
+			cur->height = strspan_ull (&val, &ok);
+		else if (strspan_eq (&attr, "frame count"))
+			cur->frame_count = strspan_ull (&val, &ok);
+		else if (strspan_eq (&attr, "drop count"))
+			cur->drop_count = strspan_ull (&val, &ok);
+	}
+
+	// drop the channels that don't have a decoder attached
+	int n = 0;
+	for (int i = 0; i < count; i++)
+		if (channel [i].name [0])
+			channel [n++] = channel [i];
+
+	return n;
+}
+
+int vdec_primary_channel (const vdec_channel_t *channel, int count)
+{
+	// the main stream is the largest picture, previews and
+	// picture-in-picture are smaller; if same, the one that runs longer
+	int primary = -1;
+	for (int i = 0; i < count; i++) {
+		const vdec_channel_t *ch = &channel [i];
+		if (primary < 0) {
+			primary = i;
+			continue;
+		}
+
+		const vdec_channel_t *best = &channel [primary];
+		unsigned area = ch->width * ch->height;
+		unsigned best_area = best->width * best->height;
+		if ((area > best_area) ||
+		    ((area == best_area) && (ch->frame_count > best->frame_count)))
+			primary = i;
+	}
+
+	return primary;
+}
+
+static void sample_vdec (vdec_sample_t *sample)
+{
+	sample->vdec.channels = 0;
+	sample->vdec.primary = -1;
+	int n = sample_read (SAMPLE_VDEC);
+	if (n < 0) {
+		sample->failed = true;
+		return;
+	}
+
+	sample->vdec.channels = vdec_status_channels (g_sample_buff, n,
+		sample->vdec.channel, SAMPLE_MAX_CHANNELS);
+	sample->vdec.primary = vdec_primary_channel (sample->vdec.channel,
+		sample->vdec.channels);
+}
+
+// sample every requested attribute and put the results into the ring
+static bool sample_requests (unsigned kinds, uint32_t gen)
+{
+	bool produced = false;
+
+	for (int kind = 0; kind < SAMPLE_COUNT; kind++) {
+		if (!(kinds & (1 << kind)))
+			continue;
+
+		unsigned head = atomic_load_explicit (&g_sample_head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit (&g_sample_tail, memory_order_acquire);
+		if (head - tail >= SAMPLE_RING) {
+			trace (2, "sample queue full, dropping request %d\n", kind);
+			continue;
+		}
+
+		struct timespec t0, t1;
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+
+		vdec_sample_t *sample = &g_sample_ring [head & (SAMPLE_RING - 1)];
+		sample->kind = kind;
+		sample->failed = false;
+		sample->gen = gen;
+		switch (kind) {
+			case SAMPLE_CHUNKS: sample_chunks (sample); break;
+			case SAMPLE_BLOCKS: sample_blocks (sample); break;
+			case SAMPLE_VDEC: sample_vdec (sample); break;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+		unsigned us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+		sample->time = us;
+		if (us > atomic_load_explicit (&g_sample_time_max, memory_order_relaxed))
+			atomic_store_explicit (&g_sample_time_max, us, memory_order_relaxed);
+
+		atomic_store_explicit (&g_sample_head, head + 1, memory_order_release);
+		produced = true;
+	}
+
+	return produced;
+}
+
+static void *sample_worker (void *arg)
+{
+	while (!atomic_load (&g_sample_quit)) {
+		uint64_t val;
+		if ((read (g_sample_wake_fd, &val, sizeof (val)) < 0) && (errno != EINTR))
+			break;
+
+		unsigned kinds = atomic_exchange (&g_sample_requests, 0);
+		uint32_t gen = atomic_load (&g_sample_gen);
+		if (kinds && sample_requests (kinds, gen)) {
+			val = 1;
+			write (g_sample_done_fd, &val, sizeof (val));
+		}
+	}
+
+	return NULL;
+}
+
+bool sampler_init (const char *vdec_sysfs)
+{
+	sysfs_attr_init (&g_sample_attr [SAMPLE_CHUNKS], vdec_sysfs, "dump_vdec_chunks");
+	sysfs_attr_init (&g_sample_attr [SAMPLE_BLOCKS], vdec_sysfs, "dump_vdec_blocks");
+	sysfs_attr_init (&g_sample_attr [SAMPLE_VDEC], vdec_sysfs, "vdec_status");
+
+	atomic_store (&g_sample_requests, 0);
+	atomic_store (&g_sample_quit, false);
+	atomic_store (&g_sample_head, 0);
+	atomic_store (&g_sample_tail, 0);
+
+	// replay must be deterministic, so sample synchronously
+	if (g_replay)
+		return true;
+
+	g_sample_wake_fd = eventfd (0, EFD_CLOEXEC);
+	g_sample_done_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((g_sample_wake_fd < 0) || (g_sample_done_fd < 0) ||
+	    (pthread_create (&g_sample_thread, NULL, sample_worker, NULL) != 0)) {
+		trace (0, "failed to start sampler thread, sampling synchronously\n");
+		sampler_fini ();
+		return false;
+	}
+
+	g_sample_threaded = true;
+	return true;
+}
+
+void sampler_fini ()
+{
+	if (g_sample_threaded) {
+		uint64_t val = 1;
+		atomic_store (&g_sample_quit, true);
+		write (g_sample_wake_fd, &val, sizeof (val));
+		pthread_join (g_sample_thread, NULL);
+		g_sample_threaded = false;
+	}
+
+	for (int kind = 0; kind < SAMPLE_COUNT; kind++)
+		sysfs_attr_fini (&g_sample_attr [kind]);
+
+	if (g_sample_wake_fd >= 0) {
+		close (g_sample_wake_fd);
+		g_sample_wake_fd = -1;
+	}
+	if (g_sample_done_fd >= 0) {
+		close (g_sample_done_fd);
+		g_sample_done_fd = -1;
+	}
+}
+
+int sampler_fd ()
+{
+	return g_sample_threaded ? g_sample_done_fd : -1;
+}
+
+void sampler_request (unsigned kinds, uint32_t gen)
+{
+	if (!g_sample_attr [SAMPLE_VDEC].path [0] || !kinds)
+		return;
+
+	if (!g_sample_threaded) {
+		sample_requests (kinds, gen);
+		return;
+	}
+
+	atomic_store (&g_sample_gen, gen);
+	atomic_fetch_or (&g_sample_requests, kinds);
+
+	uint64_t val = 1;
+	write (g_sample_wake_fd, &val, sizeof (val));
+}
+
+bool sampler_get (vdec_sample_t *sample)
+{
+	unsigned tail = atomic_load_explicit (&g_sample_tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit (&g_sample_head, memory_order_acquire);
+	if (tail == head)
+		return false;
+
+	*sample = g_sample_ring [tail & (SAMPLE_RING - 1)];
+	atomic_store_explicit (&g_sample_tail, tail + 1, memory_order_release);
+	return true;
+}
+
+void sampler_ack ()
+{
+	uint64_t val;
+	if (g_sample_threaded)
+		read (g_sample_done_fd, &val, sizeof (val));
+}
+
+uint32_t sampler_time_max ()
+{
+	return atomic_load_explicit (&g_sample_time_max, memory_order_relaxed);
+}
@@ -0,0 +1,103 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Background sampling of video decoder sysfs attributes
+ */
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/// Maximal number of chunk timestamps in a sample
+#define SAMPLE_MAX_PTS		256
+/// Maximal number of vdec_status channels in a sample
+#define SAMPLE_MAX_CHANNELS	4
+
+/// The vdec sysfs attributes we can sample
+typedef enum
+{
+	/// dump_vdec_chunks
+	SAMPLE_CHUNKS,
+	/// dump_vdec_blocks
+	SAMPLE_BLOCKS,
+	/// vdec_status
+	SAMPLE_VDEC,
+
+	SAMPLE_COUNT
+} sample_kind_t;
+
+/// Statistics of a single vdec_status channel
+typedef struct
+{
+	/// decoder driver name
+	char name [32];
+	/// declared frame rate and frame duration
+	int fps;
+	int frame_dur;
+	/// decoded frame size
+	int width, height;
+	/// number of decoded and dropped frames
+	unsigned frame_count, drop_count;
+} vdec_channel_t;
+
+/// Parsed contents of a vdec sysfs attribute
+typedef struct
+{
+	/// what was sampled (sample_kind_t)
+	uint8_t kind;
+	/// true if attribute could not be read
+	bool failed;
+	/// request generation this sample belongs to
+	uint32_t gen;
+	/// time it took to read and parse the attribute, microseconds
+	uint32_t time;
+	union
+	{
+		/// dump_vdec_chunks: pts64 of every chunk, in dump order
+		struct
+		{
+			int count;
+			uint64_t pts [SAMPLE_MAX_PTS];
+		} chunks;
+		/// dump_vdec_blocks: first line stats
+		struct
+		{
+			bool ok;
+			unsigned dsize, nframes, timeint;
+		} blocks;
+		/// vdec_status: every decoder channel and the primary one
+		struct
+		{
+			int channels;
+			int primary;
+			vdec_channel_t channel [SAMPLE_MAX_CHANNELS];
+		} vdec;
+	};
+} vdec_sample_t;
+
+/// start the sampler worker, synchronous if thread can't be used
+extern bool sampler_init (const char *vdec_sysfs);
+/// stop the worker thread
+extern void sampler_fini ();
+/// eventfd signalled when samples are ready, -1 in synchronous mode
+extern int sampler_fd ();
+/// ask to sample attributes (bitmask of 1 << sample_kind_t)
+extern void sampler_request (unsigned kinds, uint32_t gen);
+/// reset the eventfd before fetching samples with sampler_get()
+extern void sampler_ack ();
+/// get next ready sample, returns false if queue is empty
+extern bool sampler_get (vdec_sample_t *sample);
+/// longest time it took to read and parse an attribute, microseconds
+extern uint32_t sampler_time_max ();
+
+/// parse every "vdec channel N" block from vdec_status, returns number of channels
+extern int vdec_status_channels (char *buff, int len, vdec_channel_t *channel, int max);
+/// choose the channel that plays the main stream, -1 if none
+extern int vdec_primary_channel (const vdec_channel_t *channel, int count);
+
+#endif /* __SAMPLER_H__ */
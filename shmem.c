@@ -25,6 +25,17 @@ static bool g_shmem_read;
 // local copy of the statistics
 afrd_shmem_t g_afrd_stats;
 
+void shmem_file_path (char *path, size_t size, const char *name)
+{
+	// place shared files in same dir where pid file is
+	char *pidfile = strdup (g_pidfile);
+	char *dn = dirname (pidfile);
+	if (*dn && (access (dn, F_OK) != 0))
+		mkdir (dn, 0755);
+	snprintf (path, size, "%s/%s", dn, name);
+	free (pidfile);
+}
+
 bool shmem_init (bool read)
 {
 	g_shmem_read = read;
@@ -32,13 +43,7 @@ bool shmem_init (bool read)
 	crc32_init ();
 
 	char shmem_path [200];
-	// place shared memory file in same dir where pid file is
-	char *pidfile = strdup (g_pidfile);
-	char *dn = dirname (pidfile);
-	if (*dn && (access (dn, F_OK) != 0))
-		mkdir (dn, 0755);
-	snprintf (shmem_path, sizeof (shmem_path), "%s/afrd.ipc", dn);
-	free (pidfile);
+	shmem_file_path (shmem_path, sizeof (shmem_path), "afrd.ipc");
 
 	if (g_shmem_path)
 		free (g_shmem_path);
@@ -88,9 +93,11 @@ void shmem_fini ()
 {
 	if (g_shmem) {
 		// force clients to re-open the shm
-		g_shmem->size = 0;
-		g_shmem->crc32++;
-		msync (g_shmem, sizeof (afrd_shmem_t), MS_SYNC);
+		if (!g_shmem_read) {
+			g_shmem->size = 0;
+			g_shmem->crc32++;
+			msync (g_shmem, sizeof (afrd_shmem_t), MS_SYNC);
+		}
 
 		munmap (g_shmem, sizeof (afrd_shmem_t));
 		g_shmem = NULL;
@@ -0,0 +1,635 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * A simulated AMLogic device for running afrd on a plain Linux box.
+ *
+ * The device model serves the sysfs attributes at the configured paths:
+ * hdmitx capabilities and controls, the display mode attribute which
+ * blocks in write() for as long as a real hdmitx driver does, vinfo and
+ * HDCP authentication that come up some time after a mode switch, and
+ * a video decoder playing the configured stream. A thread starts and
+ * stops the stream and sends the uevents the kernel would send through
+ * a private socket, which afrd reads instead of the netlink socket.
+ */
+
+#include "afrd.h"
+#include "sim.h"
+
+#include <time.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// the modes the simulated display supports
+#define SIM_DEFAULT_MODES	"480p60hz 576p50hz 720p50hz 720p60hz 1080i50hz 1080i60hz " \
+				"1080p24hz 1080p25hz 1080p30hz 1080p50hz 1080p60hz " \
+				"2160p24hz 2160p25hz 2160p30hz 2160p50hz 2160p60hz"
+#define SIM_DEFAULT_MODE	"1080p60hz"
+#define SIM_DEFAULT_DC_CAP	"444,10bit 444,8bit 422,12bit 420,10bit 420,8bit rgb,8bit"
+#define SIM_DEFAULT_ATTR	"444,8bit,full"
+#define SIM_DEFAULT_HDCP	"14"
+#define SIM_DEFAULT_FPS		"23.976"
+#define SIM_DEFAULT_VDEC	"amvdec_h264"
+// milliseconds the mode write blocks: only the refresh rate changes,
+// the mode size changes, the screen is disabled
+#define SIM_DEFAULT_LAT_RATE	250
+#define SIM_DEFAULT_LAT_FULL	600
+#define SIM_DEFAULT_LAT_NULL	30
+// milliseconds after the write until vinfo reports the new mode
+#define SIM_DEFAULT_LAT_LINK	300
+// milliseconds after the link is up until HDCP is authenticated
+#define SIM_DEFAULT_LAT_HDCP	1200
+#define SIM_DEFAULT_START	3000
+#define SIM_DEFAULT_LENGTH	20000
+// the decoder device uevents come from
+#define SIM_VDEC_DEVPATH	"/devices/platform/vdec/vdec.0"
+#define SIM_HDMI_DEVPATH	"/devices/virtual/amhdmitx/amhdmitx0"
+// number of chunks listed in dump_vdec_chunks
+#define SIM_CHUNKS		16
+// average chunk size, bytes
+#define SIM_CHUNK_SIZE		20000
+// maximal number of attributes served
+#define SIM_ATTR_MAX		16
+
+bool g_sim = false;
+
+typedef struct
+{
+	/// full path to the attribute
+	char path [128];
+	/// generate attribute contents, return length
+	int (*read) (char *buf, size_t size, uint64_t now);
+	/// accept a written value, return 0 or -1 on error; NULL if read-only
+	int (*write) (const char *value);
+} sim_attr_t;
+
+static sim_attr_t g_sim_attr [SIM_ATTR_MAX];
+static int g_sim_attr_n = 0;
+
+// device configuration, constant while running
+static struct
+{
+	char modes [512];
+	char dc_cap [256];
+	char vdec [32];
+	int width, height;
+	int lat_rate, lat_full, lat_null, lat_link, lat_hdcp;
+	int start, length, pause;
+	bool hint;
+	double fps [SIM_MAX_FPS];
+	int fps_n;
+} g_sim_cfg;
+
+// protects g_sim_dev, the attributes are read and written by several threads
+static pthread_mutex_t g_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled to make the uevent thread quit
+static pthread_cond_t g_sim_cond;
+
+// device state
+static struct
+{
+	/// display mode as written
+	char mode [32];
+	/// display mode as reported by vinfo, the link is down until link_at
+	char link_mode [32];
+	uint64_t link_at;
+	int frac;
+	char attr [32];
+	char hdcp [4];
+	/// when HDCP gets authenticated, 0 if it never will
+	uint64_t auth_at;
+	/// the stream being played and when it started, 0 if idle
+	double fps;
+	uint64_t play_at;
+	bool quit;
+} g_sim_dev;
+
+static pthread_t g_sim_thread;
+static bool g_sim_threaded = false;
+// uevents are sent into [1], afrd reads them from [0]
+static int g_sim_uevent_fd [2] = { -1, -1 };
+static unsigned long long g_sim_seqnum;
+
+// milliseconds on the monotonic clock
+static uint64_t sim_now ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// snprintf that returns the length actually stored, like read() would
+static int sim_print (char *buf, size_t size, const char *format, ...)
+	__attribute__((format(printf,3,4)));
+static int sim_print (char *buf, size_t size, const char *format, ...)
+{
+	va_list args;
+	va_start (args, format);
+	int n = vsnprintf (buf, size, format, args);
+	va_end (args);
+
+	if (n < 0)
+		return 0;
+	return ((size_t)n >= size) ? size - 1 : n;
+}
+
+// the length of mode size part of its name, "1080p" in "1080p60hz"
+static size_t sim_mode_size (const char *mode)
+{
+	size_t n = strspn (mode, "0123456789x");
+	return mode [n] ? n + 1 : n;
+}
+
+// check if the simulated display supports mode
+static bool sim_mode_supported (const char *mode)
+{
+	size_t len = strlen (mode);
+	for (const char *cur = g_sim_cfg.modes; *cur; ) {
+		cur += strspn (cur, spaces);
+		size_t n = strcspn (cur, spaces);
+		if ((n == len) && (memcmp (cur, mode, n) == 0))
+			return true;
+		cur += n;
+	}
+	return false;
+}
+
+// the link comes up in the mode just set, then HDCP authenticates
+static void sim_link_restart (uint64_t now)
+{
+	g_sim_dev.link_at = now + g_sim_cfg.lat_link;
+	if (strcmp (g_sim_dev.hdcp, "0") && strcmp (g_sim_dev.mode, "null"))
+		g_sim_dev.auth_at = g_sim_dev.link_at + g_sim_cfg.lat_hdcp;
+	else
+		g_sim_dev.auth_at = 0;
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+static int sim_read_state (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "1\n");
+}
+
+static int sim_read_disp_cap (char *buf, size_t size, uint64_t now)
+{
+	// one mode per line, the current one is marked with an asterisk
+	int n = 0;
+	for (const char *cur = g_sim_cfg.modes; *cur; ) {
+		cur += strspn (cur, spaces);
+		int len = strcspn (cur, spaces);
+		if (len) {
+			bool current = ((size_t)len == strlen (g_sim_dev.mode)) && (memcmp (cur, g_sim_dev.mode, len) == 0);
+			n += sim_print (buf + n, size - n, "%.*s%s\n", len, cur, current ? "*" : "");
+		}
+		cur += len;
+	}
+	return n;
+}
+
+static int sim_read_dc_cap (char *buf, size_t size, uint64_t now)
+{
+	int n = 0;
+	for (const char *cur = g_sim_cfg.dc_cap; *cur; ) {
+		cur += strspn (cur, spaces);
+		int len = strcspn (cur, spaces);
+		if (len)
+			n += sim_print (buf + n, size - n, "%.*s\n", len, cur);
+		cur += len;
+	}
+	return n;
+}
+
+static int sim_read_frac (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "%d\n", g_sim_dev.frac);
+}
+
+static int sim_write_frac (const char *value)
+{
+	// takes effect on next mode switch
+	g_sim_dev.frac = (atoi (value) != 0);
+	return 0;
+}
+
+static int sim_read_attr (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "%s\n", g_sim_dev.attr);
+}
+
+static int sim_write_attr (const char *value)
+{
+	snprintf (g_sim_dev.attr, sizeof (g_sim_dev.attr), "%s", value);
+	return 0;
+}
+
+static int sim_read_hdcp_mode (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "%s\n", g_sim_dev.hdcp);
+}
+
+static int sim_write_hdcp_mode (const char *value)
+{
+	if (strcmp (value, "0") && strcmp (value, "14") && strcmp (value, "22"))
+		return -1;
+
+	// writing HDCP mode restarts authentication
+	snprintf (g_sim_dev.hdcp, sizeof (g_sim_dev.hdcp), "%s", value);
+	uint64_t now = sim_now ();
+	uint64_t up = (g_sim_dev.link_at > now) ? g_sim_dev.link_at : now;
+	g_sim_dev.auth_at = strcmp (value, "0") ? up + g_sim_cfg.lat_hdcp : 0;
+	return 0;
+}
+
+static int sim_read_hdcp_auth (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "%d\n", g_sim_dev.auth_at && (now >= g_sim_dev.auth_at));
+}
+
+static int sim_read_mode (char *buf, size_t size, uint64_t now)
+{
+	return sim_print (buf, size, "%s\n", g_sim_dev.mode);
+}
+
+// called with g_sim_lock released: it blocks like the hdmitx driver does
+static int sim_write_mode (const char *value)
+{
+	pthread_mutex_lock (&g_sim_lock);
+
+	int ms;
+	if (strcmp (value, "null") == 0)
+		ms = g_sim_cfg.lat_null;
+	else if (!sim_mode_supported (value)) {
+		pthread_mutex_unlock (&g_sim_lock);
+		return -1;
+	} else if ((sim_mode_size (value) == sim_mode_size (g_sim_dev.mode)) &&
+		   (strncmp (value, g_sim_dev.mode, sim_mode_size (value)) == 0))
+		ms = g_sim_cfg.lat_rate;
+	else
+		ms = g_sim_cfg.lat_full;
+
+	pthread_mutex_unlock (&g_sim_lock);
+
+	usleep (ms * 1000);
+
+	pthread_mutex_lock (&g_sim_lock);
+	snprintf (g_sim_dev.mode, sizeof (g_sim_dev.mode), "%s", value);
+	snprintf (g_sim_dev.link_mode, sizeof (g_sim_dev.link_mode), "%s", value);
+	sim_link_restart (sim_now ());
+	pthread_mutex_unlock (&g_sim_lock);
+	return 0;
+}
+
+static int sim_read_vinfo (char *buf, size_t size, uint64_t now)
+{
+	// the display driver reports the new mode once the link is up
+	return sim_print (buf, size, "current vinfo:\n    name:                  %s\n",
+		(now >= g_sim_dev.link_at) ? g_sim_dev.link_mode : "null");
+}
+
+// frames decoded since the stream started
+static uint64_t sim_frames (uint64_t now)
+{
+	return (uint64_t)((now - g_sim_dev.play_at) * g_sim_dev.fps / 1000.0);
+}
+
+static int sim_read_vdec_status (char *buf, size_t size, uint64_t now)
+{
+	if (!g_sim_dev.play_at)
+		return sim_print (buf, size, "No vdec.\n");
+
+	return sim_print (buf, size,
+		"vdec channel 0 statistics:\n"
+		"  device name : %s\n"
+		"  frame width : %d\n"
+		" frame height : %d\n"
+		"   frame rate : %d fps\n"
+		"     bit rate : %d kbps\n"
+		"       status : 63\n"
+		"    frame dur : %d\n"
+		"   frame data : %d KB\n"
+		"  frame count : %llu\n"
+		"   drop count : 0\n",
+		g_sim_cfg.vdec, g_sim_cfg.width, g_sim_cfg.height,
+		(int)(g_sim_dev.fps + 0.5), (int)(SIM_CHUNK_SIZE * 8 * g_sim_dev.fps / 1000),
+		(int)(96000 / g_sim_dev.fps + 0.5), SIM_CHUNK_SIZE / 1000,
+		(unsigned long long)sim_frames (now));
+}
+
+static int sim_read_chunks (char *buf, size_t size, uint64_t now)
+{
+	if (!g_sim_dev.play_at)
+		return 0;
+
+	// the chunks waiting to be decoded, in decode order: I/P, then two Bs
+	static const int reorder [4] = { 0, 3, 1, 2 };
+	uint64_t first = sim_frames (now) & ~3ULL;
+	int n = 0;
+	for (int i = 0; i < SIM_CHUNKS; i++) {
+		uint64_t chunk = first + (i & ~3) + reorder [i & 3];
+		unsigned long long pts64 = (unsigned long long)(chunk * 1000000.0 / g_sim_dev.fps + 0.5);
+		unsigned chunk_size = SIM_CHUNK_SIZE / 2 + (chunk * 2654435761U) % SIM_CHUNK_SIZE;
+		n += sim_print (buf + n, size - n, "chunk %llu: size=%u pts=%u pts64=%llu\n",
+			(unsigned long long)chunk, chunk_size, (unsigned)pts64, pts64);
+	}
+	return n;
+}
+
+static int sim_read_blocks (char *buf, size_t size, uint64_t now)
+{
+	if (!g_sim_dev.play_at)
+		return 0;
+
+	// frames decoded during the last whole second of playback
+	uint64_t sec = (now - g_sim_dev.play_at) / 1000;
+	uint64_t end = (uint64_t)(sec * g_sim_dev.fps);
+	uint64_t start = sec ? (uint64_t)((sec - 1) * g_sim_dev.fps) : 0;
+	unsigned frames = end - start;
+	unsigned dur = (unsigned)(frames * 1000 / g_sim_dev.fps + 0.5);
+
+	return sim_print (buf, size, "vdec,dsize=%llu,frames:%u,dur:%u\n",
+		(unsigned long long)end * SIM_CHUNK_SIZE, frames, dur);
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+static sim_attr_t *sim_attr_find (const char *path)
+{
+	for (int i = 0; i < g_sim_attr_n; i++)
+		if (strcmp (g_sim_attr [i].path, path) == 0)
+			return &g_sim_attr [i];
+	return NULL;
+}
+
+static void sim_attr_add (const char *device, const char *attr,
+	int (*read) (char *, size_t, uint64_t), int (*write) (const char *))
+{
+	if (!device || (g_sim_attr_n >= SIM_ATTR_MAX))
+		return;
+
+	sim_attr_t *sa = &g_sim_attr [g_sim_attr_n++];
+	if (attr)
+		snprintf (sa->path, sizeof (sa->path), "%s/%s", device, attr);
+	else
+		snprintf (sa->path, sizeof (sa->path), "%s", device);
+	sa->read = read;
+	sa->write = write;
+}
+
+static int sim_sysfs_read (const char *path, char *buf, size_t size)
+{
+	sim_attr_t *sa = sim_attr_find (path);
+	if (!sa)
+		return -1;
+
+	pthread_mutex_lock (&g_sim_lock);
+	int n = sa->read (buf, size, sim_now ());
+	pthread_mutex_unlock (&g_sim_lock);
+
+	buf [n] = 0;
+	return n;
+}
+
+static int sim_sysfs_write (const char *path, const char *value)
+{
+	sim_attr_t *sa = sim_attr_find (path);
+	if (!sa || !sa->write)
+		goto error;
+
+	// mode write has to sleep without holding the lock
+	if (sa->write == sim_write_mode) {
+		if (sim_write_mode (value) < 0)
+			goto error;
+		return 0;
+	}
+
+	pthread_mutex_lock (&g_sim_lock);
+	int ret = sa->write (value);
+	pthread_mutex_unlock (&g_sim_lock);
+	if (ret < 0)
+		goto error;
+	return 0;
+
+error:
+	trace (1, "failed to write [%s] into %s\n", value, path);
+	return -1;
+}
+
+static const sysfs_backend_t g_sim_backend =
+{
+	sim_sysfs_read, sim_sysfs_write
+};
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+// send an uevent the way kernel does: "action@devpath" and KEY=value pairs
+static void sim_uevent (const char *action, const char *devpath, const char *keys)
+{
+	char msg [512];
+	int n = snprintf (msg, sizeof (msg), "%s@%s|ACTION=%s|DEVPATH=%s|%s|SEQNUM=%llu|",
+		action, devpath, action, devpath, keys, ++g_sim_seqnum);
+	if ((n < 0) || ((size_t)n >= sizeof (msg)))
+		return;
+
+	for (int i = 0; i < n; i++)
+		if (msg [i] == '|')
+			msg [i] = 0;
+
+	trace (2, "sim: uevent %s@%s %s\n", action, devpath, keys);
+	if (send (g_sim_uevent_fd [1], msg, n, MSG_DONTWAIT) < 0)
+		trace (1, "sim: failed to send uevent: %s\n", strerror (errno));
+}
+
+// tell about the stream starting or stopping
+static void sim_stream_uevents (bool start, double fps)
+{
+	char keys [128];
+	snprintf (keys, sizeof (keys), "SUBSYSTEM=platform|MODALIAS=platform:%s", g_sim_cfg.vdec);
+	sim_uevent (start ? "add" : "remove", SIM_VDEC_DEVPATH, keys);
+
+	if (!g_sim_cfg.hint)
+		return;
+
+	// frame duration in 1/96000 s units
+	if (start)
+		snprintf (keys, sizeof (keys), "SUBSYSTEM=amhdmitx|DEVNAME=amhdmitx0|FRAME_RATE_HINT=%d",
+			(int)(96000 / fps + 0.5));
+	else
+		snprintf (keys, sizeof (keys), "SUBSYSTEM=amhdmitx|DEVNAME=amhdmitx0|FRAME_RATE_END_HINT");
+	sim_uevent ("change", SIM_HDMI_DEVPATH, keys);
+}
+
+static void *sim_worker (void *arg)
+{
+	int play_n = 0;
+	uint64_t next = sim_now () + g_sim_cfg.start;
+
+	pthread_mutex_lock (&g_sim_lock);
+	while (!g_sim_dev.quit) {
+		uint64_t now = sim_now ();
+		if (!next || (now < next)) {
+			if (!next)
+				pthread_cond_wait (&g_sim_cond, &g_sim_lock);
+			else {
+				struct timespec ts;
+				clock_gettime (CLOCK_MONOTONIC, &ts);
+				uint64_t ns = ts.tv_nsec + (next - now) * 1000000ULL;
+				ts.tv_sec += ns / 1000000000ULL;
+				ts.tv_nsec = ns % 1000000000ULL;
+				pthread_cond_timedwait (&g_sim_cond, &g_sim_lock, &ts);
+			}
+			continue;
+		}
+
+		if (!g_sim_dev.play_at) {
+			g_sim_dev.fps = g_sim_cfg.fps [play_n++ % g_sim_cfg.fps_n];
+			g_sim_dev.play_at = now;
+			trace (1, "sim: playing %.3f fps stream\n", g_sim_dev.fps);
+			sim_stream_uevents (true, g_sim_dev.fps);
+			next = g_sim_cfg.length ? now + g_sim_cfg.length : 0;
+		} else {
+			g_sim_dev.play_at = 0;
+			trace (1, "sim: stream stopped\n");
+			sim_stream_uevents (false, g_sim_dev.fps);
+			next = g_sim_cfg.pause ? now + g_sim_cfg.pause : 0;
+		}
+	}
+	pthread_mutex_unlock (&g_sim_lock);
+
+	return NULL;
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+static void sim_config ()
+{
+	snprintf (g_sim_cfg.modes, sizeof (g_sim_cfg.modes), "%s",
+		cfg_get_str ("sim.modes", SIM_DEFAULT_MODES));
+	snprintf (g_sim_cfg.dc_cap, sizeof (g_sim_cfg.dc_cap), "%s",
+		cfg_get_str ("sim.dc_cap", SIM_DEFAULT_DC_CAP));
+	snprintf (g_sim_cfg.vdec, sizeof (g_sim_cfg.vdec), "%s",
+		cfg_get_str ("sim.stream.vdec", SIM_DEFAULT_VDEC));
+	if (sscanf (cfg_get_str ("sim.stream.size", ""), "%dx%d",
+		    &g_sim_cfg.width, &g_sim_cfg.height) != 2) {
+		g_sim_cfg.width = 1920;
+		g_sim_cfg.height = 1080;
+	}
+
+	g_sim_cfg.lat_rate = cfg_get_int ("sim.latency.rate", SIM_DEFAULT_LAT_RATE);
+	g_sim_cfg.lat_full = cfg_get_int ("sim.latency.full", SIM_DEFAULT_LAT_FULL);
+	g_sim_cfg.lat_null = cfg_get_int ("sim.latency.null", SIM_DEFAULT_LAT_NULL);
+	g_sim_cfg.lat_link = cfg_get_int ("sim.latency.link", SIM_DEFAULT_LAT_LINK);
+	g_sim_cfg.lat_hdcp = cfg_get_int ("sim.latency.hdcp", SIM_DEFAULT_LAT_HDCP);
+	g_sim_cfg.start = cfg_get_int ("sim.stream.start", SIM_DEFAULT_START);
+	g_sim_cfg.length = cfg_get_int ("sim.stream.length", SIM_DEFAULT_LENGTH);
+	g_sim_cfg.pause = cfg_get_int ("sim.stream.pause", 0);
+	g_sim_cfg.hint = (cfg_get_int ("sim.stream.hint", 0) != 0);
+
+	// the frame rates of streams played in turn
+	char *tmp = strdup (cfg_get_str ("sim.stream.fps", SIM_DEFAULT_FPS));
+	char *cur = tmp;
+	g_sim_cfg.fps_n = 0;
+	while (*cur && (g_sim_cfg.fps_n < SIM_MAX_FPS)) {
+		cur += strspn (cur, spaces);
+		char *next = cur + strcspn (cur, spaces);
+		if (*next)
+			*next++ = 0;
+
+		double fps;
+		if ((sscanf (cur, "%lf", &fps) == 1) && (fps >= 1) && (fps <= 1000))
+			g_sim_cfg.fps [g_sim_cfg.fps_n++] = fps;
+
+		cur = next;
+	}
+	free (tmp);
+
+	if (!g_sim_cfg.fps_n)
+		g_sim_cfg.fps [g_sim_cfg.fps_n++] = 24000 / 1001.0;
+}
+
+bool sim_init (const char *hdmi_state, const char *vinfo, const char *vdec_sysfs)
+{
+	sim_fini ();
+	sim_config ();
+
+	memset (&g_sim_dev, 0, sizeof (g_sim_dev));
+	snprintf (g_sim_dev.mode, sizeof (g_sim_dev.mode), "%s", cfg_get_str ("sim.mode", SIM_DEFAULT_MODE));
+	snprintf (g_sim_dev.link_mode, sizeof (g_sim_dev.link_mode), "%s", g_sim_dev.mode);
+	snprintf (g_sim_dev.attr, sizeof (g_sim_dev.attr), "%s", SIM_DEFAULT_ATTR);
+	snprintf (g_sim_dev.hdcp, sizeof (g_sim_dev.hdcp), "%s", cfg_get_str ("sim.hdcp", SIM_DEFAULT_HDCP));
+	sim_link_restart (0);
+
+	g_sim_attr_n = 0;
+	sim_attr_add (hdmi_state, NULL, sim_read_state, NULL);
+	sim_attr_add (g_hdmi_dev, "disp_cap", sim_read_disp_cap, NULL);
+	sim_attr_add (g_hdmi_dev, "dc_cap", sim_read_dc_cap, NULL);
+	sim_attr_add (g_hdmi_dev, "frac_rate_policy", sim_read_frac, sim_write_frac);
+	sim_attr_add (g_hdmi_dev, "attr", sim_read_attr, sim_write_attr);
+	sim_attr_add (g_hdmi_dev, "hdcp_mode", sim_read_hdcp_mode, sim_write_hdcp_mode);
+	sim_attr_add (DEFAULT_HDCP_AUTHENTICATED, NULL, sim_read_hdcp_auth, NULL);
+	sim_attr_add (g_mode_path, NULL, sim_read_mode, sim_write_mode);
+	sim_attr_add (vinfo, NULL, sim_read_vinfo, NULL);
+	sim_attr_add (vdec_sysfs, "vdec_status", sim_read_vdec_status, NULL);
+	sim_attr_add (vdec_sysfs, "dump_vdec_chunks", sim_read_chunks, NULL);
+	sim_attr_add (vdec_sysfs, "dump_vdec_blocks", sim_read_blocks, NULL);
+	// color space attributes may be configured elsewhere
+	sim_attr_add (cfg_get_str ("cs.list.path", NULL), NULL, sim_read_dc_cap, NULL);
+	sim_attr_add (cfg_get_str ("cs.path", NULL), NULL, sim_read_attr, sim_write_attr);
+
+	if (socketpair (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, g_sim_uevent_fd) < 0) {
+		trace (0, "sim: failed to create uevent socket\n");
+		return false;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&g_sim_cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	if (pthread_create (&g_sim_thread, NULL, sim_worker, NULL) != 0) {
+		trace (0, "sim: failed to start uevent thread\n");
+		pthread_cond_destroy (&g_sim_cond);
+		sim_fini ();
+		return false;
+	}
+	g_sim_threaded = true;
+
+	sysfs_backend (&g_sim_backend);
+	trace (1, "\tsimulated device: display %s, HDCP %s, %d stream frame rates\n",
+		g_sim_dev.mode, g_sim_dev.hdcp, g_sim_cfg.fps_n);
+	return true;
+}
+
+void sim_fini ()
+{
+	if (g_sim_threaded) {
+		pthread_mutex_lock (&g_sim_lock);
+		g_sim_dev.quit = true;
+		pthread_cond_signal (&g_sim_cond);
+		pthread_mutex_unlock (&g_sim_lock);
+
+		pthread_join (g_sim_thread, NULL);
+		pthread_cond_destroy (&g_sim_cond);
+		g_sim_threaded = false;
+		sysfs_backend (NULL);
+	}
+
+	for (int i = 0; i < 2; i++)
+		if (g_sim_uevent_fd [i] >= 0) {
+			close (g_sim_uevent_fd [i]);
+			g_sim_uevent_fd [i] = -1;
+		}
+}
+
+int sim_uevent_open ()
+{
+	// the caller owns the receiving end from now on
+	int fd = g_sim_uevent_fd [0];
+	g_sim_uevent_fd [0] = -1;
+	return fd;
+}
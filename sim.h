@@ -0,0 +1,28 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * A simulated AMLogic device for running afrd on a plain Linux box
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdbool.h>
+
+/// Maximal number of frame rates the simulated stream goes through
+#define SIM_MAX_FPS		16
+
+/// true if afrd talks to the simulated device instead of hardware
+extern bool g_sim;
+
+/// set up the simulated device from config and serve sysfs from it
+extern bool sim_init (const char *hdmi_state, const char *vinfo, const char *vdec_sysfs);
+/// stop the simulated device and talk to the kernel again
+extern void sim_fini ();
+/// take the socket the simulated device sends uevents to, -1 on error
+extern int sim_uevent_open ();
+
+#endif /* __SIM_H__ */
@@ -103,40 +103,57 @@ bool strlist_contains (strlist_t *list, const char *str)
 	return false;
 }
 
-unsigned long find_ulong (const char *str, const char *prefix, bool *ok)
+void strspan_trim (strspan_t *s)
 {
-	if (!*ok)
-		return false;
-
-	const char *pfx = strstr (str, prefix);
-	if (!pfx)
-		goto fail;
+	while (s->len && strspan_space (*s->str)) {
+		s->str++;
+		s->len--;
+	}
+	while (s->len && strspan_space (s->str [s->len - 1]))
+		s->len--;
+}
 
-	char *tmp;
-	pfx += strlen (prefix);
-	unsigned long val = strtoul (pfx, &tmp, 10);
-	if (tmp > pfx)
-		return val;
+bool strspan_kv (const strspan_t *s, char sep, strspan_t *key, strspan_t *val)
+{
+	char *eq = (char *)memchr (s->str, sep, s->len);
+	if (!eq)
+		return false;
 
-fail:	*ok = false;
-	return 0;
+	*key = strspan (s->str, eq - s->str);
+	*val = strspan (eq + 1, s->len - key->len - 1);
+	strspan_trim (key);
+	strspan_trim (val);
+	return true;
 }
 
-unsigned long long find_ulonglong (const char *str, const char *prefix, bool *ok)
+unsigned long long strspan_find_ull (const strspan_t *s, const char *prefix, bool *ok)
 {
 	if (!*ok)
-		return false;
+		return 0;
 
-	const char *pfx = strstr (str, prefix);
-	if (!pfx)
-		goto fail;
+	size_t len = strlen (prefix);
+	char *cur = s->str;
+	char *end = s->str + s->len;
 
-	char *tmp;
-	pfx += strlen (prefix);
-	unsigned long val = strtoull (pfx, &tmp, 10);
-	if (tmp > pfx)
-		return val;
+	// look for the first char of prefix, then compare the rest
+	while ((size_t)(end - cur) >= len) {
+		cur = (char *)memchr (cur, prefix [0], end - cur - len + 1);
+		if (!cur)
+			break;
 
-fail:	*ok = false;
+		if (memcmp (cur, prefix, len) == 0) {
+			strspan_t num = strspan (cur + len, end - cur - len);
+			return strspan_ull (&num, ok);
+		}
+		cur++;
+	}
+
+	*ok = false;
 	return 0;
 }
+
+char *strspan_cstr (strspan_t *s)
+{
+	s->str [s->len] = 0;
+	return s->str;
+}
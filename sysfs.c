@@ -12,75 +12,93 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "afrd.h"
+#include "capture.h"
 
-char *sysfs_read (const char *device_attr)
+// incremented to make all open attribute handles reopen their files
+static atomic_uint g_sysfs_gen = 1;
+// incremented to distrust known values of control attributes
+static atomic_uint g_sysfs_value_gen = 1;
+// protects the known values of control attributes, which both threads update
+static pthread_mutex_t g_sysfs_value_lock = PTHREAD_MUTEX_INITIALIZER;
+// control attribute writes done and skipped, for statistics
+static atomic_uint g_sysfs_writes;
+static atomic_uint g_sysfs_writes_skipped;
+// serves the attributes instead of the kernel if not NULL
+static const sysfs_backend_t *g_sysfs_backend = NULL;
+
+void sysfs_backend (const sysfs_backend_t *backend)
 {
-	int h, n;
-	char tmp [4096];
+	g_sysfs_backend = backend;
+}
 
-	h = open (device_attr, O_RDONLY);
-	if (h < 0)
-		goto error;
+int sysfs_read_buf (const char *device_attr, char *buf, size_t size)
+{
+	if (g_sysfs_backend)
+		return g_sysfs_backend->read (device_attr, buf, size);
 
-	n = read (h, tmp, sizeof (tmp) - 1);
-	tmp [n] = 0;
+	int h = open (device_attr, O_RDONLY);
+	if (h < 0)
+		return -1;
 
+	int n = read (h, buf, size - 1);
 	close (h);
-	return strdup (tmp);
-
-error:
-	trace (1, "failed to read sysfs attr from %s\n", device_attr);
+	if (n < 0)
+		return -1;
 
-	if (h >= 0)
-		close (h);
-	return NULL;
+	buf [n] = 0;
+	capture_sysfs (CAP_SYSFS_READ, device_attr, buf, n);
+	return n;
 }
 
-char *sysfs_get_str (const char *device, const char *attr)
+// remove leading and trailing spaces in place
+static char *sysfs_strip (char *str, int len)
 {
-	char *ret;
-	if (attr) {
-		char tmp [200];
-		snprintf (tmp, sizeof (tmp), "%s/%s", device, attr);
-		ret = sysfs_read (tmp);
-	} else
-		ret = sysfs_read (device);
+	strspan_t s = strspan (str, len);
+	strspan_trim (&s);
+	return strspan_cstr (&s);
+}
 
-	if (!ret)
-		return NULL;
+// parse integer attribute value
+static int sysfs_parse_int (const char *vals)
+{
+	/* may be something like HDMI=1 */
+	const char *eq = strchr (vals, '=');
+	if (eq != NULL)
+		vals = eq + 1;
 
-	// remove trailing spaces
-	char *eol = strchr (ret, 0);
-	while ((eol > ret) && strchr ("\r\n\t ", eol [-1]))
-		eol--;
-	*eol = 0;
-	return ret;
+	return strtol (vals, NULL, 0);
 }
 
 int sysfs_get_int (const char *device, const char *attr)
 {
-	int val;
-	char *vals = sysfs_get_str (device, attr);
-	if (!vals)
-		return -1;
-
-        /* may be something like HDMI=1 */
-        char *eq = strchr (vals, '=');
-        if (eq != NULL)
-            vals = eq + 1;
+	char tmp [200];
+	if (attr) {
+		snprintf (tmp, sizeof (tmp), "%s/%s", device, attr);
+		device = tmp;
+	}
 
-	val = strtol (vals, NULL, 0);
-	free (vals);
+	char vals [64];
+	if (sysfs_read_buf (device, vals, sizeof (vals)) < 0) {
+		trace (1, "failed to read sysfs attr from %s\n", device);
+		return -1;
+	}
 
-	return val;
+	return sysfs_parse_int (vals);
 }
 
 int sysfs_write (const char *device_attr, const char *value)
 {
 	int h, n;
 
+	if (g_sysfs_backend)
+		return g_sysfs_backend->write (device_attr, value);
+
+	capture_sysfs (CAP_SYSFS_WRITE, device_attr, value, strlen (value));
+
 	h = open (device_attr, O_TRUNC | O_WRONLY);
 	if (h < 0)
 		goto error;
@@ -119,5 +137,239 @@ int sysfs_set_int (const char *device, const char *attr, int value)
 
 int sysfs_exists (const char *device_attr)
 {
+	if (g_sysfs_backend) {
+		char buf [2];
+		return (g_sysfs_backend->read (device_attr, buf, sizeof (buf)) < 0) ? -1 : 0;
+	}
+
 	return access (device_attr, F_OK);
 }
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+void sysfs_attr_init (sysfs_attr_t *sa, const char *device, const char *attr)
+{
+	sysfs_attr_fini (sa);
+
+	if (!device)
+		sa->path [0] = 0;
+	else if (attr)
+		snprintf (sa->path, sizeof (sa->path), "%s/%s", device, attr);
+	else
+		snprintf (sa->path, sizeof (sa->path), "%s", device);
+}
+
+void sysfs_attr_fini (sysfs_attr_t *sa)
+{
+	// a zero-initialized handle has no open files
+	if (sa->rgen && (sa->rfd >= 0))
+		close (sa->rfd);
+	if (sa->wgen && (sa->wfd >= 0))
+		close (sa->wfd);
+
+	sa->rfd = sa->wfd = -1;
+	sa->rgen = sa->wgen = atomic_load (&g_sysfs_gen);
+	sa->value [0] = 0;
+}
+
+// remember what a control attribute holds now, data is the raw attribute contents
+static void sysfs_attr_remember (sysfs_attr_t *sa, const char *data, size_t len)
+{
+	while (len && strchr (spaces, data [len - 1]))
+		len--;
+
+	pthread_mutex_lock (&g_sysfs_value_lock);
+	if (atomic_load (&sa->control)) {
+		if (len >= sizeof (sa->value))
+			sa->value [0] = 0;
+		else {
+			memcpy (sa->value, data, len);
+			sa->value [len] = 0;
+			sa->value_gen = atomic_load (&g_sysfs_value_gen);
+		}
+	}
+	pthread_mutex_unlock (&g_sysfs_value_lock);
+}
+
+// check if control attribute is known to hold given value
+static bool sysfs_attr_holds (sysfs_attr_t *sa, const char *value)
+{
+	char buf [sizeof (sa->value)];
+	const char *known = sysfs_attr_known (sa, buf, sizeof (buf));
+	return known && (strcmp (known, value) == 0);
+}
+
+// open the file of this thread if not open yet or if handles were invalidated;
+// each thread closes only its own file, the other one may be in use
+static int sysfs_attr_fd (sysfs_attr_t *sa, bool write)
+{
+	if (!sa->path [0])
+		return -1;
+
+	int *fd = write ? &sa->wfd : &sa->rfd;
+	unsigned *gen = write ? &sa->wgen : &sa->rgen;
+	unsigned cur = atomic_load (&g_sysfs_gen);
+	if (*gen != cur) {
+		// a zero-initialized handle has no open files
+		if (*gen && (*fd >= 0))
+			close (*fd);
+		*fd = -1;
+		*gen = cur;
+	}
+
+	if (*fd < 0)
+		*fd = open (sa->path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	return *fd;
+}
+
+int sysfs_attr_read (sysfs_attr_t *sa, char *buf, size_t size)
+{
+	if (g_sysfs_backend) {
+		int n = g_sysfs_backend->read (sa->path, buf, size);
+		if (n >= 0)
+			sysfs_attr_remember (sa, buf, n);
+		return n;
+	}
+
+	// sysfs regenerates attribute contents on every read from offset 0
+	int n = -1;
+	for (int retry = 0; (n < 0) && (retry < 2); retry++) {
+		int fd = sysfs_attr_fd (sa, false);
+		if (fd < 0)
+			return -1;
+
+		n = pread (fd, buf, size - 1, 0);
+		// the device may have gone away, reopen and try again
+		if (n < 0) {
+			close (sa->rfd);
+			sa->rfd = -1;
+		}
+	}
+
+	if (n < 0)
+		return -1;
+
+	buf [n] = 0;
+	capture_sysfs (CAP_SYSFS_READ, sa->path, buf, n);
+	// what we read is more recent than what we wrote
+	sysfs_attr_remember (sa, buf, n);
+	return n;
+}
+
+int sysfs_attr_reread (sysfs_attr_t *sa)
+{
+	// the read handle belongs to main thread, so read through a file of our own
+	char buf [sizeof (sa->value) + 1];
+	int n = sysfs_read_buf (sa->path, buf, sizeof (buf));
+	if (n >= 0)
+		sysfs_attr_remember (sa, buf, n);
+	return n;
+}
+
+int sysfs_attr_poll_fd (sysfs_attr_t *sa)
+{
+	// there's nothing to poll for attributes served by a backend
+	if (g_sysfs_backend)
+		return -1;
+
+	return sysfs_attr_fd (sa, false);
+}
+
+char *sysfs_attr_get_str (sysfs_attr_t *sa, char *buf, size_t size)
+{
+	int n = sysfs_attr_read (sa, buf, size);
+	if (n < 0) {
+		trace (1, "failed to read sysfs attr from %s\n", sa->path);
+		return NULL;
+	}
+
+	return sysfs_strip (buf, n);
+}
+
+int sysfs_attr_get_int (sysfs_attr_t *sa)
+{
+	char vals [64];
+	if (!sysfs_attr_get_str (sa, vals, sizeof (vals)))
+		return -1;
+
+	return sysfs_parse_int (vals);
+}
+
+int sysfs_attr_write (sysfs_attr_t *sa, const char *value)
+{
+	if (g_sysfs_backend)
+		return g_sysfs_backend->write (sa->path, value);
+
+	capture_sysfs (CAP_SYSFS_WRITE, sa->path, value, strlen (value));
+
+	int n = strlen (value);
+	for (int retry = 0; retry < 2; retry++) {
+		int fd = sysfs_attr_fd (sa, true);
+		if (fd < 0)
+			break;
+
+		if (pwrite (fd, value, n, 0) == n)
+			return 0;
+
+		close (sa->wfd);
+		sa->wfd = -1;
+	}
+
+	trace (1, "failed to write [%s] into %s\n", value, sa->path);
+	return -1;
+}
+
+int sysfs_attr_set (sysfs_attr_t *sa, const char *value)
+{
+	atomic_store (&sa->control, true);
+	if (sysfs_attr_holds (sa, value)) {
+		trace (2, "%s is already [%s]\n", sa->path, value);
+		atomic_fetch_add (&g_sysfs_writes_skipped, 1);
+		return 1;
+	}
+
+	return sysfs_attr_force (sa, value);
+}
+
+int sysfs_attr_force (sysfs_attr_t *sa, const char *value)
+{
+	atomic_store (&sa->control, true);
+	atomic_fetch_add (&g_sysfs_writes, 1);
+	if (sysfs_attr_write (sa, value) < 0) {
+		pthread_mutex_lock (&g_sysfs_value_lock);
+		sa->value [0] = 0;
+		pthread_mutex_unlock (&g_sysfs_value_lock);
+		return -1;
+	}
+
+	sysfs_attr_remember (sa, value, strlen (value));
+	return 0;
+}
+
+void sysfs_invalidate ()
+{
+	atomic_fetch_add (&g_sysfs_gen, 1);
+	sysfs_forget ();
+}
+
+void sysfs_forget ()
+{
+	atomic_fetch_add (&g_sysfs_value_gen, 1);
+}
+
+const char *sysfs_attr_known (sysfs_attr_t *sa, char *buf, size_t size)
+{
+	pthread_mutex_lock (&g_sysfs_value_lock);
+	bool known = atomic_load (&sa->control) && sa->value [0] &&
+		(sa->value_gen == atomic_load (&g_sysfs_value_gen));
+	if (known)
+		snprintf (buf, size, "%s", sa->value);
+	pthread_mutex_unlock (&g_sysfs_value_lock);
+	return known ? buf : NULL;
+}
+
+void sysfs_write_stats (uint32_t *written, uint32_t *skipped)
+{
+	*written = atomic_load (&g_sysfs_writes);
+	*skipped = atomic_load (&g_sysfs_writes_skipped);
+}
@@ -8,6 +8,109 @@
 #include "afrd.h"
 #include "uevent_filter.h"
 
+// characters having special meaning in extended regular expressions
+static const char *rex_special = ".[]()*+?{}|^$\\";
+
+// check if regular expression has an alternation outside of brackets and groups
+static bool rex_top_alternation (const char *rex)
+{
+	int depth = 0;
+	for (const char *cur = rex; *cur; cur++)
+		switch (*cur) {
+			case '\\':
+				if (cur [1])
+					cur++;
+				break;
+
+			case '[':
+				// a ']' right after '[' or '[^' is a literal
+				cur++;
+				if (*cur == '^')
+					cur++;
+				if (*cur == ']')
+					cur++;
+				cur += strcspn (cur, "]");
+				if (!*cur)
+					return false;
+				break;
+
+			case '(':
+				depth++;
+				break;
+
+			case ')':
+				if (depth)
+					depth--;
+				break;
+
+			case '|':
+				if (!depth)
+					return true;
+				break;
+		}
+
+	return false;
+}
+
+// return the length of the literal prefix of a regular expression
+static int rex_literal_len (const char *rex)
+{
+	// "abc|xyz" matches values not starting with "abc"
+	if (rex_top_alternation (rex))
+		return 0;
+
+	int len = strcspn (rex, rex_special);
+	// a quantifier after literal char makes that char optional
+	if (len && rex [len] && strchr ("*?{", rex [len]))
+		len--;
+	return len;
+}
+
+// find out the fastest way to match the regex
+static void classify_rex (uevent_filter_t *uevf, int idx, char *rex)
+{
+	int len = rex_literal_len (rex);
+
+	uevf->kind [idx] = UEVF_REGEX;
+	uevf->len [idx] = len;
+
+	if (!rex [len]) {
+		uevf->kind [idx] = UEVF_LITERAL;
+		return;
+	}
+
+	if ((rex [len] == '.') && (rex [len + 1] == '*') && !rex [len + 2]) {
+		uevf->kind [idx] = UEVF_PREFIX;
+		return;
+	}
+
+	// check for "(alt1|alt2|...)"
+	if (rex [0] != '(')
+		return;
+
+	int n = 1;
+	char *cur = rex + 1;
+	for (;;) {
+		cur += strcspn (cur, rex_special);
+		if (*cur == '|')
+			n++;
+		else if ((*cur == ')') && !cur [1])
+			break;
+		else
+			return;
+		cur++;
+	}
+
+	// split the alternatives into a sequence of zero-terminated strings
+	for (cur = rex + 1; *cur; cur++)
+		if ((*cur == '|') || (*cur == ')'))
+			*cur = 0;
+
+	uevf->kind [idx] = UEVF_ONEOF;
+	uevf->len [idx] = n;
+	uevf->rexval [idx] = rex + 1;
+}
+
 static bool append_rex (uevent_filter_t *uevf, char *str)
 {
 	if (uevf->size >= ARRAY_SIZE (uevf->attr)) {
@@ -32,12 +135,15 @@ static bool append_rex (uevent_filter_t *uevf, char *str)
 	trace (2, "\t+ %s=(%s)\n", str, eq);
 
 	uevf->attr [uevf->size] = str;
+	uevf->hash [uevf->size] = uevent_hash (str, strlen (str));
 	uevf->rexval [uevf->size] = eq;
 	if (regcomp (&uevf->rex [uevf->size], eq, REG_EXTENDED) != 0) {
 		trace (1, "\t  ignoring bad regex: %s\n", eq);
 		return false;
 	}
 
+	classify_rex (uevf, uevf->size, eq);
+
 	uevf->size++;
 	return true;
 }
@@ -89,22 +195,52 @@ bool uevent_filter_load (uevent_filter_t *uevf, const char *kw)
 void uevent_filter_reset (uevent_filter_t *uevf)
 {
 	uevf->matches = 0;
+	uevf->failed = false;
+}
+
+// check if value matches i-th attribute filter
+static bool rule_match (uevent_filter_t *uevf, int i, const char *value, size_t value_len)
+{
+	const char *rexval = uevf->rexval [i];
+	int len = uevf->len [i];
+
+	switch (uevf->kind [i]) {
+		case UEVF_LITERAL:
+			return (value_len == len) && (memcmp (value, rexval, len) == 0);
+
+		case UEVF_PREFIX:
+			return (value_len >= len) && (memcmp (value, rexval, len) == 0);
+
+		case UEVF_ONEOF:
+			for (; len; len--) {
+				if (strcmp (value, rexval) == 0)
+					return true;
+				rexval = strchr (rexval, 0) + 1;
+			}
+			return false;
+	}
+
+	// quickly reject values without the literal prefix
+	if ((value_len < len) || (memcmp (value, rexval, len) != 0))
+		return false;
+
+	regmatch_t match [1];
+	if (regexec (&uevf->rex [i], value, 1, match, 0) == REG_NOMATCH)
+		return false;
+	// must match whole line
+	return (match [0].rm_so == 0) && (match [0].rm_eo == value_len);
 }
 
 bool uevent_filter_match (uevent_filter_t *uevf, const char *attr, const char *value)
 {
 	for (int i = 0; i < uevf->size; i++)
 		if (strcmp (uevf->attr [i], attr) == 0) {
-			regmatch_t match [1];
-			if (regexec (&uevf->rex [i], value, 1, match, 0) == REG_NOMATCH)
-				continue;
-			// must match whole line
-			if (match [0].rm_so != 0 || match [0].rm_eo != strlen (value))
+			if (!rule_match (uevf, i, value, strlen (value)))
 				continue;
 
 			trace (3, "\t  matched filter %s\n", uevf->name);
 
-			uevf->matches++;
+			uevf->matches |= 1 << i;
 			return true;
 		}
 
@@ -113,5 +249,227 @@ bool uevent_filter_match (uevent_filter_t *uevf, const char *attr, const char *v
 
 bool uevent_filter_matched (uevent_filter_t *uevf)
 {
-	return uevf->size && (uevf->matches == uevf->size);
+	return uevf->size && !uevf->failed &&
+		(uevf->matches == (1U << uevf->size) - 1);
+}
+
+uint32_t uevent_hash (const char *str, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	while (len--)
+		hash = (hash ^ (uint8_t)*str++) * 16777619U;
+	return hash;
+}
+
+void uevent_classifier_init (uevent_classifier_t *uevc)
+{
+	memset (uevc, 0, sizeof (*uevc));
+	for (int i = 0; i < UEVENT_CLASSIFIER_BUCKETS; i++)
+		uevc->bucket [i] = -1;
+}
+
+bool uevent_classifier_add (uevent_classifier_t *uevc, uevent_filter_t *uevf)
+{
+	if (uevc->size >= UEVENT_CLASSIFIER_MAX)
+		return false;
+
+	int fidx = uevc->size++;
+	uevc->filter [fidx] = uevf;
+
+	for (int i = 0; i < uevf->size; i++) {
+		int b = uevf->hash [i] & (UEVENT_CLASSIFIER_BUCKETS - 1);
+		int r = uevc->refs++;
+		uevc->ref [r].filter = fidx;
+		uevc->ref [r].attr = i;
+		uevc->ref [r].next = uevc->bucket [b];
+		uevc->bucket [b] = r;
+	}
+
+	return true;
+}
+
+void uevent_classifier_reset (uevent_classifier_t *uevc)
+{
+	uevc->alive = 0;
+	for (int i = 0; i < uevc->size; i++) {
+		uevent_filter_t *uevf = uevc->filter [i];
+		uevent_filter_reset (uevf);
+		if (uevf->size)
+			uevc->alive |= 1 << i;
+	}
+}
+
+bool uevent_classifier_match (uevent_classifier_t *uevc, uint32_t hash,
+	const char *attr, const char *value, size_t value_len)
+{
+	// filters having this attribute, and filters that matched it
+	uint32_t seen = 0, hit = 0;
+
+	int b = hash & (UEVENT_CLASSIFIER_BUCKETS - 1);
+	for (int r = uevc->bucket [b]; r >= 0; r = uevc->ref [r].next) {
+		int fidx = uevc->ref [r].filter;
+		int i = uevc->ref [r].attr;
+		uevent_filter_t *uevf = uevc->filter [fidx];
+
+		if (!(uevc->alive & (1 << fidx)) ||
+		    (uevf->hash [i] != hash) ||
+		    (strcmp (uevf->attr [i], attr) != 0))
+			continue;
+
+		seen |= 1 << fidx;
+		if (rule_match (uevf, i, value, value_len)) {
+			hit |= 1 << fidx;
+			uevf->matches |= 1 << i;
+			trace (3, "\t  matched filter %s\n", uevf->name);
+		}
+	}
+
+	// the filters which have seen the attribute but didn't match it are out
+	uint32_t failed = seen & ~hit;
+	for (int i = 0; failed; i++, failed >>= 1)
+		if (failed & 1)
+			uevc->filter [i]->failed = true;
+
+	uevc->alive &= ~(seen & ~hit);
+	return (uevc->alive != 0);
+}
+
+/* --------- * --------- * --------- * --------- * --------- * --------- */
+
+// max length of uevent header prefix checked by BPF program
+#define BPF_PREFIX_MAX		64
+
+// append instruction to program, if there's space left
+#define BPF_EMIT(code, k, jt, jf) do { \
+	if (n < max) \
+		prog [n] = (struct sock_filter) BPF_JUMP ((code), (k), (jt), (jf)); \
+	n++; \
+} while (0)
+
+// build uevent header prefixes ("action@devpath") required by filter, and their lengths
+static int header_prefixes (uevent_filter_t *uevf, char pfx [][BPF_PREFIX_MAX + 1],
+	int *pfx_len, int max)
+{
+	int action = -1, devpath = -1;
+	for (int i = 0; i < uevf->size; i++)
+		if (strcmp (uevf->attr [i], "ACTION") == 0)
+			action = i;
+		else if (strcmp (uevf->attr [i], "DEVPATH") == 0)
+			devpath = i;
+
+	// without a known action we can't check anything in the header
+	if ((action < 0) ||
+	    ((uevf->kind [action] != UEVF_LITERAL) && (uevf->kind [action] != UEVF_ONEOF)))
+		return -1;
+
+	int dp_len = 0;
+	const char *dp = "";
+	if (devpath >= 0) {
+		dp = uevf->rexval [devpath];
+		dp_len = uevf->len [devpath];
+		// literal devpath must be followed by end of header
+		if (uevf->kind [devpath] == UEVF_LITERAL)
+			dp_len++;
+		else if (uevf->kind [devpath] == UEVF_ONEOF)
+			dp_len = 0;
+		// "abc|xyz" has no prefix common to all devpaths it matches
+		else if ((uevf->kind [devpath] == UEVF_REGEX) && rex_top_alternation (dp))
+			dp_len = 0;
+	}
+
+	int nact = (uevf->kind [action] == UEVF_ONEOF) ? uevf->len [action] : 1;
+	const char *act = uevf->rexval [action];
+	int n = 0;
+	for (; nact && (n < max); nact--, n++) {
+		int len = snprintf (pfx [n], BPF_PREFIX_MAX + 1, "%s@", act);
+		if (len > BPF_PREFIX_MAX)
+			len = BPF_PREFIX_MAX;
+		if (len + dp_len > BPF_PREFIX_MAX)
+			dp_len = BPF_PREFIX_MAX - len;
+		// the terminating zero of literal devpath is copied too
+		memcpy (pfx [n] + len, dp, dp_len);
+		pfx [n][len + dp_len] = 0;
+		pfx_len [n] = len + dp_len;
+		act = strchr (act, 0) + 1;
+	}
+
+	return n;
+}
+
+int uevent_classifier_bpf (uevent_classifier_t *uevc, struct sock_filter *prog, int max)
+{
+	char pfx [UEVENT_CLASSIFIER_MAX * 4][BPF_PREFIX_MAX + 1];
+	int pfx_len [UEVENT_CLASSIFIER_MAX * 4];
+	int npfx = 0;
+
+	for (int i = 0; i < uevc->size; i++) {
+		uevent_filter_t *uevf = uevc->filter [i];
+		if (!uevf->size)
+			continue;
+
+		int n = header_prefixes (uevf, pfx + npfx, pfx_len + npfx,
+			ARRAY_SIZE (pfx) - npfx);
+		if (n < 0)
+			return 0;
+		npfx += n;
+	}
+
+	if (!npfx)
+		return 0;
+
+	int n = 0;
+	for (int i = 0; i < npfx; i++) {
+		uint8_t *p = (uint8_t *)pfx [i];
+		int len = pfx_len [i];
+
+		// skip prefixes which are already covered by a shorter one
+		bool covered = false;
+		for (int j = 0; j < npfx && !covered; j++) {
+			int jlen = pfx_len [j];
+			covered = (j != i) && ((jlen < len) || ((jlen == len) && (j < i))) &&
+				(memcmp (pfx [j], p, jlen) == 0);
+		}
+		if (covered)
+			continue;
+
+		// number of instructions in this alternative after packet length check
+		int body = 2 * (len / 4) + ((len % 4 == 3) ? 4 : (len % 4) ? 2 : 0) + 1;
+		int alt_end = n + 2 + body;
+
+		// don't load bytes past the end of packet, that would drop it
+		BPF_EMIT (BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+		BPF_EMIT (BPF_JMP | BPF_JGE | BPF_K, len, 0, alt_end - n - 1);
+
+		for (int o = 0; o < len; o += 4) {
+			uint32_t w;
+			int size;
+			if (len - o >= 4) {
+				size = BPF_W;
+				w = (p [o] << 24) | (p [o + 1] << 16) | (p [o + 2] << 8) | p [o + 3];
+			} else if (len - o >= 2) {
+				// 2 or 3 bytes left, check the 3rd byte and load a halfword
+				size = BPF_H;
+				w = (p [o] << 8) | p [o + 1];
+				if (len - o == 3) {
+					BPF_EMIT (BPF_LD | BPF_B | BPF_ABS, o + 2, 0, 0);
+					BPF_EMIT (BPF_JMP | BPF_JEQ | BPF_K, p [o + 2], 0, alt_end - n - 1);
+				}
+			} else {
+				size = BPF_B;
+				w = p [o];
+			}
+
+			BPF_EMIT (BPF_LD | size | BPF_ABS, o, 0, 0);
+			BPF_EMIT (BPF_JMP | BPF_JEQ | BPF_K, w, 0, alt_end - n - 1);
+		}
+
+		// whole prefix matched, accept the packet
+		BPF_EMIT (BPF_RET | BPF_K, 0xffffffff, 0, 0);
+	}
+
+	// no prefix matched, drop the packet
+	BPF_EMIT (BPF_RET | BPF_K, 0, 0, 0);
+
+	return (n <= max) ? n : 0;
 }
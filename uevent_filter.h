@@ -8,26 +8,83 @@
 #ifndef __UEVENT_FILTER_H__
 #define __UEVENT_FILTER_H__
 
+#include <stdint.h>
 #include <regex.h>
+#include <linux/filter.h>
+
+/// Maximal number of attributes in a single filter
+#define UEVENT_FILTER_MAX		16
+
+/// The way attribute value is matched against filter
+typedef enum
+{
+	/// value must be equal to a literal string
+	UEVF_LITERAL,
+	/// value must start with a literal string (filter was "prefix.*")
+	UEVF_PREFIX,
+	/// value must be equal to one of literal strings (filter was "(a|b|c)")
+	UEVF_ONEOF,
+	/// generic regular expression, literal prefix is checked first
+	UEVF_REGEX,
+} uevent_match_t;
 
 typedef struct
 {
 	// Attribute names
-	const char *attr [16];
+	const char *attr [UEVENT_FILTER_MAX];
+	// Attribute name hashes
+	uint32_t hash [UEVENT_FILTER_MAX];
+	// How attribute value is matched (uevent_match_t)
+	uint8_t kind [UEVENT_FILTER_MAX];
+	// Length of literal value or literal prefix (number of strings for UEVF_ONEOF)
+	int len [UEVENT_FILTER_MAX];
 	// Regular expressions for attribute values
-	regex_t rex [16];
+	regex_t rex [UEVENT_FILTER_MAX];
 	// Regex value
-	const char *rexval [16];
+	const char *rexval [UEVENT_FILTER_MAX];
 	// Filter name
 	char *name;
 	// Original filter string, modified for our needs
 	char *filter;
 	// Number of attributes
 	int size;
-	// Number of matches since last reset
-	int matches;
+	// Bitmask of matched attributes since last reset
+	uint32_t matches;
+	// Set if an attribute has been seen with a non-matching value
+	bool failed;
 } uevent_filter_t;
 
+/// Maximal number of filters in a classifier
+#define UEVENT_CLASSIFIER_MAX		8
+/// Number of hash buckets, must be a power of two
+#define UEVENT_CLASSIFIER_BUCKETS	64
+
+/**
+ * A set of filters compiled into a single attribute dispatch table.
+ * Every uevent attribute is hashed once and checked only against
+ * the filter rules with same attribute name; as soon as no filter
+ * has a chance to match, the rest of uevent can be skipped.
+ */
+typedef struct
+{
+	// The filters in this classifier
+	uevent_filter_t *filter [UEVENT_CLASSIFIER_MAX];
+	// Number of filters
+	int size;
+	// Index of first rule reference in every bucket, -1 if empty
+	int16_t bucket [UEVENT_CLASSIFIER_BUCKETS];
+	// Rule references: filter index, attribute index and next in chain
+	struct {
+		uint8_t filter;
+		uint8_t attr;
+		int16_t next;
+	} ref [UEVENT_CLASSIFIER_MAX * UEVENT_FILTER_MAX];
+	// Number of used rule references
+	int refs;
+	// Bitmask of filters that still may match current uevent
+	uint32_t alive;
+} uevent_classifier_t;
+
 /// Initialize an uEvent filter object from filter expression string
 extern bool uevent_filter_init (uevent_filter_t *uevf, const char *name, const char *filter);
 /// Finalize an uEvent filter
@@ -41,6 +98,22 @@ extern bool uevent_filter_match (uevent_filter_t *uevf, const char *attr, const
 /// Check if all attributes were matched
 extern bool uevent_filter_matched (uevent_filter_t *uevf);
 
+/// Compute the hash of uevent attribute name
+extern uint32_t uevent_hash (const char *str, size_t len);
+/// Initialize an empty classifier
+extern void uevent_classifier_init (uevent_classifier_t *uevc);
+/// Add a loaded filter to the classifier
+extern bool uevent_classifier_add (uevent_classifier_t *uevc, uevent_filter_t *uevf);
+/// Reset classifier and all its filters before parsing a new uevent
+extern void uevent_classifier_reset (uevent_classifier_t *uevc);
+/// Match attribute against all filters, return false if no filter can match anymore
+extern bool uevent_classifier_match (uevent_classifier_t *uevc, uint32_t hash,
+	const char *attr, const char *value, size_t value_len);
+
+/// Generate a classic BPF program that drops uevents no filter can match,
+/// returns number of instructions or 0 if filters can't be checked by BPF
+extern int uevent_classifier_bpf (uevent_classifier_t *uevc, struct sock_filter *prog, int max);
+
 /// Helper function
 void strip_trailing_spaces (char *eol, const char *start);
 /// The list of spaces characters
@@ -0,0 +1,222 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Watching sysfs attributes for changes.
+ *
+ * Drivers tell about attribute changes with sysfs_notify(), which
+ * makes poll() return POLLPRI|POLLERR on the attribute file until it
+ * is read again. Attributes that are not on sysfs, and module
+ * parameters, never notify: only these are re-read on a timer.
+ */
+
+#include "afrd.h"
+#include "watch.h"
+#include "actuator.h"
+#include "crc32.h"
+
+#include <sys/vfs.h>
+
+#ifndef SYSFS_MAGIC
+#define SYSFS_MAGIC		0x62656572
+#endif
+
+typedef struct
+{
+	sysfs_attr_t *sa;
+	watch_cb_t cb;
+	/// re-read period if attribute does not notify, ms
+	int poll_ms;
+	/// true if attribute is known not to notify
+	bool polled;
+	/// true after first notification has been seen
+	bool notified;
+	/// notification has to be handled after actuator completes
+	bool pending;
+	/// when to re-read a polled attribute
+	mstime_t next;
+	/// crc32 of the last value read
+	uint32_t crc;
+} watch_t;
+
+static watch_t g_watch [WATCH_MAX];
+static int g_watch_n = 0;
+
+static watch_t *watch_find (sysfs_attr_t *sa)
+{
+	for (int i = 0; i < g_watch_n; i++)
+		if (g_watch [i].sa == sa)
+			return &g_watch [i];
+	return NULL;
+}
+
+// check if attribute can notify about changes at all
+static bool watch_can_notify (sysfs_attr_t *sa)
+{
+	int fd = sysfs_attr_poll_fd (sa);
+	if (fd < 0)
+		return false;
+
+	// module parameters are plain variables, nobody notifies about them
+	if (strncmp (sa->path, "/sys/module/", 12) == 0)
+		return false;
+
+	struct statfs sfs;
+	return (fstatfs (fd, &sfs) == 0) && (sfs.f_type == SYSFS_MAGIC);
+}
+
+// read the attribute and report it, return false if it can't be read
+static bool watch_read (watch_t *w, bool notify)
+{
+	w->pending = false;
+
+	// control attributes changed by us are not a change
+	char known [sizeof (w->sa->value)];
+	const char *k = sysfs_attr_known (w->sa, known, sizeof (known));
+
+	char buff [512];
+	int n = sysfs_attr_read (w->sa, buff, sizeof (buff));
+	if (n < 0)
+		return false;
+
+	while (n && strchr (spaces, buff [n - 1]))
+		n--;
+	buff [n] = 0;
+
+	uint32_t crc = crc32_finish (crc32_update (CRC32_START, buff, n));
+	bool changed = k ? (strcmp (buff, known) != 0) : (crc != w->crc);
+	w->crc = crc;
+
+	if (notify && !w->notified) {
+		trace (2, "%s notifies about changes\n", w->sa->path);
+		w->notified = true;
+	}
+
+	w->cb (w->sa, buff, changed);
+	return true;
+}
+
+void watch_add (sysfs_attr_t *sa, int poll_ms, watch_cb_t cb)
+{
+	if (!sa->path [0])
+		return;
+
+	watch_t *w = watch_find (sa);
+	if (!w) {
+		if (g_watch_n >= WATCH_MAX) {
+			trace (0, "too many watched attributes, not watching %s\n", sa->path);
+			return;
+		}
+		w = &g_watch [g_watch_n++];
+	}
+
+	memset (w, 0, sizeof (*w));
+	w->sa = sa;
+	w->cb = cb;
+	w->poll_ms = poll_ms;
+	w->polled = !watch_can_notify (sa);
+	if (w->polled && poll_ms)
+		mstime_arm (&w->next, poll_ms);
+
+	// remember current value to tell changes later
+	char buff [512];
+	int n = sysfs_attr_read (sa, buff, sizeof (buff));
+	if (n >= 0) {
+		while (n && strchr (spaces, buff [n - 1]))
+			n--;
+		w->crc = crc32_finish (crc32_update (CRC32_START, buff, n));
+	}
+
+	if (w->polled && poll_ms)
+		trace (2, "%s does not notify about changes, will read it every %d ms\n",
+			sa->path, poll_ms);
+}
+
+void watch_remove (sysfs_attr_t *sa)
+{
+	watch_t *w = watch_find (sa);
+	if (!w)
+		return;
+
+	*w = g_watch [--g_watch_n];
+}
+
+int watch_prep_poll (struct pollfd *pfd, int max)
+{
+	int n = 0;
+	for (int i = 0; (i < g_watch_n) && (n < max); i++) {
+		watch_t *w = &g_watch [i];
+		if (w->polled || w->pending)
+			continue;
+
+		int fd = sysfs_attr_poll_fd (w->sa);
+		if (fd < 0)
+			continue;
+
+		pfd [n].fd = fd;
+		pfd [n].events = POLLPRI;
+		pfd [n].revents = 0;
+		n++;
+	}
+
+	return n;
+}
+
+void watch_handle (struct pollfd *pfd, int pfd_count)
+{
+	for (; pfd_count; pfd++, pfd_count--) {
+		if ((pfd->fd < 0) || !(pfd->revents & (POLLPRI | POLLERR)))
+			continue;
+
+		for (int i = 0; i < g_watch_n; i++) {
+			watch_t *w = &g_watch [i];
+			if (w->polled || (pfd->fd != w->sa->rfd))
+				continue;
+
+			// the actuator thread may be writing it right now
+			if (w->sa->control && actuator_busy ())
+				w->pending = true;
+			else
+				watch_read (w, true);
+			break;
+		}
+	}
+}
+
+int watch_timeout ()
+{
+	int to = -1;
+	for (int i = 0; i < g_watch_n; i++) {
+		watch_t *w = &g_watch [i];
+		int left = -1;
+		if (w->pending)
+			left = actuator_busy () ? -1 : 0;
+		else if (w->polled && w->poll_ms)
+			left = mstime_left (&w->next);
+
+		if ((left >= 0) && ((to < 0) || (left < to)))
+			to = left;
+	}
+
+	return to;
+}
+
+void watch_timers ()
+{
+	// callbacks may add or remove watches, so restart after every one
+	for (int i = 0; i < g_watch_n; i++) {
+		watch_t *w = &g_watch [i];
+		if (w->pending) {
+			if (actuator_busy ())
+				continue;
+		} else if (!w->polled || !w->poll_ms || !mstime_expired (&w->next))
+			continue;
+
+		if (w->polled && w->poll_ms)
+			mstime_arm (&w->next, w->poll_ms);
+		watch_read (w, w->pending);
+		i = -1;
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * Automatic Framerate Daemon for AMLogic S905/S912-based boxes.
+ * Copyright (C) 2017-2019 Andrey Zabolotnyi <zapparello@ya.ru>
+ *
+ * For copying conditions, see file COPYING.txt.
+ *
+ * Watching sysfs attributes for changes
+ */
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include <stdbool.h>
+#include <poll.h>
+#include "afrd.h"
+
+/// Maximal number of attributes watched at once
+#define WATCH_MAX		8
+
+/**
+ * Called when a watched attribute has been read after a change notification
+ * or on the poll timer. changed is false if it holds the same value as before
+ * (for control attributes: the value afrd has set itself).
+ */
+typedef void (*watch_cb_t) (sysfs_attr_t *sa, const char *value, bool changed);
+
+/// start watching attribute; poll_ms is the period to re-read it if it is
+/// known not to notify about changes, 0 to rely on notifications only
+extern void watch_add (sysfs_attr_t *sa, int poll_ms, watch_cb_t cb);
+/// stop watching attribute
+extern void watch_remove (sysfs_attr_t *sa);
+/// add watched attributes to poll set, return number of entries used
+extern int watch_prep_poll (struct pollfd *pfd, int max);
+/// read the attributes that have notified about changes
+extern void watch_handle (struct pollfd *pfd, int pfd_count);
+/// milliseconds until some attribute has to be re-read, -1 if none
+extern int watch_timeout ();
+/// re-read the attributes whose time has come
+extern void watch_timers ();
+
+#endif /* __WATCH_H__ */